@@ -51,6 +51,18 @@ local userDotInRequire = true;         --兼容require中使用 require(a.b) 和
 local traversalUserData = false;        --如果可以的话(取决于userdata原表中的__pairs)，展示userdata中的元素。 如果在调试器中展开userdata时有错误，请关闭此项.
 local customGetSocketInstance = nil;    --支持用户实现一个自定义调用luasocket的函数，函数返回值必须是一个socket实例。例: function() return require("socket.core").tcp() end;
 local consoleLogLevel = 2;           --打印在控制台(print)的日志等级 0 : all/ 1: info/ 2: error.
+local logPointRateLimit = 20;        --使用hookLib时，每个记录点每秒最多输出的条数，超出的会被丢弃并计数。0表示不限制
+local logPointFlushInterval = 200;   --使用hookLib时，记录点输出在缓冲区中最多保留的时间(ms)，之后批量发送。0表示不缓冲
+local logPointBufferLines = 128;     --使用hookLib时，记录点缓冲区的行数
+local messagePollInterval = 100;     --使用hookLib时，运行中接收VSCode消息(新断点,暂停等)的间隔(ms)
+local hookInstructionBudget = 100000; --使用hookLib时，每执行多少条指令检查一次消息，保证死循环中也能暂停。0表示不检查
+local useNativeTransport = false;    --使用hookLib时，由hookLib的后台线程接收VSCode消息，运行中不再轮询socket。需要luasocket支持getfd
+local attachListenPort = 0;          --使用hookLib时，未连接调试器时不安装hook，由后台线程监听127.0.0.1的该端口，有连接(如 nc 127.0.0.1 端口)时再发起attach。0表示不使用，仍定时尝试attach
+local variableMaxDepth = 64;         --使用hookLib时，变量可以逐层展开的最大深度。0表示不限制
+local variableMaxChildren = 5000;    --使用hookLib时，一次展开变量显示的最大成员数，超出的部分被截断。0表示不限制
+local variableMaxStringLen = 10000;  --使用hookLib时，变量中字符串显示的最大长度。0表示不限制
+local variableTimeBudget = 500;      --使用hookLib时，一次展开变量的最长时间(ms)，超时的部分被截断。0表示不限制
+local variablePageSize = 1000;       --使用hookLib时，成员数超过该值的table在VSCode中分页展开。0表示不分页
 --用户设置项END
 
 local debuggerVer = "3.3.1";                 --debugger版本号
@@ -118,6 +130,8 @@ local variableRefTab = {};      --变量记录table
 local lastRunFilePath = "";     --最后执行的文件路径
 local pathCaseSensitivity = true;  --路径是否发大小写敏感，这个选项接收VScode设置，请勿在此处更改
 local recvMsgQueue = {};        --接收的消息队列
+local nativeTransportOn = false;  --是否由hookLib后台线程接收消息
+local attachListenerOn = false;   --hookLib是否在监听attach请求
 local coroutinePool = setmetatable({}, {__mode = "v"});       --保存用户协程的队列
 local winDiskSymbolUpper = false;--设置win下盘符的大小写。以此确保从VSCode中传入的断点路径,cwd和从lua虚拟机获得的文件路径盘符大小写一致
 local isNeedB64EncodeStr = false;-- 记录是否使用base64编码字符串
@@ -330,6 +344,10 @@ function this.stopAttach()
     openAttachMode = false;
     this.printToConsole("Debugger stopAttach", 1);
     this.clearData()
+    if attachListenerOn then
+        hookLib.attach_unlisten();
+        attachListenerOn = false;
+    end
     this.changeHookState( hookState.DISCONNECT_HOOK );
     stopConnectTime = os.time();
     this.changeRunState(runState.DISCONNECT);
@@ -348,6 +366,10 @@ function this.disconnect()
     this.changeRunState(runState.DISCONNECT);
 
     if sock ~= nil then
+        if nativeTransportOn then
+            hookLib.transport_detach();
+            nativeTransportOn = false;
+        end
         sock:close();
         sock = nil;
         server = nil;
@@ -666,10 +688,401 @@ function this.getInfo()
         strTable[#strTable + 1] = '\n' .. pathErrTip;
     end
 
+    if hookLib ~= nil and hookLib.get_pathcache_stats then
+        local hit, miss, size, capacity = hookLib.get_pathcache_stats();
+        strTable[#strTable + 1] = "\nhookLib path cache: hit:" .. tostring(hit) .. " | miss:" .. tostring(miss) .. " | size:" .. tostring(size) .. "/" .. tostring(capacity);
+    end
+
+    if hookLib ~= nil and hookLib.get_callback_stats then
+        local stats = hookLib.get_callback_stats();
+        local names = {};
+        for name, _ in pairs(stats) do
+            names[#names + 1] = name;
+        end
+        table.sort(names, function(a, b) return stats[a].time > stats[b].time end);
+        strTable[#strTable + 1] = "\nhookLib callbacks:";
+        for _, name in ipairs(names) do
+            local item = stats[name];
+            strTable[#strTable + 1] = "\n    " .. name .. " | calls:" .. tostring(item.calls) .. " | errors:" .. tostring(item.errors) .. " | time:" .. string.format("%.3f", item.time) .. "ms";
+        end
+    end
+
     strTable[#strTable + 1] = "\n\n- Breaks Info: \nUse 'LuaPanda.getBreaks()' to watch.";
     return table.concat(strTable);
 end
 
+-- 开始采样分析(需使用c hook库，在LuaPanda.start之后调用)
+-- @mode "count":每interval条虚拟机指令采样一次 / "timer":每interval微秒采样一次
+-- @interval 采样间隔，不填使用默认值1000
+function this.startProfiler(mode, interval)
+    if hookLib == nil or hookLib.profiler_start == nil then
+        this.printToConsole("[profiler] 采样分析需要使用c hook库", 2);
+        return false;
+    end
+    hookLib.profiler_start(mode or "count", interval or 0);
+    return true;
+end
+
+-- 停止采样分析，返回采样总次数
+function this.stopProfiler()
+    if hookLib == nil or hookLib.profiler_stop == nil then
+        return 0;
+    end
+    return hookLib.profiler_stop();
+end
+
+-- 把采样结果写入临时文件目录，返回文件路径
+-- @format "folded":火焰图使用的folded stacks / "pprof":pprof格式
+function this.dumpProfiler(format)
+    if hookLib == nil or hookLib.profiler_dump == nil then
+        return nil, "hookLib not loaded";
+    end
+    return hookLib.profiler_dump(format or "folded");
+end
+
+-- 开始统计每个函数的调用次数和耗时(需使用c hook库，在LuaPanda.start之后调用)
+function this.startTrace()
+    if hookLib == nil or hookLib.trace_start == nil then
+        this.printToConsole("[trace] 函数耗时统计需要使用c hook库", 2);
+        return false;
+    end
+    hookLib.trace_start();
+    return true;
+end
+
+-- 停止统计函数耗时
+function this.stopTrace()
+    if hookLib ~= nil and hookLib.trace_stop ~= nil then
+        hookLib.trace_stop();
+    end
+end
+
+-- 返回按自身耗时排序的统计结果 {source, linedefined, calls, inclusive, exclusive}，耗时单位为毫秒
+-- @limit 最多返回的函数个数，不填返回全部
+function this.getTraceStats(limit)
+    if hookLib == nil or hookLib.get_trace_stats == nil then
+        return {};
+    end
+    return hookLib.get_trace_stats(limit or 0);
+end
+
+-- 把函数耗时统计写入临时文件目录，返回文件路径
+-- @format "csv" / "json"
+function this.dumpTrace(format)
+    if hookLib == nil or hookLib.trace_dump == nil then
+        return nil, "hookLib not loaded";
+    end
+    return hookLib.trace_dump(format or "csv");
+end
+
+-- 开始收集行覆盖率(需使用c hook库，在LuaPanda.start之后调用)
+-- @countHits 是否记录每行的执行次数
+-- @useActivelines 是否在函数首次执行时标记其所有可执行的行，未执行的行也会出现在结果中
+function this.startCoverage(countHits, useActivelines)
+    if hookLib == nil or hookLib.coverage_start == nil then
+        this.printToConsole("[coverage] 覆盖率需要使用c hook库", 2);
+        return false;
+    end
+    hookLib.coverage_start(countHits == true, useActivelines == true);
+    return true;
+end
+
+-- 停止收集覆盖率
+function this.stopCoverage()
+    if hookLib ~= nil and hookLib.coverage_stop ~= nil then
+        hookLib.coverage_stop();
+    end
+end
+
+-- 把覆盖率写入临时文件目录，返回文件路径
+-- @format "lcov" / "cobertura"
+function this.dumpCoverage(format)
+    if hookLib == nil or hookLib.coverage_dump == nil then
+        return nil, "hookLib not loaded";
+    end
+    return hookLib.coverage_dump(format or "lcov");
+end
+
+-- 开始统计内存分配(需使用c hook库，在LuaPanda.start之后调用)
+-- @sampleBytes 每分配多少字节采样一次，不填为8192，<=0表示每次分配都记录
+function this.startAllocProfiler(sampleBytes)
+    if hookLib == nil or hookLib.alloc_profiler_start == nil then
+        this.printToConsole("[alloc] 内存分配统计需要使用c hook库", 2);
+        return false;
+    end
+    return hookLib.alloc_profiler_start(sampleBytes or 8192) == 1;
+end
+
+-- 停止统计内存分配
+function this.stopAllocProfiler()
+    if hookLib ~= nil and hookLib.alloc_profiler_stop ~= nil then
+        hookLib.alloc_profiler_stop();
+    end
+end
+
+-- 返回按存活字节数排序的分配位置 {site, live, total, samples}
+-- @limit 最多返回的个数，不填返回全部
+function this.getAllocStats(limit)
+    if hookLib == nil or hookLib.get_alloc_stats == nil then
+        return {};
+    end
+    return hookLib.get_alloc_stats(limit or 0);
+end
+
+-- 记录当前各分配位置的存活字节数，返回快照id
+function this.allocSnapshot()
+    if hookLib == nil or hookLib.alloc_snapshot == nil then
+        return nil;
+    end
+    return hookLib.alloc_snapshot();
+end
+
+-- 返回两个快照间增长的分配位置 {site, growth, before, after}，按增长字节数排序
+-- @toId 不填表示和当前比较
+function this.allocSnapshotDiff(fromId, toId, limit)
+    if hookLib == nil or hookLib.alloc_snapshot_diff == nil then
+        return nil;
+    end
+    return hookLib.alloc_snapshot_diff(fromId, toId or 0, limit or 0);
+end
+
+-- 生成内存快照，写入临时文件目录。返回文件路径, 对象数, 估算的总字节数
+-- @name 快照名，文件名为 luapanda_heap_<name>.txt
+function this.heapSnapshot(name)
+    if hookLib == nil or hookLib.heap_snapshot == nil then
+        return nil, "hookLib not loaded";
+    end
+    return hookLib.heap_snapshot(tostring(name or os.time()));
+end
+
+-- 比较两个内存快照文件，返回增长最多的对象 {grown = {path, type, before, after, newChildren, newChildBytes, growth}, newObjects, newBytes, freedObjects, freedBytes}
+function this.heapSnapshotDiff(oldPath, newPath, limit)
+    if hookLib == nil or hookLib.heap_snapshot_diff == nil then
+        return nil, "hookLib not loaded";
+    end
+    return hookLib.heap_snapshot_diff(oldPath, newPath, limit or 0);
+end
+
+-- hook开销测试用例。作为独立的chunk加载，避免被hook当作调试器自身的代码跳过
+local benchmarkSource = [[
+local workloads = {};
+local function fib(n)
+    if n < 2 then return n end
+    return fib(n - 1) + fib(n - 2);
+end
+workloads[#workloads + 1] = { "call", function(n)
+    local s = 0;
+    for i = 1, n * 100 do
+        s = s + fib(15);
+    end
+    return s;
+end };
+workloads[#workloads + 1] = { "loop", function(n)
+    local s = 0;
+    for i = 1, n * 1000000 do
+        s = s + i % 7;
+    end
+    return s;
+end };
+workloads[#workloads + 1] = { "coroutine", function(n)
+    local co = coroutine.wrap(function()
+        while true do
+            coroutine.yield(1);
+        end
+    end);
+    local s = 0;
+    for i = 1, n * 100000 do
+        s = s + co();
+    end
+    return s;
+end };
+workloads[#workloads + 1] = { "string", function(n)
+    local parts = {};
+    for i = 1, n * 50000 do
+        local str = string.format("%d:%s", i, "luapanda");
+        parts[#parts + 1] = str:sub(1, 4) .. str:upper():len();
+        if #parts > 100 then
+            parts = {};
+        end
+    end
+    return #parts;
+end };
+return workloads;
+]];
+
+-- 生成count个不会命中的断点，用来测量断点数量对hook的影响
+-- 一半放在用例文件中：先放在用例函数内没有代码的行(使函数所在范围有断点，走逐行判断)，其余放在文件末尾之后的行
+-- 另一半分布在不会执行的文件中
+-- @benchPath 用例文件的路径
+-- @inLines 用例函数内没有代码的行
+-- @lastLine 用例文件的行数
+local function benchmarkBreaks(count, benchPath, inLines, lastLine)
+    local benchBreaks = {};
+    local function addBreak(path, fullpath, line)
+        if benchBreaks[path] == nil then
+            benchBreaks[path] = { [fullpath] = {} };
+        end
+        local bks = benchBreaks[path][fullpath];
+        bks[#bks + 1] = { line = line, type = 2 };
+    end
+    local fileCount = math.floor(count / 2);
+    for i = 0, count - fileCount - 1 do
+        local line = inLines[i + 1] or lastLine + i + 1;
+        addBreak(benchPath, benchPath, line);
+    end
+    for i = 0, fileCount - 1 do
+        local path = "/luapanda_benchmark/file" .. tostring(math.floor(i / 10)) .. ".lua";
+        addBreak(path, path, i % 10 + 1);
+    end
+    return benchBreaks;
+end
+
+-- 取中位数
+local function benchmarkMedian(values)
+    table.sort(values);
+    local n = #values;
+    if n % 2 == 1 then
+        return values[(n + 1) / 2];
+    end
+    return (values[n / 2] + values[n / 2 + 1]) / 2;
+end
+
+-- 测量hook开销(需使用c hook库，在未连接调试器时调用)
+-- 在无hook、attach等待(DISCONNECT_HOOK)和各hook状态下，分别设置0/10/1000个不会命中的断点运行调用、循环、协程、字符串密集的用例
+-- 单步状态(STEPOVER/STEPIN/STEPOUT)下用替换的SendMsgWithStack模拟停止后立即继续单步，测量单步判断和停止的开销
+-- 每个用例先单独运行一次统计hook事件数(兼作预热)，再在关闭hook统计时计时reps次取中位数，避免统计本身的计时计入耗时
+-- 输出耗时、相对无hook的倍数和每个hook事件的平均额外耗时(ns)。结束后恢复为未连接状态
+-- @scale 用例规模倍数，不填为1
+-- @reps 每个用例计时的次数，不填为5
+-- 返回结果数组 {state, breakpoints, workload, time(ms), slowdown, events, nsPerEvent}
+function this.benchmarkHook(scale, reps)
+    if hookLib == nil or hookLib.get_hook_stats == nil then
+        this.printToConsole("[benchmark] hook开销测试需要使用c hook库", 2);
+        return nil;
+    end
+    if currentRunState ~= nil and currentRunState ~= runState.DISCONNECT then
+        this.printToConsole("[benchmark] 请在未连接调试器时进行hook开销测试", 2);
+        return nil;
+    end
+    scale = tonumber(scale) or 1;
+    reps = math.max(math.floor(tonumber(reps) or 5), 1);
+    local chunk, err = debugger_loadString(benchmarkSource, "@LuaPandaBenchmark.lua");
+    if chunk == nil then
+        this.printToConsole("[benchmark] load workloads error: " .. tostring(err), 2);
+        return nil;
+    end
+    local workloads = chunk();
+
+    -- 未连接过调试器时(如用tryRequireClib加载c库后直接测试)，同步断点格式和debugger路径
+    if hookLib.sync_lua_debugger_ver then
+        local verTable = this.stringSplit(debuggerVer, '%.');
+        hookLib.sync_lua_debugger_ver(verTable[1] * 10000 + verTable[2] * 100 + verTable[3]);
+    end
+    if DebuggerFileName == "" then
+        hookLib.sync_debugger_path(tostring(debug.getinfo(1, "S").source));
+    end
+
+    -- 用例函数内没有代码的行
+    local inLines = {};
+    for _, workload in ipairs(workloads) do
+        local info = debug.getinfo(workload[2], "SL");
+        for line = info.linedefined + 1, info.lastlinedefined - 1 do
+            if not info.activelines[line] then
+                inLines[#inLines + 1] = line;
+            end
+        end
+    end
+    local _, lastLine = string.gsub(benchmarkSource, "\n", "\n");
+
+    -- 各hook状态在运行状态(RUN)下测量，和连接后运行时一样按断点位置调整hook状态
+    local configs = { { name = "NO_HOOK", bks = 0, run = runState.DISCONNECT },
+        { name = "DISCONNECT_HOOK", state = hookState.DISCONNECT_HOOK, bks = 0, run = runState.DISCONNECT } };
+    for _, stateName in ipairs({ "LITE_HOOK", "MID_HOOK", "ALL_HOOK" }) do
+        for _, bkCount in ipairs({ 0, 10, 1000 }) do
+            configs[#configs + 1] = { name = stateName, state = hookState[stateName], bks = bkCount, run = runState.RUN };
+        end
+    end
+    for _, stepName in ipairs({ "STEPOVER", "STEPIN", "STEPOUT" }) do
+        configs[#configs + 1] = { name = stepName, state = hookState.ALL_HOOK, bks = 0, run = runState[stepName] };
+    end
+
+    -- 测试期间不发起连接、不接收消息，单步停止后直接继续单步
+    -- 未连接时没有路径配置，路径只去掉开头的@，和测试断点表中的路径一致。结束后清空c中按此缓存的路径
+    local savedReConnect = this.reConnect;
+    local savedSendMsgWithStack = this.SendMsgWithStack;
+    local savedGetPath = this.getPath;
+    local savedWaitMsg = this.debugger_wait_msg;
+    local benchRunState = runState.DISCONNECT;
+    this.reConnect = function() return 0; end
+    this.debugger_wait_msg = function() end
+    this.SendMsgWithStack = function() hookLib.lua_set_runstate(benchRunState); end
+    this.getPath = function(info)
+        local filePath = type(info) == "table" and info.source or info;
+        return (string.gsub(filePath, "^@", ""));
+    end
+    hookLib.rebind_callbacks();
+    hookLib.clear_pathcache();
+
+    local results = {};
+    local baseTime = {};
+    local lines = { "\n[benchmark] state | breakpoints | workload | time(ms) | slowdown | events | ns/event" };
+    for _, config in ipairs(configs) do
+        if config.state == nil then
+            hookLib.endHook();
+        else
+            this.breaks = benchmarkBreaks(config.bks, "LuaPandaBenchmark.lua", inLines, lastLine + 1);
+            hookLib.sync_breakpoints();
+            hookLib.lua_set_hookstate(config.state);
+        end
+        benchRunState = config.run;
+        for _, workload in ipairs(workloads) do
+            -- 统计事件数，同时作为预热
+            hookLib.lua_set_runstate(benchRunState);
+            hookLib.hook_stats_start();
+            workload[2](scale);
+            hookLib.hook_stats_stop();
+            local stats = hookLib.get_hook_stats();
+            -- 计时
+            local times = {};
+            for rep = 1, reps do
+                -- 每次从相同的gc状态开始，减少字符串用例的波动
+                collectgarbage("collect");
+                hookLib.lua_set_runstate(benchRunState);
+                local startTime = os.clock();
+                workload[2](scale);
+                times[rep] = (os.clock() - startTime) * 1000;
+            end
+            local costTime = benchmarkMedian(times);
+            if config.state == nil then
+                baseTime[workload[1]] = costTime;
+            end
+            local base = baseTime[workload[1]];
+            local nsPerEvent = 0;
+            if base and stats.events > 0 then
+                nsPerEvent = math.max(costTime - base, 0) * 1000000 / stats.events;
+            end
+            local item = { state = config.name, breakpoints = config.bks, workload = workload[1], time = costTime,
+                slowdown = (base and base > 0) and costTime / base or 1, events = stats.events, nsPerEvent = nsPerEvent };
+            results[#results + 1] = item;
+            lines[#lines + 1] = string.format("%s | %d | %s | %.2f | %.2fx | %d | %.1f", item.state, item.breakpoints, item.workload, item.time, item.slowdown, item.events, item.nsPerEvent);
+        end
+    end
+
+    -- 恢复断点和未连接状态
+    this.reConnect = savedReConnect;
+    this.SendMsgWithStack = savedSendMsgWithStack;
+    this.getPath = savedGetPath;
+    this.debugger_wait_msg = savedWaitMsg;
+    hookLib.rebind_callbacks();
+    hookLib.clear_pathcache();
+    hookLib.lua_set_runstate(runState.DISCONNECT);
+    this.breaks = breaks;
+    hookLib.sync_breakpoints();
+    this.changeHookState(hookState.DISCONNECT_HOOK);
+    this.printToConsole(table.concat(lines, "\n"), 2);
+    return results;
+end
+
 --判断是否在协程中
 function this.isInMain()
     return isInMainThread;
@@ -967,6 +1380,38 @@ function this.reGetSock()
     return true;
 end
 
+-- 把socket的消息接收交给hookLib的后台线程, 发送仍使用sock
+-- luasocket缓冲区中还有未读数据时不切换, 避免丢失消息
+function this.attachNativeTransport()
+    if nativeTransportOn or hookLib == nil or hookLib.transport_attach == nil or sock == nil then
+        return;
+    end
+    if sock.getfd == nil or sock.dirty == nil or sock:dirty() then
+        this.printToVSCode("native transport not available, use luasocket to receive message", 1);
+        return;
+    end
+    nativeTransportOn = hookLib.transport_attach(sock:getfd()) == 1;
+end
+
+-- 开始监听attach请求, 返回是否在监听
+function this.startAttachListener()
+    if not attachListenerOn and attachListenPort > 0 and hookLib ~= nil and hookLib.attach_listen ~= nil then
+        attachListenerOn = hookLib.attach_listen(attachListenPort) == 1;
+        if not attachListenerOn then
+            this.printToConsole("[Warning] attach listen on port " .. tostring(attachListenPort) .. " failed, use timed attach", 1);
+        end
+    end
+    return attachListenerOn;
+end
+
+-- hookLib收到attach请求后调用, 立即尝试连接。失败时回到等待状态(只保留统计需要的hook)
+function this.attachNow()
+    stopConnectTime = 0;
+    if this.reConnect() == 0 and currentHookState == hookState.DISCONNECT_HOOK then
+        hookLib.attach_wait();
+    end
+end
+
 -- 定时(以函数return为时机) 进行attach连接
 -- 返回值 hook 可以继续往下走时返回1 ，无需继续时返回0
 function this.reConnect()
@@ -1021,7 +1466,13 @@ function this.sendMsg( sendTab )
         end
     end
 
-    local sendStr = json.encode(sendTab);
+    local sendStr;
+    if hookLib ~= nil and hookLib.encode_json ~= nil then
+        sendStr = hookLib.encode_json(sendTab, json.null, json.EMPTY_ARRAY, json.EMPTY_OBJECT);
+    end
+    if sendStr == nil then
+        sendStr = json.encode(sendTab);
+    end
     if currentRunState == runState.DISCONNECT then
         this.printToConsole("[debugger error] disconnect but want sendMsg:" .. sendStr, 2);
         this.disconnect();
@@ -1040,9 +1491,12 @@ end
 
 -- 处理 收到的消息
 -- @dataStr 接收的消息json
-function this.dataProcess( dataStr )
+-- @dataTable hookLib已解码的消息(可选)，为空时使用json.decode解码
+function this.dataProcess( dataStr, dataTable )
     this.printToVSCode("debugger get:"..dataStr);
-    local dataTable = json.decode(dataStr);
+    if not dataTable then
+        dataTable = json.decode(dataStr);
+    end
     if dataTable == nil then
         this.printToVSCode("[error] Json is error", 2);
         return;
@@ -1066,6 +1520,9 @@ function this.dataProcess( dataStr )
                 fakeBreakPointCache[info.fakeBKPath] = {};
             end
             table.insert(fakeBreakPointCache[info.fakeBKPath] ,info.fakeBKLine);
+            if hookLib ~= nil and hookLib.sync_fake_breakpoint then
+                hookLib.sync_fake_breakpoint(tostring(info.fakeBKPath), tonumber(info.fakeBKLine) or 0);
+            end
         else
             this.changeRunState(runState.RUN);
         end
@@ -1232,7 +1689,7 @@ function this.dataProcess( dataStr )
             local varRefNum = tonumber(dataTable.info.varRef);
             if varRefNum < 10000 then
                 --查询变量, 此时忽略 stackId
-                local varTable = this.getVariableRef(dataTable.info.varRef, true);
+                local varTable = this.getVariableRef(dataTable.info.varRef, dataTable.info.filter, tonumber(dataTable.info.start), tonumber(dataTable.info.count));
                 msgTab.info = varTable;
             elseif varRefNum >= 10000 and varRefNum < 20000 then
                 --局部变量
@@ -1402,6 +1859,19 @@ function this.dataProcess( dataStr )
             hookLib.sync_tempfile_path(TempFilePath_luaString);
             hookLib.sync_cwd(cwd);
             hookLib.sync_file_ext(luaFileExtension);
+            if hookLib.sync_distinguish_same_name_file then
+                -- 同步后由C完成同名文件区分和假断点过滤
+                hookLib.sync_distinguish_same_name_file(distinguishSameNameFile and 1 or 0);
+            end
+            if hookLib.set_logpoint_config then
+                hookLib.set_logpoint_config(logPointRateLimit, logPointFlushInterval, logPointBufferLines);
+            end
+            if hookLib.set_poll_config then
+                hookLib.set_poll_config(messagePollInterval, attachInterval * 1000, hookInstructionBudget);
+            end
+            if hookLib.set_variable_config then
+                hookLib.set_variable_config(variableMaxDepth, variableMaxChildren, variableMaxStringLen, variableTimeBudget, variablePageSize);
+            end
         end
         --detect LoadString
         isUseLoadstring = 0;
@@ -1412,6 +1882,10 @@ function this.dataProcess( dataStr )
         end
         local tab = { debuggerVer = tostring(debuggerVer) , UseHookLib = tostring(isUseHookLib) , UseLoadstring = tostring(isUseLoadstring), isNeedB64EncodeStr = tostring(isNeedB64EncodeStr) };
         msgTab.info  = tab;
+        -- 在回复initSuccess之前切换, 此时VSCode端在等待回复, socket中没有未读消息
+        if hookLib ~= nil and useNativeTransport then
+            this.attachNativeTransport();
+        end
         this.sendMsg(msgTab);
         --上面getBK中会判断当前状态是否WAIT_CMD, 所以最后再切换状态。
         stopOnEntry = dataTable.info.stopOnEntry;
@@ -1553,7 +2027,7 @@ function this.receiveMessage( timeoutSec )
     if #recvMsgQueue > 0 then
         local saved_cmd = recvMsgQueue[1];
         table.remove(recvMsgQueue, 1);
-        this.dataProcess(saved_cmd);
+        this.dataProcess(saved_cmd[1], saved_cmd[2]);
         return true;
     end
 
@@ -1566,7 +2040,12 @@ function this.receiveMessage( timeoutSec )
         this.printToConsole("[debugger error]接收信息失败  |  reason: socket == nil", 2);
         return;
     end
-    local response, err = sock:receive("*l");
+    local response, err;
+    if nativeTransportOn then
+        response, err = hookLib.transport_receive(timeoutSec);
+    else
+        response, err = sock:receive("*l");
+    end
     if response == nil then
         if err == "closed" then
             this.printToConsole("[debugger error]接收信息失败  |  reason:"..err, 2);
@@ -1576,22 +2055,32 @@ function this.receiveMessage( timeoutSec )
     else
 
         --判断是否是一条消息，分拆
-        local proc_response = string.sub(response, 1, -1 * (TCPSplitChar:len() + 1 ));
-        local match_res = string.find(proc_response, TCPSplitChar, 1, true);
-        if match_res == nil then
-            --单条
-            this.dataProcess(proc_response);
+        local frames, commands;
+        if hookLib ~= nil and hookLib.decode_messages ~= nil then
+            --hookLib一次扫描完成切分和解码
+            frames, commands = hookLib.decode_messages(response, TCPSplitChar);
+        end
+        if frames ~= nil then
+            for i = 1, #frames do
+                table.insert(recvMsgQueue, {frames[i], commands[i]});
+            end
         else
-            --有粘包
+            local proc_response = string.sub(response, 1, -1 * (TCPSplitChar:len() + 1 ));
+            local startPos = 1;
             repeat
+                local match_res = string.find(proc_response, TCPSplitChar, startPos, true);
                 --待处理命令
-                local str1 = string.sub(proc_response, 1, match_res - 1);
-                table.insert(recvMsgQueue, str1);
-                --剩余匹配
-                local str2 = string.sub(proc_response, match_res + TCPSplitChar:len() , -1);
-                match_res = string.find(str2, TCPSplitChar, 1, true);
+                table.insert(recvMsgQueue, {string.sub(proc_response, startPos, (match_res or 0) - 1)});
+                if match_res then
+                    startPos = match_res + TCPSplitChar:len();
+                end
             until not match_res
-            this.receiveMessage();
+        end
+
+        if #recvMsgQueue > 0 then
+            local saved_cmd = recvMsgQueue[1];
+            table.remove(recvMsgQueue, 1);
+            this.dataProcess(saved_cmd[1], saved_cmd[2]);
         end
         return true;
     end
@@ -1641,6 +2130,16 @@ function this.getStackTable( level )
     local functionLevel = 0
     if hookLib ~= nil then
         functionLevel = level or HOOK_LEVEL;
+        if hookLib.get_stack_table ~= nil then
+            --由hookLib遍历调用栈，层级和本函数中debug.getinfo的层级一致
+            local stackTab, userFuncSteakLevel, callStack = hookLib.get_stack_table(functionLevel);
+            if stackTab ~= nil then
+                for _, callStackInfo in ipairs(callStack) do
+                    table.insert(currentCallStack, callStackInfo);
+                end
+                return stackTab, userFuncSteakLevel;
+            end
+        end
     else
         functionLevel = level or this.getSpecificFunctionStackLevel(lastRunFunction.func);
     end
@@ -1878,6 +2377,17 @@ function this.checkRealHitBreakpoint( oPath, line )
     return true;  
 end
 
+-- 获取 opath 经过 formatOpath 和 truncatedPath 处理后的路径(和堆栈中的 oPath 一致)。供hookLib调用, 结果由C缓存
+function this.getFormatedOpath(opath)
+    local oPathFormated = this.formatOpath(opath);
+    return this.truncatedPath(oPathFormated, truncatedOPath);
+end
+
+-- 断点所在的 fullpath 是否就是 oPathFormated 对应的文件(区分同名文件)。供hookLib调用, 结果由C缓存
+function this.isOpathMatchBreakpoint(fullpath, oPathFormated)
+    return string.match(fullpath, oPathFormated) ~= nil;
+end
+
 ------------------------断点处理-------------------------
 --- this.isHitBreakpoint 判断断点是否命中。这个方法在c mod以及lua中都有调用
 -- @param breakpointPath 文件名+后缀
@@ -1914,7 +2424,8 @@ function this.isHitBreakpoint(breakpointPath, opath, curLine)
                         -- enum BreakpointType {
                         --     conditionBreakpoint = 0,
                         --     logPoint,
-                        --     lineBreakpoint
+                        --     lineBreakpoint,
+                        --     hitConditionBreakpoint
                         -- }
                         
                     -- 处理断点
@@ -1928,6 +2439,16 @@ function this.isHitBreakpoint(breakpointPath, opath, curLine)
                         -- log point
                         this.printToVSCode("[LogPoint Output]: " .. cur_node["logMessage"], 2, 2);
                         return false;
+                    elseif cur_node["type"] == "3" then
+                        -- hit condition breakpoint. 有condition时只统计条件成立的次数
+                        if cur_node["condition"] ~= nil and cur_node["condition"] ~= "" then
+                            local conditionRet = this.IsMeetCondition(cur_node["condition"]);
+                            if not conditionRet then
+                                return false;
+                            end
+                        end
+                        cur_node["hitCount"] = (cur_node["hitCount"] or 0) + 1;
+                        return this.isMeetHitCondition(cur_node["hitCondition"], cur_node["hitCount"]);
                     else
                         -- line breakpoint
                         return true;
@@ -1945,13 +2466,14 @@ end
 -- 条件断点处理函数
 -- 返回true表示条件成立
 -- @conditionExp 条件表达式
-function this.IsMeetCondition(conditionExp)
+-- @stackLevel   使用hookLib时用户函数所在的栈层级(可选, 默认4)
+function this.IsMeetCondition(conditionExp, stackLevel)
     -- 判断条件之前更新堆栈信息
     currentCallStack = {};
     variableRefTab = {};
     variableRefIdx = 1;
     if  hookLib then
-        this.getStackTable(4);
+        this.getStackTable(stackLevel or 4);
     else
         this.getStackTable();
     end
@@ -1978,6 +2500,32 @@ function this.IsMeetCondition(conditionExp)
     return isMeetCondition;
 end
 
+-- 命中次数断点处理函数
+-- 支持 "N"/"==N"(第N次), ">N", ">=N", "<N", "<=N", "%N"(每N次)。格式错误时不命中
+-- @hitCondition 命中条件
+-- @hitCount     包含本次在内的命中次数
+function this.isMeetHitCondition(hitCondition, hitCount)
+    local op, num = string.match(tostring(hitCondition), "^%s*([=<>%%]*)%s*(%d+)%s*$");
+    num = tonumber(num);
+    if num == nil then
+        return false;
+    end
+    if op == "" or op == "==" or op == "=" then
+        return hitCount == num;
+    elseif op == ">" then
+        return hitCount > num;
+    elseif op == ">=" then
+        return hitCount >= num;
+    elseif op == "<" then
+        return hitCount < num;
+    elseif op == "<=" then
+        return hitCount <= num;
+    elseif op == "%" then
+        return num > 0 and hitCount % num == 0;
+    end
+    return false;
+end
+
 --加入断点函数
 function this.BP()
     this.printToConsole("BP()");
@@ -2329,7 +2877,8 @@ function this.changeHookState( s )
     if s == hookState.DISCONNECT_HOOK then
         --为了实现通用attach模式，require即开始hook，利用r作为时机发起连接
         if openAttachMode == true then
-            if hookLib then hookLib.lua_set_hookstate(hookState.DISCONNECT_HOOK); else debug.sethook(this.debug_hook, "r", 1000000); end
+            if hookLib and this.startAttachListener() then hookLib.attach_wait();
+            elseif hookLib then hookLib.lua_set_hookstate(hookState.DISCONNECT_HOOK); else debug.sethook(this.debug_hook, "r", 1000000); end
         else
             if hookLib then hookLib.endHook(); else debug.sethook(); end
         end
@@ -2704,11 +3253,22 @@ end
 
 -- 查询引用变量
 -- @refStr 变量记录id(variableRefTab索引)
+-- @filter 分页展开时VSCode请求的成员类型"indexed"/"named"(可选，仅hookLib生成的大table有)
+-- @start  分页展开时的起始位置(可选)
+-- @count  分页展开时的成员数(可选)
 -- @return 格式化的变量信息table
-function this.getVariableRef( refStr )
+function this.getVariableRef( refStr, filter, start, count )
     local varRef = tonumber(refStr);
     local varTab = {};
 
+    if type(variableRefTab[varRef]) == "table" then
+        varTab = this.getVariablesByHookLib("table", variableRefTab[varRef], varRef, filter, start, count);
+        if varTab ~= nil then
+            return varTab;
+        end
+        varTab = {};
+    end
+
     if tostring(type(variableRefTab[varRef])) == "table" then
         for n,v in pairs(variableRefTab[varRef]) do
             local var = {};
@@ -2787,11 +3347,32 @@ function this.getVariableRef( refStr )
     return varTab;
 end
 
+-- 使用hookLib展开变量，遍历受深度、成员数、字符串长度和时间限制。hookLib不可用时返回nil
+-- @kind      "local" | "upvalue" | "global" | "table"
+-- @target    栈层级(相对本函数) | function | table
+-- @parentRef 被展开变量的引用id(可选)
+-- @filter, start, count 分页展开table时VSCode的请求参数(可选)
+-- @return 格式化的变量信息table
+function this.getVariablesByHookLib(kind, target, parentRef, filter, start, count)
+    if hookLib == nil or hookLib.get_variables == nil then
+        return nil;
+    end
+    local varTab, nextRefIdx = hookLib.get_variables(kind, target, variableRefTab, variableRefIdx, parentRef, filter, start, count);
+    if varTab ~= nil then
+        variableRefIdx = nextRefIdx;
+    end
+    return varTab;
+end
+
 -- 获取全局变量。方法和内存管理中获取全局变量的方法一样
 -- @return 格式化的信息, 若未找到返回空table
 function this.getGlobalVariable( ... )
     --成本比较高，这里只能遍历_G中的所有变量，并去除系统变量，再返回给客户端
-    local varTab = {};
+    local varTab = this.getVariablesByHookLib("global", _G);
+    if varTab ~= nil then
+        return varTab;
+    end
+    varTab = {};
     for k,v in pairs(_G) do
         local var = {};
         var.name = tostring(k);
@@ -2829,6 +3410,12 @@ function this.getUpValueVariable( checkFunc , isFormatVariable)
     if checkFunc == nil then
         return varTab;
     end
+    if isGetValue == false then
+        local hookLibVarTab = this.getVariablesByHookLib("upvalue", checkFunc);
+        if hookLibVarTab ~= nil then
+            return hookLibVarTab;
+        end
+    end
     local i = 1
     repeat
         local n, v = debug.getupvalue(checkFunc, i)
@@ -2887,6 +3474,14 @@ function this.getVariable( checkLayer, isFormatVariable , offset)
         stacklayer = stacklayer + offset;
     end
 
+    if isGetValue == false then
+        --getVariablesByHookLib多占一层栈
+        local hookLibVarTab = this.getVariablesByHookLib("local", stacklayer + 1);
+        if hookLibVarTab ~= nil then
+            return hookLibVarTab, stacklayer - 1;
+        end
+    end
+
     repeat
         local n, v = debug.getlocal(stacklayer, k)
         if n == nil then
@@ -3591,6 +4186,13 @@ local base64CharTable='ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz01234
 
 -- encoding
 function tools.base64encode(data)
+    --加载了hookLib时使用C实现
+    if hookLib ~= nil and hookLib.base64_encode ~= nil then
+        local ret = hookLib.base64_encode(data);
+        if ret ~= nil then
+            return ret;
+        end
+    end
     return ((data:gsub('.', function(x)
         local r,b='',x:byte()
         for i=8,1,-1 do r=r..(b%2^i-b%2^(i-1)>0 and '1' or '0') end
@@ -3605,6 +4207,12 @@ end
 
 -- decoding
 function tools.base64decode(data)
+    if hookLib ~= nil and hookLib.base64_decode ~= nil then
+        local ret = hookLib.base64_decode(data);
+        if ret ~= nil then
+            return ret;
+        end
+    end
     data = string.gsub(data, '[^'..base64CharTable..'=]', '')
     return (data:gsub('.', function(x)
         if (x == '=') then return '' end
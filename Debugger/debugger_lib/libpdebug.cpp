@@ -5,40 +5,70 @@
 // Unless required by applicable law or agreed to in writing, software distributed under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions and limitations under the License.
 
 #include "libpdebug.h"
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <ctime>
 #include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define BASE64_SIMD 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+#ifdef _WIN32
+#include <winsock2.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#endif
 
 //using namespace std;
-static int cur_run_state = 0;       //当前运行状态， c 和 lua 都可能改变这个状态，要保持同步
-static int cur_hook_state = 0;      //当前hook状态， c 和 lua 都可能改变这个状态
-static int logLevel = 1;            //日志等级（从lua同步）
-static int pathCaseSensitivity = 1; //大小写敏感标志位（从lua同步）
 //static int autoPathMode = 0;        //自动路径标是否开启志位
-static int BPhit = 0;               //BP命中标志位
-static int stackdeep_counter = 0;   //step用的栈深度计数器
-static char hookLog[1024] = { 0 };
-const char* debug_file_path;             //debugger的文件路径
-int debug_file_path_len;
-const char* tools_file_path;             //tools的文件路径
-int tools_file_path_len;
-char config_ext[32] = "";             //后缀（从lua同步）
-const char* config_cwd = "";             //cwd(从lua同步)
-const char* config_tempfile_path = "";
-time_t recvMsgSeconds = 0;
-const char* last_source;
-int ar_current_line = 0;
-int ar_def_line = 0;
-int ar_lastdef_line = 0;
-int bp_twice_check_res = 1;
-int lua_debugger_ver = 0;             // luapanda.lua的版本，便于做向下兼容
+const int poll_check_events = 64;       //每隔多少个hook事件读一次时钟，count事件总是读时钟
+// 每个协程(lua_State)各自的hook状态和单步计数。lua_sethook只作用于传入的协程，其他协程在下一个hook事件中按global_hook_state更新
+struct thread_hook_state {
+    int hook_state;                 //本协程的hook状态
+    unsigned int version;           //hook_state对应的global_hook_version，不同时要重新设置hook
+    int stackdeep_counter;          //step用的栈深度计数器
+    const char *last_source;        //本协程最近一次处理的位置，断点变化时用来重新判断hook状态
+    int current_line;
+    int def_line;
+    int lastdef_line;
+    int installed_count;            //本协程当前count hook的指令数
+    long long profiler_countdown;   //count模式采样，距离下次采样还需执行的指令数
+};
+const size_t thread_states_capacity = 4096;     //超过时清空(已结束的协程不会通知C)，单步所在的协程保留
 struct path_transfer_node;
 struct breakpoint;
-// 路径缓存队列 getinfo -> format
-std::list<path_transfer_node*> getinfo_to_format_cache;
-// 存放断点map，key为source
-std::map<std::string, std::map<int, breakpoint> > all_breakpoint_map;
+struct file_breakpoint_index;
+// 分页展开table时的遍历位置。table和上次的键保存在registry中，保证遍历期间不被回收
+struct variable_cursor {
+    int table_ref;
+    int key_ref;            //LUA_NOREF表示从头开始
+    int position;           //已经遍历过的成员数
+    bool finished;
+};
+const size_t variable_cursor_capacity = 64;
+const int profiler_timer_check_instructions = 1000;   //timer模式下每执行多少条指令检查一次采样标记
 
 enum run_state
 {
@@ -68,30 +98,150 @@ enum hook_event
     CALL = 0,
     RETURN =1,
     LINE =2,
+    COUNT = 3,
     TAILRET=4
 };
 
+enum profiler_mode_type
+{
+    PROFILER_OFF = 0,
+    PROFILER_COUNT,             //每N条虚拟机指令采样一次
+    PROFILER_TIMER              //后台线程每N微秒置位采样标记
+};
+
 enum breakpoint_type
 {
     CONDITION_BREAKPOINT = 0,
     LOG_POINT,
-    LINE_BREAKPOINT
+    LINE_BREAKPOINT,
+    HIT_CONDITION_BREAKPOINT
+};
+
+//命中次数断点的比较方式
+enum hit_condition_op
+{
+    HIT_INVALID = 0,
+    HIT_EQUAL,                  //"N" "==N" 第N次命中
+    HIT_GREATER,                //">N"
+    HIT_GREATER_EQUAL,          //">=N"
+    HIT_LESS,                   //"<N"
+    HIT_LESS_EQUAL,             //"<=N"
+    HIT_MULTIPLE                //"%N" 每N次命中
 };
 
 //用来缓存路径的结构体
 struct path_transfer_node{
     std::string src;
     std::string dst;
+    const char* source_ptr;                                 //最近一次查询时ar->source的地址
+    std::list<path_transfer_node*>::iterator lru_iter;      //在getinfo_to_format_cache中的位置
+    const file_breakpoint_index* bp_index;                  //dst对应的断点索引，nullptr表示本文件无断点
+    unsigned int bp_index_ver;                              //bp_index对应的断点索引版本号
+    std::string opath;                                      //src经formatOpath和truncatedPath处理后的路径，首次需要时从lua获取
+    bool opath_ready;
+    std::unordered_map<std::string, bool> opath_match;      //断点fullpath -> 是否就是本文件(区分同名文件)，随断点索引版本失效
     path_transfer_node(std::string _src, std::string _dst){
         src = _src;
         dst = _dst;
+        source_ptr = nullptr;
+        bp_index = nullptr;
+        bp_index_ver = 0;
+        opath_ready = false;
+    }
+};
+
+//路径缓存按字符串内容索引时使用的hash(FNV-1a)，避免查询时构造std::string
+struct cstr_hash {
+    size_t operator()(const char* str) const {
+        size_t hash = 2166136261u;
+        while (*str) {
+            hash ^= static_cast<unsigned char>(*str++);
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+};
+
+struct cstr_equal {
+    bool operator()(const char* a, const char* b) const {
+        return strcmp(a, b) == 0;
     }
 };
 
+
+// 记录点模板片段。模板中的{expr}在同步断点时解析为表达式片段
+struct logpoint_segment {
+    std::string text;               //文本，或表达式原文
+    bool is_expr = false;
+    bool is_name = false;           //表达式是简单变量名，优先用lua_getlocal/lua_getupvalue直接取值
+    int chunk_ref = LUA_NOREF;      //表达式编译后的chunk。变量名不是局部变量和upvalue时也用它取值(如全局变量)
+};
+
 // 断点信息
 struct breakpoint {
     breakpoint_type type;
     std::string info;
+    std::string opath;      //断点所在文件的完整路径(lua中breaks的第二级key)，用于区分同名文件
+    int condition_ref = LUA_NOREF;      //条件断点编译后的chunk在registry中的引用。LUA_NOREF表示未编译，交给lua判断
+    bool condition_error = false;       //条件表达式编译失败，视为条件不成立
+    std::string condition;              //命中次数断点附带的条件表达式，可为空
+    hit_condition_op hit_op = HIT_INVALID;
+    int hit_target = 0;
+    mutable int hit_count = 0;          //命中次数，重新同步断点时清零
+    std::vector<logpoint_segment> log_segments;     //记录点模板，同步断点时解析
+    bool log_native = false;                        //记录点模板已在C中解析
+    mutable double log_window_start = 0;            //限流窗口开始时间
+    mutable int log_window_count = 0;               //限流窗口内已输出的条数
+    mutable int log_suppressed = 0;                 //被限流丢弃的条数，下一次输出时提示
+};
+
+// 单个文件的断点索引。line_bits按行号置位，未命中时只需一次位运算；断点内容放在line_breakpoints中
+// 同名文件的断点会合并到同一个文件名下，所以一行可能有多个断点
+// sorted_lines是升序排列的断点行号，用于查询函数范围内是否有断点
+struct file_breakpoint_index {
+    std::vector<unsigned int> line_bits;
+    std::vector<int> sorted_lines;
+    std::unordered_map<int, std::vector<breakpoint> > line_breakpoints;
+
+    void set_line(int line) {
+        if (line < 0) {
+            return;
+        }
+        size_t word = static_cast<size_t>(line) >> 5;
+        if (word >= line_bits.size()) {
+            line_bits.resize(word + 1, 0);
+        }
+        line_bits[word] |= 1u << (line & 31);
+    }
+
+    bool has_line(int line) const {
+        if (line < 0) {
+            return false;
+        }
+        size_t word = static_cast<size_t>(line) >> 5;
+        return word < line_bits.size() && (line_bits[word] & (1u << (line & 31))) != 0;
+    }
+
+    //[sline, eline]范围内是否有断点。主chunk(sline和eline都为0)或范围无效时按整个文件处理
+    bool has_line_in_range(int sline, int eline) const {
+        if (sorted_lines.empty()) {
+            return false;
+        }
+        if (eline <= 0 || eline < sline) {
+            return true;
+        }
+        std::vector<int>::const_iterator iter = std::lower_bound(sorted_lines.begin(), sorted_lines.end(), sline);
+        return iter != sorted_lines.end() && *iter <= eline;
+    }
+
+    //返回本行的断点列表，无断点返回nullptr
+    const std::vector<breakpoint>* find_breakpoints(int line) const {
+        std::unordered_map<int, std::vector<breakpoint> >::const_iterator iter = line_breakpoints.find(line);
+        if (iter == line_breakpoints.end()) {
+            return nullptr;
+        }
+        return &iter->second;
+    }
 };
 
 struct debug_auto_stack {
@@ -106,21 +256,246 @@ struct debug_auto_stack {
     int top;
 };
 
+//------------调试器上下文------------
+//调试器状态按虚拟机保存在debugger_context中，同一进程中的多个虚拟机(可以在不同线程中运行)互不影响
+//上下文由registry中的userdata持有，虚拟机关闭时由__gc释放。hook事件和lua调用的接口开始时取一次上下文，之后作为参数传递
+struct lua_callback_slot;
+struct profiler_frame;
+struct trace_function_stat;
+struct trace_thread_stack;
+struct coverage_chunk;
+struct alloc_site;
+struct alloc_block;
+struct alloc_pending_block;
+struct heap_frame;
+struct transport_channel;
+struct attach_listener;
+
+// 采样分析timer模式的定时线程，每个虚拟机一个。上下文释放时停止定时线程，避免析构joinable的std::thread
+struct profiler_timer {
+    std::thread thread;
+    std::atomic<bool> stop;
+    std::atomic<bool> tick;                 //采样标记
+
+    profiler_timer() : stop(false), tick(false) {}
+
+    void shutdown() {
+        stop.store(true);
+        if (thread.joinable()) {
+            thread.join();
+        }
+        stop.store(false);
+        tick.store(false);
+    }
+
+    ~profiler_timer() {
+        shutdown();
+    }
+};
+
+// 函数耗时统计和覆盖率中函数的key
+struct trace_function_key {
+    const char *source;
+    int linedefined;
+    bool operator==(const trace_function_key &other) const {
+        return source == other.source && linedefined == other.linedefined;
+    }
+};
+struct trace_function_key_hash {
+    size_t operator()(const trace_function_key &key) const {
+        return std::hash<const char*>()(key.source) ^ (static_cast<size_t>(key.linedefined) * 0x9e3779b9u);
+    }
+};
+
+// hook开销统计
+const int hook_stats_event_types = 5;       //hook_event，5.2以后第5类为TAILCALL
+struct hook_event_stat {
+    double count;
+    double time_ns;
+};
+
+struct debugger_context {
+    int cur_run_state = 0;       //当前运行状态， c 和 lua 都可能改变这个状态，要保持同步
+    int cur_hook_state = 0;      //当前hook状态， c 和 lua 都可能改变这个状态
+    int logLevel = 1;            //日志等级（从lua同步）
+    int pathCaseSensitivity = 1; //大小写敏感标志位（从lua同步）
+    int BPhit = 0;               //BP命中标志位
+    char hookLog[1024] = { 0 };
+    const char* debug_file_path = NULL;             //debugger的文件路径
+    int debug_file_path_len = 0;
+    const char* tools_file_path = NULL;             //tools的文件路径
+    int tools_file_path_len = 0;
+    char config_ext[32] = "";             //后缀（从lua同步）
+    const char* config_cwd = "";             //cwd(从lua同步)
+    const char* config_tempfile_path = "";
+    // 消息轮询调度。hook事件中按间隔接收消息/重连，count hook保证死循环中也能定时轮询
+    double poll_interval_ms = 100;          //RUN/单步时接收消息的间隔(毫秒)（可由lua设置）
+    double reconnect_interval_ms = 1000;    //未连接时尝试重连的间隔(毫秒)（可由lua设置）
+    int hook_instruction_budget = 100000;   //每执行多少条虚拟机指令触发一次count hook，<=0表示不使用（可由lua设置）
+    int poll_event_counter = 0;
+    double next_poll_time = 0;
+    double next_reconnect_time = 0;
+    const char* last_source = NULL;
+    int ar_current_line = 0;
+    int ar_def_line = 0;
+    int ar_lastdef_line = 0;
+    // 协程的hook状态
+    std::unordered_map<lua_State*, thread_hook_state> thread_states;
+    lua_State *cached_thread = NULL;                //最近一次查询的协程，连续的hook事件通常来自同一协程
+    thread_hook_state *cached_thread_state = NULL;
+    thread_hook_state detached_thread_state = thread_hook_state();     //协程状态被清空后，正在处理的hook事件使用这个状态
+    thread_hook_state *cur_thread_state = &detached_thread_state;   //正在处理hook事件的协程
+    int global_hook_state = 0;                      //lua最近一次设置的hook状态
+    unsigned int global_hook_version = 1;           //lua设置hook状态或hook需要的事件变化时递增
+    bool hook_detached = false;                     //endHook之后不再调试，其他协程在下一个事件中只保留统计需要的hook
+    lua_State *step_thread = NULL;                  //开始单步的协程，STEPOVER/STEPOUT只在这个协程中计数和停止
+    int bp_twice_check_res = 1;
+    int lua_debugger_ver = 0;             // luapanda.lua的版本，便于做向下兼容
+    int distinguish_same_name_file = 0;   //是否区分同名文件中的断点（从lua同步）
+    int native_hit_check = 0;             //是否在C中完成断点真实命中判断。lua同步distinguishSameNameFile后开启，旧版本luapanda.lua仍走lua判断
+    // 路径缓存队列 getinfo -> format。按LRU排序，队首是最近使用的节点
+    std::list<path_transfer_node*> getinfo_to_format_cache;
+    size_t pathcache_capacity = 4096;        //路径缓存容量，超出后淘汰最久未使用的节点（可由lua设置）
+    double pathcache_hit_count = 0;          //路径缓存命中次数
+    double pathcache_miss_count = 0;         //路径缓存未命中次数
+    // 路径缓存索引。一级以ar->source指针为key(lua中同一个chunk的source是同一个字符串)，二级以字符串内容为key
+    std::unordered_map<const char*, path_transfer_node*> pathcache_ptr_index;
+    std::unordered_map<const char*, path_transfer_node*, cstr_hash, cstr_equal> pathcache_str_index;
+    // 存放断点map，key为source
+    std::map<std::string, std::multimap<int, breakpoint> > all_breakpoint_map;
+    // 断点行号索引，由all_breakpoint_map生成，key为source。供hook中快速判断行号是否有断点
+    std::unordered_map<std::string, file_breakpoint_index> breakpoint_index;
+    unsigned int breakpoint_index_ver = 1;  //断点索引版本号，每次重建索引时递增，使路径缓存中记录的索引失效
+    // 假断点缓存。key为VSCode校验后回传的oPath，value为行号列表。同名文件导致的错误命中会记录在这里
+    std::unordered_map<std::string, std::vector<int> > fake_breakpoint_cache;
+    // 已编译的表达式(条件断点，记录点)在registry中的引用，重新同步断点或结束hook时释放
+    std::vector<int> condition_chunk_refs;
+    // 回调表，key为方法名。另以调用处传入的字符串常量地址为key做一级索引
+    std::unordered_map<std::string, lua_callback_slot> callback_slots;
+    std::unordered_map<const char*, lua_callback_slot*> callback_ptr_index;
+    // lua回调绑定版本号。sync_lua_debugger_ver或rebind_callbacks时递增，回调在下次调用时重新绑定
+    unsigned int callback_bind_ver = 1;
+    // 记录点输出缓冲区(环形)，批量发送给VSCode
+    int logpoint_rate_limit = 20;                //每个记录点每秒最多输出的条数，<=0表示不限制（可由lua设置）
+    double logpoint_flush_interval = 200;        //缓冲区中的输出最多保留的毫秒数，<=0表示不缓冲（可由lua设置）
+    size_t logpoint_buffer_capacity = 128;       //缓冲区行数（可由lua设置）
+    std::vector<std::string> logpoint_ring;
+    size_t logpoint_ring_head = 0;
+    size_t logpoint_ring_count = 0;
+    double logpoint_oldest_time = 0;             //缓冲区中最早一条输出的时间
+    // 变量展开的限制，<=0表示不限制（可由lua设置）
+    int variable_max_depth = 64;                 //引用的最大深度(从局部变量/upvalue/全局变量开始逐层展开)
+    int variable_max_children = 5000;            //一次展开的最大成员数，同时是统计table成员数的上限
+    int variable_max_string_len = 10000;         //字符串值的最大长度
+    double variable_time_budget_ms = 500;        //一次展开的最长时间
+    int variable_page_size = 1000;               //成员数超过该值的table由VSCode分页展开，<=0表示不分页
+    std::unordered_map<int, int> variable_ref_depth;    //variablesReference -> 深度
+    // 分页展开的遍历位置，key为variablesReference。下一页从上次的位置继续遍历
+    std::map<int, variable_cursor> variable_cursors;
+    std::string json_buffer;             //json编码复用的输出缓冲区，避免每条消息重新分配
+    // 采样分析。在count hook中采样lua调用栈
+    int profiler_mode = 0;                       //profiler_mode_type
+    int profiler_interval = 0;                   //count模式为采样间隔的指令数，timer模式为采样间隔的微秒数
+    int profiler_count_instructions = 0;         //采样需要的count hook指令数，0表示未开启采样
+    std::vector<std::string> profiler_sources;                                  //source_id -> source
+    std::unordered_map<const char*, int> profiler_source_ptr;                   //ar->source的地址 -> source_id，命中后仍比较内容
+    std::unordered_map<std::string, int> profiler_source_ids;                   //source -> source_id
+    std::vector<profiler_frame> profiler_frames;                                //frame_id -> 帧
+    std::unordered_map<unsigned long long, int> profiler_frame_ids;             //(source_id, linedefined, currentline) -> frame_id
+    std::unordered_map<std::string, unsigned long long> profiler_stacks;        //frame_id序列(栈顶在前) -> 采样次数
+    std::string profiler_stack_key;
+    unsigned long long profiler_sample_total = 0;
+    double profiler_start_time = 0;
+    double profiler_elapsed_ms = 0;             //已停止的采样累计时长
+    bool profiler_sample_by_time = false;       //最近一次采样是否为timer模式，停止后导出时使用
+    profiler_timer profiler_timer_state;
+    // 函数耗时统计
+    bool trace_enabled = false;                  //是否在统计函数耗时
+    std::unordered_map<trace_function_key, int, trace_function_key_hash> trace_function_ids;   //ar->source的地址 -> 统计，命中后仍比较内容
+    std::map<std::pair<std::string, int>, int> trace_function_name_ids;                        //(源文件名, linedefined) -> 统计
+    std::vector<trace_function_stat> trace_stats;
+    std::unordered_map<lua_State*, trace_thread_stack> trace_stacks;
+    lua_State *trace_current_thread = NULL;
+    double trace_start_time = 0;
+    double trace_elapsed_ms = 0;
+    // 覆盖率
+    bool coverage_enabled = false;               //是否在收集覆盖率
+    bool coverage_count_hits = false;               //是否记录每行的执行次数
+    bool coverage_use_activelines = false;          //是否在函数首次执行时用activelines标记可执行的行
+    std::vector<coverage_chunk> coverage_chunks;
+    std::unordered_map<const char*, int> coverage_chunk_ptr;        //ar->source的地址 -> chunk，命中后仍比较内容
+    std::unordered_map<std::string, int> coverage_chunk_ids;        //source -> chunk
+    std::unordered_set<trace_function_key, trace_function_key_hash> coverage_seen_functions;   //已取过activelines的函数
+    const char *coverage_last_source = NULL;        //最近一次的source地址，连续的LINE事件通常在同一个chunk中
+    int coverage_last_chunk = -1;
+    // 内存分配统计
+    bool alloc_enabled = false;                  //是否在统计内存分配
+    int alloc_suspend_depth = 0;                //>0表示正在执行debug_hook_c，调试器自身的分配不采样
+    lua_Alloc alloc_original_f = NULL;
+    void *alloc_original_ud = NULL;
+    long long alloc_sample_bytes = 0;           //每分配多少字节采样一次，<=0表示每次分配都记录
+    long long alloc_countdown = 0;
+    std::unordered_map<void*, alloc_block> alloc_blocks;        //采样到且未释放的内存块
+    std::vector<alloc_pending_block> alloc_pending;
+    std::vector<alloc_site> alloc_sites;
+    std::unordered_map<std::string, int> alloc_site_ids;
+    std::map<int, std::vector<long long> > alloc_snapshots;     //快照id -> 各分配位置的存活字节数
+    int alloc_snapshot_seq = 0;
+    // 内存快照
+    std::unordered_set<const void*> heap_visited;
+    std::vector<heap_frame> heap_frames;
+    FILE *heap_file = NULL;
+    size_t heap_object_count = 0;
+    unsigned long long heap_total_bytes = 0;
+    size_t heap_truncated_count = 0;
+    // hook开销统计
+    bool hook_stats_enabled = false;
+    hook_event_stat hook_stats[hook_stats_event_types] = {};
+    std::unique_ptr<transport_channel> transport;       //原生消息通道，未启动时为空。上下文释放时停止接收线程
+    std::unique_ptr<attach_listener> attach_state;      //后台attach监听，未启动时为空
+};
+
+//取当前虚拟机的上下文，不存在时创建。只在lua调用的接口中使用
+debugger_context *get_context(lua_State *L);
+//取当前虚拟机的上下文，不存在时返回NULL。在hook中使用，不创建上下文
+debugger_context *find_context(lua_State *L);
+
+//单调时钟(毫秒)
+double monotonic_ms() {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//轮询用的低开销单调时钟(毫秒)。linux下使用CLOCK_MONOTONIC_COARSE，精度为一个tick
+double coarse_monotonic_ms() {
+#if defined(__linux__) && defined(CLOCK_MONOTONIC_COARSE)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == 0) {
+        return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+    }
+#endif
+    return monotonic_ms();
+}
+
 //内部方法声明
+int native_eval_available();
 void debug_hook_c(lua_State *L, lua_Debug *ar);
-void check_hook_state(lua_State *L, const char* source, int current_line, int def_line, int last_line, int event = -1);
-void print_to_vscode(lua_State *L, const char* msg, int level = 0);
+void check_hook_state(debugger_context *ctx, lua_State *L, const char* source, int current_line, int def_line, int last_line, int event = -1);
+void print_to_vscode(debugger_context *ctx, lua_State *L, const char* msg, int level = 0);
+void flush_logpoint_buffer(debugger_context *ctx, lua_State *L);
 void load(lua_State* L);
+void attach_disarm(debugger_context *ctx);
+int attach_check_count(debugger_context *ctx);
+void attach_poll(debugger_context *ctx, lua_State *L);
 
 //打印断点信息
-void print_all_breakpoint_map(lua_State *L, int print_level = 0) {
-    if (print_level < logLevel) {
+void print_all_breakpoint_map(debugger_context *ctx, lua_State *L, int print_level = 0) {
+    if (print_level < ctx->logLevel) {
         return;
     }
-    std::map<std::string, std::map<int, breakpoint> >::iterator iter1;
-    std::map<int, breakpoint>::iterator iter2;
+    std::map<std::string, std::multimap<int, breakpoint> >::iterator iter1;
+    std::multimap<int, breakpoint>::iterator iter2;
     std::string log_message = "[breakpoints in chook:]\n";
-    for (iter1 = all_breakpoint_map.begin(); iter1 != all_breakpoint_map.end(); ++iter1) {
+    for (iter1 = ctx->all_breakpoint_map.begin(); iter1 != ctx->all_breakpoint_map.end(); ++iter1) {
         log_message += iter1->first;
         log_message += '\n';
         for (iter2 = iter1->second.begin(); iter2 != iter1->second.end(); ++iter2) {
@@ -143,6 +518,15 @@ void print_all_breakpoint_map(lua_State *L, int print_level = 0) {
                     log_message += iter2->second.info;
                     break;
 
+                case HIT_CONDITION_BREAKPOINT:
+                    log_message += std::string("hit condition breakpoint  info: ");
+                    log_message += iter2->second.info;
+                    if (!iter2->second.condition.empty()) {
+                        log_message += std::string("  condition: ");
+                        log_message += iter2->second.condition;
+                    }
+                    break;
+
                 default:
                     log_message += std::string("Invalid breakpoint type!");
                     log_message += std::to_string(iter2->second.type);
@@ -151,7 +535,7 @@ void print_all_breakpoint_map(lua_State *L, int print_level = 0) {
             log_message += '\n';
         }
     }
-    print_to_vscode(L, log_message.c_str(), print_level);
+    print_to_vscode(ctx, L, log_message.c_str(), print_level);
 }
 
 //push_arg Template
@@ -188,30 +572,112 @@ void push_args(lua_State *L, T value ,ARGS... args){
 }
 //push_args End
 
-template <typename ... ARGS>
-int call_lua_function(lua_State *L, const char * lua_function_name, int retCount , ARGS... args){
+//------------lua回调------------
+//LuaPanda中被C调用的方法。首次调用时解析为registry引用，之后不再按名字查找
+struct lua_callback_slot {
+    std::string name;
+    int ref = LUA_NOREF;
+    unsigned int bind_ver = 0;      //ref对应的callback_bind_ver
+    double calls = 0;               //调用次数
+    double errors = 0;              //调用出错次数
+    double total_time = 0;          //累计耗时(毫秒)，包含lua中阻塞等待的时间
+};
+
+
+//按名字获取回调槽位
+lua_callback_slot* get_callback_slot(debugger_context *ctx, const char *name) {
+    std::unordered_map<const char*, lua_callback_slot*>::const_iterator iter = ctx->callback_ptr_index.find(name);
+    if (iter != ctx->callback_ptr_index.end() && !strcmp(iter->second->name.c_str(), name)) {
+        return iter->second;
+    }
+    lua_callback_slot *slot = &ctx->callback_slots[std::string(name)];
+    if (slot->name.empty()) {
+        slot->name = name;
+    }
+    ctx->callback_ptr_index[name] = slot;
+    return slot;
+}
+
+//把LuaPanda[name]解析为registry引用。解析失败时ref保持LUA_NOREF，调用时按名字查找并报错
+void bind_lua_callback(debugger_context *ctx, lua_State *L, lua_callback_slot *slot) {
+    slot->bind_ver = ctx->callback_bind_ver;
+    if (!native_eval_available()) {
+        return;
+    }
+    if (slot->ref != LUA_NOREF) {
+        luaL_unref(L, LUA_REGISTRYINDEX, slot->ref);
+        slot->ref = LUA_NOREF;
+    }
+    debug_auto_stack _tt(L);
+    lua_getglobal(L, LUA_DEBUGGER_NAME);
+    if (!lua_istable(L, -1)) {
+        return;
+    }
+    lua_getfield(L, -1, slot->name.c_str());
+    if (!lua_isfunction(L, -1)) {
+        return;
+    }
+    slot->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+//释放所有回调引用
+void release_lua_callbacks(debugger_context *ctx, lua_State *L) {
+    for (std::unordered_map<std::string, lua_callback_slot>::iterator iter = ctx->callback_slots.begin(); iter != ctx->callback_slots.end(); ++iter) {
+        if (iter->second.ref != LUA_NOREF) {
+            luaL_unref(L, LUA_REGISTRYINDEX, iter->second.ref);
+            iter->second.ref = LUA_NOREF;
+        }
+    }
+    ctx->callback_bind_ver++;
+}
+
+//把回调函数压栈，失败返回0
+int push_lua_callback(debugger_context *ctx, lua_State *L, lua_callback_slot *slot) {
+    if (slot->bind_ver != ctx->callback_bind_ver) {
+        bind_lua_callback(ctx, L, slot);
+    }
+    if (slot->ref != LUA_NOREF) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, slot->ref);
+        return 1;
+    }
+
     lua_getglobal(L, LUA_DEBUGGER_NAME);
     if (!lua_istable(L, -1)) {
         const char *err_msg = "[C Module Error]:call_lua_function Get LUA_DEBUGGER_NAME error.\n";
-        print_to_vscode(L, err_msg, 2);
-        return -1;
+        print_to_vscode(ctx, L, err_msg, 2);
+        return 0;
     }
 
-    lua_getfield(L, -1, lua_function_name);
+    lua_getfield(L, -1, slot->name.c_str());
     if (!lua_isfunction(L, -1)) {
         char err_msg[100];
-        snprintf(err_msg, sizeof(err_msg), "[C Module Error]:call_lua_function Get lua function '%s' error\n.", lua_function_name);
-        print_to_vscode(L, err_msg, 2);
+        snprintf(err_msg, sizeof(err_msg), "[C Module Error]:call_lua_function Get lua function '%s' error\n.", slot->name.c_str());
+        print_to_vscode(ctx, L, err_msg, 2);
+        return 0;
+    }
+    return 1;
+}
+
+//lua_function_name 需是字符串常量
+template <typename ... ARGS>
+int call_lua_function(debugger_context *ctx, lua_State *L, const char * lua_function_name, int retCount , ARGS... args){
+    lua_callback_slot *slot = get_callback_slot(ctx, lua_function_name);
+    if (!push_lua_callback(ctx, L, slot)) {
+        slot->errors++;
         return -1;
     }
 
     push_args(L, args...);
+    double start_time = monotonic_ms();
     int err_code = lua_pcall(L, sizeof...(args), retCount, 0);
+    slot->calls++;
+    slot->total_time += monotonic_ms() - start_time;
     if (err_code) {
+        slot->errors++;
         char err_msg[1024];
         const char *lua_error = lua_tostring(L, -1);
         snprintf(err_msg, sizeof(err_msg), "[C Module Error]:call_lua_function Call '%s' error. ErrorCode: %d, ErrorMessage: %s.\n", lua_function_name, err_code, lua_error);
-        print_to_vscode(L, err_msg, 2);
+        print_to_vscode(ctx, L, err_msg, 2);
         lua_pop(L, 1);
         return err_code;
     }
@@ -220,64 +686,207 @@ int call_lua_function(lua_State *L, const char * lua_function_name, int retCount
 }
 
 
+//------------路径缓存------------
+//从缓存中移除并释放一个节点
+void pathcache_remove_node(debugger_context *ctx, path_transfer_node* nd) {
+    std::unordered_map<const char*, path_transfer_node*>::iterator ptr_iter = ctx->pathcache_ptr_index.find(nd->source_ptr);
+    if (ptr_iter != ctx->pathcache_ptr_index.end() && ptr_iter->second == nd) {
+        ctx->pathcache_ptr_index.erase(ptr_iter);
+    }
+    ctx->pathcache_str_index.erase(nd->src.c_str());
+    ctx->getinfo_to_format_cache.erase(nd->lru_iter);
+    delete nd;
+}
+
+//超出容量时淘汰最久未使用的节点
+void pathcache_evict(debugger_context *ctx) {
+    while (ctx->getinfo_to_format_cache.size() > ctx->pathcache_capacity) {
+        pathcache_remove_node(ctx, ctx->getinfo_to_format_cache.back());
+    }
+}
+
+//清空路径缓存并释放所有节点
+void pathcache_clear(debugger_context *ctx) {
+    for (std::list<path_transfer_node*>::iterator iter = ctx->getinfo_to_format_cache.begin(); iter != ctx->getinfo_to_format_cache.end(); ++iter) {
+        delete *iter;
+    }
+    ctx->getinfo_to_format_cache.clear();
+    ctx->pathcache_ptr_index.clear();
+    ctx->pathcache_str_index.clear();
+}
+
+//标记节点为最近使用，并记录本次查询的source地址
+void pathcache_touch(debugger_context *ctx, path_transfer_node* nd, const char* source) {
+    if (nd->source_ptr != source) {
+        std::unordered_map<const char*, path_transfer_node*>::iterator ptr_iter = ctx->pathcache_ptr_index.find(nd->source_ptr);
+        if (ptr_iter != ctx->pathcache_ptr_index.end() && ptr_iter->second == nd) {
+            ctx->pathcache_ptr_index.erase(ptr_iter);
+        }
+        nd->source_ptr = source;
+        ctx->pathcache_ptr_index[source] = nd;
+    }
+    ctx->getinfo_to_format_cache.splice(ctx->getinfo_to_format_cache.begin(), ctx->getinfo_to_format_cache, nd->lru_iter);
+}
+
+//查缓存，未命中返回nullptr
+path_transfer_node* pathcache_find(debugger_context *ctx, const char* source) {
+    //source指针命中时仍需比较内容，防止字符串被回收后地址被复用
+    std::unordered_map<const char*, path_transfer_node*>::iterator ptr_iter = ctx->pathcache_ptr_index.find(source);
+    if (ptr_iter != ctx->pathcache_ptr_index.end() && !strcmp(ptr_iter->second->src.c_str(), source)) {
+        return ptr_iter->second;
+    }
+
+    std::unordered_map<const char*, path_transfer_node*, cstr_hash, cstr_equal>::iterator str_iter = ctx->pathcache_str_index.find(source);
+    if (str_iter != ctx->pathcache_str_index.end()) {
+        return str_iter->second;
+    }
+    return nullptr;
+}
+
+//加入缓存
+path_transfer_node* pathcache_insert(debugger_context *ctx, const char* source, const char* dst) {
+    path_transfer_node *nd = new path_transfer_node(source, dst);
+    ctx->getinfo_to_format_cache.push_front(nd);
+    nd->lru_iter = ctx->getinfo_to_format_cache.begin();
+    nd->source_ptr = source;
+    ctx->pathcache_ptr_index[source] = nd;
+    ctx->pathcache_str_index[nd->src.c_str()] = nd;
+    pathcache_evict(ctx);
+    return nd;
+}
+
 //------------Lua同步数据接口------------
 //lua层主动清除路径缓存
 extern "C" int clear_pathcache(lua_State *L)
 {
-    getinfo_to_format_cache.clear();
+    debugger_context *ctx = get_context(L);
+    pathcache_clear(ctx);
+    return 0;
+}
+
+//设置路径缓存容量
+extern "C" int set_pathcache_capacity(lua_State *L)
+{
+    debugger_context *ctx = get_context(L);
+    int capacity = static_cast<int>(luaL_checkinteger(L, 1));
+    //至少保留一个节点，保证getPath返回的路径在下一次查询前有效
+    ctx->pathcache_capacity = capacity > 0 ? static_cast<size_t>(capacity) : 1;
+    pathcache_evict(ctx);
     return 0;
 }
 
+//获取路径缓存统计 返回: 命中次数, 未命中次数, 当前节点数, 容量
+extern "C" int get_pathcache_stats(lua_State *L)
+{
+    debugger_context *ctx = get_context(L);
+    lua_pushnumber(L, ctx->pathcache_hit_count);
+    lua_pushnumber(L, ctx->pathcache_miss_count);
+    lua_pushnumber(L, static_cast<lua_Number>(ctx->getinfo_to_format_cache.size()));
+    lua_pushnumber(L, static_cast<lua_Number>(ctx->pathcache_capacity));
+    return 4;
+}
+
 //lua主动调用从c获取current_hook_state状态
 extern "C" int get_libhook_state(lua_State *L)
 {
-    lua_pushnumber(L, cur_hook_state);
+    debugger_context *ctx = get_context(L);
+    lua_pushnumber(L, ctx->cur_hook_state);
     return 1;
 }
 
 //lua主动调用从c获取last_source
 extern "C" int get_last_source(lua_State *L)
 {
-    lua_pushstring(L, last_source);
+    debugger_context *ctx = get_context(L);
+    lua_pushstring(L, ctx->last_source);
     return 1;
 }
 
-//同步luapanda.lua的版本号
+//同步luapanda.lua的版本号。同时使lua回调重新绑定
 extern "C" int sync_lua_debugger_ver(lua_State *L)
 {
-    lua_debugger_ver = static_cast<int>(luaL_checkinteger(L, 1));
+    debugger_context *ctx = get_context(L);
+    ctx->lua_debugger_ver = static_cast<int>(luaL_checkinteger(L, 1));
+    ctx->callback_bind_ver++;
+    return 0;
+}
+
+//LuaPanda中的方法被替换后(如重新加载LuaPanda.lua)，使lua回调重新绑定
+extern "C" int rebind_callbacks(lua_State *L)
+{
+    debugger_context *ctx = get_context(L);
+    ctx->callback_bind_ver++;
     return 0;
 }
 
+//获取lua回调统计 返回: { 方法名 = { calls = 调用次数, errors = 出错次数, time = 累计耗时(ms) } }
+extern "C" int get_callback_stats(lua_State *L)
+{
+    debugger_context *ctx = get_context(L);
+    lua_createtable(L, 0, static_cast<int>(ctx->callback_slots.size()));
+    for (std::unordered_map<std::string, lua_callback_slot>::const_iterator iter = ctx->callback_slots.begin(); iter != ctx->callback_slots.end(); ++iter) {
+        lua_createtable(L, 0, 3);
+        lua_pushnumber(L, iter->second.calls);
+        lua_setfield(L, -2, "calls");
+        lua_pushnumber(L, iter->second.errors);
+        lua_setfield(L, -2, "errors");
+        lua_pushnumber(L, iter->second.total_time);
+        lua_setfield(L, -2, "time");
+        lua_setfield(L, -2, iter->first.c_str());
+    }
+    return 1;
+}
+
 //同步断点命中标识
 extern "C" int sync_bp_hit(lua_State *L) {
-    if(cur_hook_state == DISCONNECT_HOOK){
+    debugger_context *ctx = get_context(L);
+    if(ctx->cur_hook_state == DISCONNECT_HOOK){
         //返回参数个数
         return 0;
     }
 
-    BPhit = static_cast<int>(luaL_checkinteger(L, 1));
+    ctx->BPhit = static_cast<int>(luaL_checkinteger(L, 1));
+    return 0;
+}
+
+//同步是否区分同名文件。调用此接口说明lua支持在C中判断断点是否真实命中
+extern "C" int sync_distinguish_same_name_file(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    ctx->distinguish_same_name_file = static_cast<int>(luaL_checkinteger(L, 1));
+    ctx->native_hit_check = 1;
+    return 0;
+}
+
+//同步一个假断点(VSCode校验后发现是同名文件导致的错误命中)
+extern "C" int sync_fake_breakpoint(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    const char* opath = luaL_checkstring(L, 1);
+    int line = static_cast<int>(luaL_checkinteger(L, 2));
+    ctx->fake_breakpoint_cache[std::string(opath)].push_back(line);
     return 0;
 }
 
 //同步设置 -- 日志等级, 是否debug代码段, 是否使用忽略大小写
 extern "C" int sync_config(lua_State *L) {
-    logLevel = static_cast<int>(luaL_checkinteger(L, 1));
-    pathCaseSensitivity = static_cast<int>(luaL_checkinteger(L, 2));
+    debugger_context *ctx = get_context(L);
+    ctx->logLevel = static_cast<int>(luaL_checkinteger(L, 1));
+    ctx->pathCaseSensitivity = static_cast<int>(luaL_checkinteger(L, 2));
 //    autoPathMode = static_cast<int>(luaL_optinteger(L, 3, 0));
     return 0;
 }
 
 //同步临时文件路径
 extern "C" int sync_tempfile_path(lua_State *L) {
-    config_tempfile_path = luaL_checkstring(L, 1);
+    debugger_context *ctx = get_context(L);
+    ctx->config_tempfile_path = luaL_checkstring(L, 1);
     return 0;
 }
 
 
 //同步临时文件路径
 extern "C" int set_bp_twice_check_res(lua_State *L) {
-    bp_twice_check_res = luaL_checknumber(L, 1);
+    debugger_context *ctx = get_context(L);
+    ctx->bp_twice_check_res = luaL_checknumber(L, 1);
     return 0;
 }
 
@@ -290,119 +899,385 @@ extern "C" int sync_getLibVersion(lua_State *L) {
 
 //同步文件后缀
 extern "C" int sync_file_ext(lua_State *L) {
+    debugger_context *ctx = get_context(L);
     const char *ext = luaL_checkstring(L, 1);
-    snprintf(config_ext, sizeof(config_ext), ".%s", ext);
+    snprintf(ctx->config_ext, sizeof(ctx->config_ext), ".%s", ext);
     return 0;
 }
 
 //debugger路径
 extern "C" int sync_debugger_path(lua_State *L) {
-    debug_file_path = luaL_checkstring(L, 1);
-	debug_file_path_len = strlen(debug_file_path);
+    debugger_context *ctx = get_context(L);
+    ctx->debug_file_path = luaL_checkstring(L, 1);
+	ctx->debug_file_path_len = strlen(ctx->debug_file_path);
     return 0;
 }
 
 //tools路径
 extern "C" int sync_tools_path(lua_State *L) {
-    tools_file_path = luaL_checkstring(L, 1);
-	tools_file_path_len = strlen(tools_file_path);
+    debugger_context *ctx = get_context(L);
+    ctx->tools_file_path = luaL_checkstring(L, 1);
+	ctx->tools_file_path_len = strlen(ctx->tools_file_path);
     return 0;
 }
 
 //cwd
 extern "C" int sync_cwd(lua_State *L) {
-    config_cwd = luaL_checkstring(L, 1);
+    debugger_context *ctx = get_context(L);
+    ctx->config_cwd = luaL_checkstring(L, 1);
     return 0;
 }
 
 //同步运行状态给Lua C->lua
-void sync_runstate_toLua(lua_State *L, int state) {
+void sync_runstate_toLua(debugger_context *ctx, lua_State *L, int state) {
     debug_auto_stack _tt(L);
-    cur_run_state = state;
-    call_lua_function(L, "changeRunState", 0, state, 1);
+    //停止前先输出缓冲的记录点，保证顺序
+    flush_logpoint_buffer(ctx, L);
+    ctx->cur_run_state = state;
+    call_lua_function(ctx, L, "changeRunState", 0, state, 1);
     return;
 }
 
+//取协程的hook状态，不存在时创建。新协程继承了创建者的hook，version为0，会在首个事件中按global_hook_state重新设置
+thread_hook_state &get_thread_state(debugger_context *ctx, lua_State *L) {
+    if (L == ctx->cached_thread) {
+        return *ctx->cached_thread_state;
+    }
+    std::unordered_map<lua_State*, thread_hook_state>::iterator iter = ctx->thread_states.find(L);
+    if (iter == ctx->thread_states.end()) {
+        if (ctx->thread_states.size() >= thread_states_capacity) {
+            std::unordered_map<lua_State*, thread_hook_state>::iterator step_iter = ctx->thread_states.find(ctx->step_thread);
+            thread_hook_state step_state;
+            bool keep_step = step_iter != ctx->thread_states.end();
+            if (keep_step) {
+                step_state = step_iter->second;
+            }
+            ctx->thread_states.clear();
+            ctx->cur_thread_state = &ctx->detached_thread_state;
+            if (keep_step) {
+                ctx->thread_states[ctx->step_thread] = step_state;
+            }
+        }
+        thread_hook_state state;
+        state.hook_state = ctx->global_hook_state;
+        state.version = 0;
+        state.stackdeep_counter = 0;
+        state.last_source = NULL;
+        state.current_line = 0;
+        state.def_line = 0;
+        state.lastdef_line = 0;
+        state.installed_count = 0;
+        state.profiler_countdown = ctx->profiler_interval;
+        iter = ctx->thread_states.insert(std::make_pair(L, state)).first;
+    }
+    ctx->cached_thread = L;
+    ctx->cached_thread_state = &iter->second;
+    return iter->second;
+}
+
+void clear_thread_states(debugger_context *ctx) {
+    ctx->thread_states.clear();
+    ctx->cached_thread = NULL;
+    ctx->cached_thread_state = NULL;
+    ctx->cur_thread_state = &ctx->detached_thread_state;
+    ctx->step_thread = NULL;
+}
+
 //这个接口给lua调用，用来同步状态 lua->C
+//开始单步时记录所在的协程，并从0开始计数。协程在注册表中保持引用，单步期间不会被回收，可以安全地查询它的状态
 extern "C" int lua_set_runstate(lua_State *L) {
-    cur_run_state = static_cast<int>(luaL_checkinteger(L, 1));
+    debugger_context *ctx = get_context(L);
+    ctx->cur_run_state = static_cast<int>(luaL_checkinteger(L, 1));
+    if (ctx->cur_run_state == STEPOVER || ctx->cur_run_state == STEPIN || ctx->cur_run_state == STEPOUT) {
+        ctx->step_thread = L;
+        get_thread_state(ctx, L).stackdeep_counter = 0;
+        lua_pushthread(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, "LuaPanda_step_thread");
+    } else if (ctx->step_thread != NULL) {
+        ctx->step_thread = NULL;
+        lua_pushnil(L);
+        lua_setfield(L, LUA_REGISTRYINDEX, "LuaPanda_step_thread");
+    }
     return 0;
 }
 
+//在hook mask中加入count hook，使不返回的循环中也能定时轮询消息
+//开启采样分析时也需要count hook，取两者中较小的指令数
+int with_count_mask(debugger_context *ctx, int mask) {
+    return (ctx->hook_instruction_budget > 0 || ctx->profiler_count_instructions > 0) ? (mask | LUA_MASKCOUNT) : mask;
+}
+
+//统计函数耗时时，所有hook状态都需要CALL/RETURN事件
+int with_trace_mask(debugger_context *ctx, int mask) {
+    return ctx->trace_enabled ? (mask | LUA_MASKCALL | LUA_MASKRET) : mask;
+}
+
+//收集覆盖率时，所有hook状态都需要LINE事件
+int with_coverage_mask(debugger_context *ctx, int mask) {
+    return ctx->coverage_enabled ? (mask | LUA_MASKLINE) : mask;
+}
+
+//统计内存分配时需要CALL/RETURN事件，使采样的内存块尽快按当时的调用栈确定分配位置
+int with_alloc_mask(debugger_context *ctx, int mask) {
+    return ctx->alloc_enabled ? (mask | LUA_MASKCALL | LUA_MASKRET) : mask;
+}
+
+//调试需要的hook mask加上轮询、采样分析、函数耗时统计、覆盖率和内存分配统计需要的事件
+int hook_mask(debugger_context *ctx, int mask) {
+    return with_count_mask(ctx, with_alloc_mask(ctx, with_coverage_mask(ctx, with_trace_mask(ctx, mask))));
+}
+
+int hook_count(debugger_context *ctx) {
+    int count = ctx->hook_instruction_budget > 0 ? ctx->hook_instruction_budget : 0;
+    if (ctx->profiler_count_instructions > 0 && (count == 0 || ctx->profiler_count_instructions < count)) {
+        count = ctx->profiler_count_instructions;
+    }
+    return count;
+}
+
 //根据运行状态修改hook状态
-void sethookstate(lua_State *L, int state){
-    cur_hook_state = state;
+void sethookstate(debugger_context *ctx, lua_State *L, int state){
+    ctx->cur_hook_state = state;
+    thread_hook_state &thread_state = get_thread_state(ctx, L);
+    thread_state.hook_state = state;
+    thread_state.version = ctx->global_hook_version;
+    thread_state.installed_count = hook_count(ctx);
     switch(state){
         case DISCONNECT_HOOK:
-            lua_sethook(L, debug_hook_c, LUA_MASKRET , 1000000);
+            lua_sethook(L, debug_hook_c, hook_mask(ctx, LUA_MASKRET), hook_count(ctx));
             break;
         case LITE_HOOK:
-            lua_sethook(L, debug_hook_c, LUA_MASKRET , 0);
+            lua_sethook(L, debug_hook_c, hook_mask(ctx, LUA_MASKRET), hook_count(ctx));
             break;
         case MID_HOOK:
-            lua_sethook(L, debug_hook_c, LUA_MASKCALL | LUA_MASKRET  , 0);
+            lua_sethook(L, debug_hook_c, hook_mask(ctx, LUA_MASKCALL | LUA_MASKRET), hook_count(ctx));
             break;
         case ALL_HOOK:
-            lua_sethook(L, debug_hook_c, LUA_MASKCALL | LUA_MASKRET | LUA_MASKLINE, 0);
+            lua_sethook(L, debug_hook_c, hook_mask(ctx, LUA_MASKCALL | LUA_MASKRET | LUA_MASKLINE), hook_count(ctx));
             break;
     }
 }
 
+//采样分析、函数耗时统计、覆盖率或内存分配统计是否在进行
+int collectors_active(debugger_context *ctx) {
+    return ctx->profiler_mode != PROFILER_OFF || ctx->trace_enabled || ctx->coverage_enabled || ctx->alloc_enabled;
+}
+
+//调试结束后(endHook)的hook：不再轮询消息，只保留统计需要的事件，都不需要时移除hook
+//等待attach时如需在hook中检查请求(attach_check_count)，加上相应的count hook
+void set_detached_hook(debugger_context *ctx, lua_State *L) {
+    thread_hook_state &thread_state = get_thread_state(ctx, L);
+    thread_state.hook_state = DISCONNECT_HOOK;
+    thread_state.version = ctx->global_hook_version;
+    int mask = with_alloc_mask(ctx, with_coverage_mask(ctx, with_trace_mask(ctx, 0)));
+    int count = ctx->profiler_count_instructions;
+    int attach_count = attach_check_count(ctx);
+    if (attach_count > 0 && (count == 0 || attach_count < count)) {
+        count = attach_count;
+    }
+    thread_state.installed_count = count;
+    if (count > 0) {
+        mask |= LUA_MASKCOUNT;
+    }
+    if (mask == 0) {
+        lua_sethook(L, NULL, 0, 0);
+    } else {
+        lua_sethook(L, debug_hook_c, mask, count);
+    }
+}
+
+//设置消息轮询参数 -- 接收消息间隔(ms), 重连间隔(ms), count hook指令数(<=0不使用)。在下次设置hook状态时生效
+extern "C" int set_poll_config(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    ctx->poll_interval_ms = luaL_checknumber(L, 1);
+    ctx->reconnect_interval_ms = luaL_checknumber(L, 2);
+    ctx->hook_instruction_budget = static_cast<int>(luaL_checkinteger(L, 3));
+    ctx->next_poll_time = 0;
+    ctx->next_reconnect_time = 0;
+    return 0;
+}
+
+//hook状态或hook需要的事件变化，其他协程在下一个hook事件中重新设置
+//调试结束后只更新统计需要的事件，不改变attach等待状态
+void refresh_thread_hooks(debugger_context *ctx, lua_State *L, int state) {
+    ctx->global_hook_version++;
+    if (ctx->hook_detached) {
+        set_detached_hook(ctx, L);
+    } else {
+        sethookstate(ctx, L, state);
+    }
+}
+
 //这个接口给lua调用，用来同步hook状态 lua->C
+//lua设置hook状态说明已经在调试中，不再响应attach请求
 extern "C" int lua_set_hookstate(lua_State *L) {
-    cur_hook_state = static_cast<int>(luaL_checkinteger(L, 1));
-    sethookstate(L, cur_hook_state);
+    debugger_context *ctx = get_context(L);
+    ctx->global_hook_state = static_cast<int>(luaL_checkinteger(L, 1));
+    ctx->hook_detached = false;
+    attach_disarm(ctx);
+    refresh_thread_hooks(ctx, L, ctx->global_hook_state);
     return 0;
 }
 
-void print_to_vscode(lua_State *L, const char* msg, int level) {
-    if ( DISCONNECT != cur_run_state && level >= logLevel) {
+//在hook事件开始时调用，切换到该协程的hook状态。lua修改过全局hook状态时重新设置本协程的hook
+//返回0表示调试已结束，且没有统计需要hook事件，已移除本协程的hook
+int enter_thread_state(debugger_context *ctx, lua_State *L) {
+    thread_hook_state &thread_state = get_thread_state(ctx, L);
+    if (thread_state.version != ctx->global_hook_version) {
+        if (ctx->hook_detached) {
+            set_detached_hook(ctx, L);
+        } else {
+            sethookstate(ctx, L, ctx->global_hook_state);
+        }
+    }
+    if (ctx->hook_detached && !collectors_active(ctx) && attach_check_count(ctx) == 0) {
+        lua_sethook(L, NULL, 0, 0);
+        return 0;
+    }
+    ctx->cur_hook_state = thread_state.hook_state;
+    ctx->cur_thread_state = &thread_state;
+    return 1;
+}
+
+void print_to_vscode(debugger_context *ctx, lua_State *L, const char* msg, int level) {
+    if ( DISCONNECT != ctx->cur_run_state && level >= ctx->logLevel) {
         //打印
-        call_lua_function(L, "printToVSCode", 0, msg,  level);
+        call_lua_function(ctx, L, "printToVSCode", 0, msg,  level);
     }
 }
 
-//获取路径(带缓存)
-const char* getPath(lua_State *L,const char* source){
+//获取路径缓存节点(带缓存)，出错时返回nullptr
+path_transfer_node* getPathNode(debugger_context *ctx, lua_State *L,const char* source){
     debug_auto_stack _tt(L);
 
     if(source == nullptr){
-        print_to_vscode(L, "[C Module Error]: getPath Exception: source == nullptr", 2);
-        return "";
+        print_to_vscode(ctx, L, "[C Module Error]: getPath Exception: source == nullptr", 2);
+        return nullptr;
     }
 
     //检查缓存
-    for(auto iter = getinfo_to_format_cache.begin();iter != getinfo_to_format_cache.end();iter++)
-    {
-        if(!strcmp((*iter)->src.c_str(), source)){
-            return (*iter)->dst.c_str();
-        }
+    path_transfer_node *nd = pathcache_find(ctx, source);
+    if (nd != nullptr) {
+        ctx->pathcache_hit_count++;
+        pathcache_touch(ctx, nd, source);
+        return nd;
     }
+    ctx->pathcache_miss_count++;
 
     //若缓存中没有，到lua中转换
-    int lua_ret = call_lua_function(L, "getPath", 1 , source);
+    int lua_ret = call_lua_function(ctx, L, "getPath", 1 , source);
     if (lua_ret != 0) {
-        return "";
+        return nullptr;
     }
     const char* retSource = lua_tostring(L, -1);
+    if (retSource == nullptr) {
+        return nullptr;
+    }
     //加入缓存,返回
-    path_transfer_node *nd = new path_transfer_node(source, retSource );
-    getinfo_to_format_cache.push_back(nd);
+    return pathcache_insert(ctx, source, retSource);
+}
+
+//获取路径(带缓存)
+const char* getPath(debugger_context *ctx, lua_State *L,const char* source){
+    path_transfer_node *nd = getPathNode(ctx, L, source);
+    if (nd == nullptr) {
+        return "";
+    }
+    return nd->dst.c_str();
+}
+
+//根据all_breakpoint_map重建断点行号索引
+void build_breakpoint_index(debugger_context *ctx) {
+    ctx->breakpoint_index.clear();
+    std::map<std::string, std::multimap<int, breakpoint> >::const_iterator iter1;
+    std::multimap<int, breakpoint>::const_iterator iter2;
+    for (iter1 = ctx->all_breakpoint_map.begin(); iter1 != ctx->all_breakpoint_map.end(); ++iter1) {
+        file_breakpoint_index &file_index = ctx->breakpoint_index[iter1->first];
+        //std::multimap按行号升序遍历，sorted_lines无需再排序
+        for (iter2 = iter1->second.begin(); iter2 != iter1->second.end(); ++iter2) {
+            if (file_index.sorted_lines.empty() || file_index.sorted_lines.back() != iter2->first) {
+                file_index.sorted_lines.push_back(iter2->first);
+            }
+            file_index.set_line(iter2->first);
+            file_index.line_breakpoints[iter2->first].push_back(iter2->second);
+        }
+    }
+    ctx->breakpoint_index_ver++;
+}
+
+//获取路径缓存节点对应文件的断点索引，本文件无断点时返回nullptr
+const file_breakpoint_index* get_file_breakpoint_index(debugger_context *ctx, path_transfer_node* nd) {
+    if (nd->bp_index_ver != ctx->breakpoint_index_ver) {
+        std::unordered_map<std::string, file_breakpoint_index>::const_iterator iter = ctx->breakpoint_index.find(nd->dst);
+        nd->bp_index = (iter == ctx->breakpoint_index.end()) ? nullptr : &iter->second;
+        nd->bp_index_ver = ctx->breakpoint_index_ver;
+        nd->opath_match.clear();
+    }
+    return nd->bp_index;
+}
+
+//获取source经formatOpath和truncatedPath处理后的路径(带缓存)
+const std::string& get_formated_opath(debugger_context *ctx, lua_State *L, path_transfer_node *nd) {
+    if (!nd->opath_ready) {
+        debug_auto_stack _tt(L);
+        nd->opath_ready = true;
+        if (call_lua_function(ctx, L, "getFormatedOpath", 1, nd->src.c_str()) == 0) {
+            const char* opath = lua_tostring(L, -1);
+            if (opath != nullptr) {
+                nd->opath = opath;
+            }
+        }
+    }
+    return nd->opath;
+}
+
+//断点的fullpath是否就是nd对应的文件(区分同名文件)，结果缓存在路径节点中
+int check_opath_match(debugger_context *ctx, lua_State *L, path_transfer_node *nd, const std::string &fullpath) {
+    if (fullpath.empty()) {
+        return 1;
+    }
+    std::unordered_map<std::string, bool>::const_iterator iter = nd->opath_match.find(fullpath);
+    if (iter != nd->opath_match.end()) {
+        return iter->second ? 1 : 0;
+    }
+
+    debug_auto_stack _tt(L);
+    const std::string &opath = get_formated_opath(ctx, L, nd);
+    // 调用出错时按匹配处理，交给VSCode端二次校验
+    int is_match = 1;
+    if (call_lua_function(ctx, L, "isOpathMatchBreakpoint", 1, fullpath.c_str(), opath.c_str()) == 0) {
+        is_match = lua_toboolean(L, -1);
+    }
+    nd->opath_match[fullpath] = (is_match != 0);
+    return is_match;
+}
 
-    return retSource;
+// 在假断点缓存中查询此行是否被VSCode校验为错误命中
+int check_fake_breakpoint(debugger_context *ctx, lua_State *L, path_transfer_node *nd, int line) {
+    if (ctx->fake_breakpoint_cache.empty()) {
+        return 0;
+    }
+    std::unordered_map<std::string, std::vector<int> >::const_iterator iter = ctx->fake_breakpoint_cache.find(get_formated_opath(ctx, L, nd));
+    if (iter == ctx->fake_breakpoint_cache.end()) {
+        iter = ctx->fake_breakpoint_cache.find(nd->src);
+    }
+    if (iter == ctx->fake_breakpoint_cache.end()) {
+        return 0;
+    }
+    return std::find(iter->second.begin(), iter->second.end(), line) != iter->second.end();
 }
 
 // 向 lua 中 checkRealHitBreakpoint 查询是否在缓存中，以判断是否真正命中断点
-const int checkRealHitBreakpoint(lua_State *L,const char* source, int line){
+const int checkRealHitBreakpoint(debugger_context *ctx, lua_State *L,const char* source, int line){
     debug_auto_stack _tt(L);
 
     if(source == nullptr){
-        print_to_vscode(L, "[C Module Error]: checkRealHitBreakpoint Exception: source == nullptr", 2);
+        print_to_vscode(ctx, L, "[C Module Error]: checkRealHitBreakpoint Exception: source == nullptr", 2);
         return 0;
     }
 
     //若缓存中没有，到lua中转换
-    int lua_ret = call_lua_function(L, "checkRealHitBreakpoint", 1 , source, line);
+    int lua_ret = call_lua_function(ctx, L, "checkRealHitBreakpoint", 1 , source, line);
     if (lua_ret != 0) {
         return 0;
     }
@@ -410,33 +1285,522 @@ const int checkRealHitBreakpoint(lua_State *L,const char* source, int line){
     return realHit;
 }
 
-//供lua调用,把断点列表同步给c端
-extern "C" int sync_breakpoints(lua_State *L) {
+//------------条件断点------------
+//C中编译和执行表达式(条件断点，记录点)所需的接口是否可用。win下slua-ue只提供固定的接口表，此时仍交给lua处理
+int native_eval_available() {
+#if !defined(USE_SOURCE_CODE) && defined(_WIN32)
+#if LUA_VERSION_NUM == 501
+    if (luaL_loadbuffer == NULL || lua_getfenv == NULL || lua_setfenv == NULL) {
+        return 0;
+    }
+#else
+    if (luaL_loadbufferx == NULL || lua_setupvalue == NULL) {
+        return 0;
+    }
+#endif
+    return lua_createtable != NULL && lua_pushvalue != NULL && lua_setfield != NULL && lua_setmetatable != NULL &&
+           lua_getstack != NULL && lua_getlocal != NULL && lua_getupvalue != NULL &&
+           luaL_ref != NULL && luaL_unref != NULL && lua_rawgeti != NULL && lua_topointer != NULL;
+#else
+    return 1;
+#endif
+}
+
+//编译表达式，并把chunk存入registry。编译出错时报告错误并返回LUA_NOREF
+int compile_expression(debugger_context *ctx, lua_State *L, const std::string &expr, const char *err_prefix) {
     debug_auto_stack _tt(L);
-    //取数组
-    lua_getglobal(L, LUA_DEBUGGER_NAME);     //-1 LuaPanda
-    if (!lua_istable(L, -1)) {
-        print_to_vscode(L, "[C Module Error] debug_ishit_bk get LUA_DEBUGGER_NAME error", 2);
-        return -1;
+    //和lua中processWatchedExp的处理一致
+    std::string chunk = "return " + expr;
+    if (luaL_loadbuffer(L, chunk.c_str(), chunk.size(), "=LuaPanda expression") != 0) {
+        const char *lua_error = lua_tostring(L, -1);
+        std::string err_msg = err_prefix;
+        err_msg += expr;
+        err_msg += "  error: ";
+        err_msg += lua_error != nullptr ? lua_error : "unknown";
+        print_to_vscode(ctx, L, err_msg.c_str(), 2);
+        return LUA_NOREF;
     }
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    ctx->condition_chunk_refs.push_back(ref);
+    return ref;
+}
 
-    lua_getfield(L, -1, "breaks");
-    if (!lua_istable(L, -1)) {
-        print_to_vscode(L, "[C Module Error] debug_ishit_bk get breaks error", 2);
-        return -1;
+//编译条件表达式。编译错误只在同步断点时报告一次
+void compile_condition(debugger_context *ctx, lua_State *L, breakpoint &bp, const std::string &condition) {
+    if (!native_eval_available()) {
+        return;
+    }
+    bp.condition_ref = compile_expression(ctx, L, condition, "[C Module] Condition breakpoint compile error. condition: ");
+    bp.condition_error = (bp.condition_ref == LUA_NOREF);
+}
+
+//释放所有已编译的条件表达式
+void release_condition_chunks(debugger_context *ctx, lua_State *L) {
+    for (std::vector<int>::const_iterator iter = ctx->condition_chunk_refs.begin(); iter != ctx->condition_chunk_refs.end(); ++iter) {
+        luaL_unref(L, LUA_REGISTRYINDEX, *iter);
+    }
+    ctx->condition_chunk_refs.clear();
+}
+
+//把当前用户函数(hook中栈第0层)的upvalue和局部变量放入一个新表，作为条件表达式的环境压栈
+//局部变量覆盖同名upvalue，找不到的变量到函数的环境(_ENV/fenv)中查找
+int push_condition_env(lua_State *L) {
+    lua_Debug frame;
+    if (lua_getstack(L, 0, &frame) == 0) {
+        return 0;
+    }
+    lua_createtable(L, 0, 8);
+    int env_idx = lua_gettop(L);
+    lua_getinfo(L, "f", &frame);
+    int func_idx = lua_gettop(L);
+    int fallback_idx = 0;
+
+    const char *name;
+    for (int i = 1; (name = lua_getupvalue(L, func_idx, i)) != nullptr; i++) {
+        if (!strcmp(name, "_ENV")) {
+            //留在栈上作为__index
+            fallback_idx = lua_gettop(L);
+            continue;
+        }
+        if (name[0] == '\0' || name[0] == '(') {
+            lua_pop(L, 1);
+            continue;
+        }
+        lua_setfield(L, env_idx, name);
+    }
+    for (int i = 1; (name = lua_getlocal(L, &frame, i)) != nullptr; i++) {
+        //跳过(*temporary) (vararg)等内部变量
+        if (name[0] == '(') {
+            lua_pop(L, 1);
+            continue;
+        }
+        lua_setfield(L, env_idx, name);
+    }
+
+    lua_createtable(L, 0, 1);
+    if (fallback_idx != 0) {
+        lua_pushvalue(L, fallback_idx);
+    } else {
+#if LUA_VERSION_NUM == 501
+        lua_getfenv(L, func_idx);
+#else
+        lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+#endif
+    }
+    lua_setfield(L, -2, "__index");
+    lua_setmetatable(L, env_idx);
+    lua_settop(L, env_idx);
+    return 1;
+}
+
+//在当前用户函数的环境中执行已编译的表达式，成功时返回1并把结果压栈
+int call_compiled_chunk(lua_State *L, int chunk_ref) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, chunk_ref);
+    if (!push_condition_env(L)) {
+        return 0;
+    }
+#if LUA_VERSION_NUM == 501
+    lua_setfenv(L, -2);
+#else
+    lua_setupvalue(L, -2, 1);
+#endif
+    return lua_pcall(L, 0, 1, 0) == 0;
+}
+
+//执行已编译的条件表达式，返回条件是否成立。运行出错按不成立处理
+int eval_condition(lua_State *L, const breakpoint &bp) {
+    if (bp.condition_error) {
+        return 0;
+    }
+    debug_auto_stack _tt(L);
+    if (!call_compiled_chunk(L, bp.condition_ref)) {
+        return 0;
+    }
+    return lua_toboolean(L, -1);
+}
+
+//条件断点是否已在C中编译(或编译失败)，可以不经过lua判断
+bool is_condition_compiled(const breakpoint &bp) {
+    return bp.condition_ref != LUA_NOREF || bp.condition_error;
+}
+
+//判断条件是否成立。未在C中编译时交给lua的IsMeetCondition
+//stack_level 是lua中用户函数所在的栈层级，为0时使用lua中的默认值
+int is_meet_condition(debugger_context *ctx, lua_State *L, const breakpoint &bp, const std::string &condition, int stack_level) {
+    if (is_condition_compiled(bp)) {
+        return eval_condition(L, bp);
+    }
+    debug_auto_stack _tt(L);
+    int lua_ret = stack_level > 0 ? call_lua_function(ctx, L, "IsMeetCondition", 1, condition.c_str(), stack_level)
+                                  : call_lua_function(ctx, L, "IsMeetCondition", 1, condition.c_str());
+    if (lua_ret != 0) {
+        return 0;
+    }
+    return lua_toboolean(L, -1);
+}
+
+//------------命中次数断点------------
+//解析命中条件 "N" "==N" ">N" ">=N" "<N" "<=N" "%N"，格式错误返回0
+int parse_hit_condition(breakpoint &bp) {
+    const char *p = bp.info.c_str();
+    while (*p == ' ' || *p == '\t') p++;
+
+    hit_condition_op op = HIT_EQUAL;
+    if (p[0] == '=') {
+        p += (p[1] == '=') ? 2 : 1;
+    } else if (p[0] == '>') {
+        op = (p[1] == '=') ? HIT_GREATER_EQUAL : HIT_GREATER;
+        p += (p[1] == '=') ? 2 : 1;
+    } else if (p[0] == '<') {
+        op = (p[1] == '=') ? HIT_LESS_EQUAL : HIT_LESS;
+        p += (p[1] == '=') ? 2 : 1;
+    } else if (p[0] == '%') {
+        op = HIT_MULTIPLE;
+        p++;
+    }
+    while (*p == ' ' || *p == '\t') p++;
+
+    if (*p < '0' || *p > '9') {
+        return 0;
+    }
+    long target = 0;
+    while (*p >= '0' && *p <= '9') {
+        target = target * 10 + (*p++ - '0');
+        if (target > 0x7fffffff) {
+            return 0;
+        }
+    }
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p != '\0' || (op == HIT_MULTIPLE && target == 0)) {
+        return 0;
+    }
+
+    bp.hit_op = op;
+    bp.hit_target = static_cast<int>(target);
+    return 1;
+}
+
+//从lua断点表(栈顶)中读取命中次数断点
+void read_hit_condition_breakpoint(debugger_context *ctx, lua_State *L, breakpoint &bp) {
+    bp.type = HIT_CONDITION_BREAKPOINT;
+
+    lua_getfield(L, -1, "hitCondition");
+    const char* hit_condition = lua_tostring(L, -1);
+    bp.info = hit_condition != nullptr ? hit_condition : "";
+    lua_pop(L, 1); // hitCondition
+    if (!parse_hit_condition(bp)) {
+        std::string err_msg = "[C Module] Invalid hit condition: " + bp.info;
+        print_to_vscode(ctx, L, err_msg.c_str(), 2);
+    }
+
+    lua_getfield(L, -1, "condition");
+    const char* condition = lua_tostring(L, -1);
+    bp.condition = condition != nullptr ? condition : "";
+    lua_pop(L, 1); // condition
+    if (!bp.condition.empty()) {
+        compile_condition(ctx, L, bp, bp.condition);
+    }
+}
+
+//命中次数断点是否命中。附带条件时只统计条件成立的次数；无条件时不会调用lua
+int check_hit_condition(debugger_context *ctx, lua_State *L, const breakpoint &bp, int stack_level) {
+    if (bp.hit_op == HIT_INVALID) {
+        return 0;
+    }
+    if (!bp.condition.empty() && !is_meet_condition(ctx, L, bp, bp.condition, stack_level)) {
+        return 0;
+    }
+
+    bp.hit_count++;
+    switch (bp.hit_op) {
+        case HIT_EQUAL:
+            return bp.hit_count == bp.hit_target;
+        case HIT_GREATER:
+            return bp.hit_count > bp.hit_target;
+        case HIT_GREATER_EQUAL:
+            return bp.hit_count >= bp.hit_target;
+        case HIT_LESS:
+            return bp.hit_count < bp.hit_target;
+        case HIT_LESS_EQUAL:
+            return bp.hit_count <= bp.hit_target;
+        case HIT_MULTIPLE:
+            return bp.hit_count % bp.hit_target == 0;
+        default:
+            return 0;
+    }
+}
+
+//------------记录点------------
+//是否是简单变量名
+bool is_lua_name(const std::string &str) {
+    if (str.empty() || (str[0] >= '0' && str[0] <= '9')) {
+        return false;
+    }
+    for (std::string::const_iterator iter = str.begin(); iter != str.end(); ++iter) {
+        char c = *iter;
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//解析记录点模板。{expr}为表达式，{{和}}输出花括号本身，未闭合的{按文本处理
+void parse_logpoint_template(debugger_context *ctx, lua_State *L, breakpoint &bp) {
+    if (!native_eval_available()) {
+        return;
+    }
+    const std::string &tpl = bp.info;
+    std::string literal = "[LogPoint Output]: ";
+    size_t pos = 0;
+    while (pos < tpl.size()) {
+        char c = tpl[pos];
+        if ((c == '{' || c == '}') && pos + 1 < tpl.size() && tpl[pos + 1] == c) {
+            literal += c;
+            pos += 2;
+            continue;
+        }
+        size_t close = (c == '{') ? tpl.find('}', pos + 1) : std::string::npos;
+        if (close == std::string::npos) {
+            literal += c;
+            pos++;
+            continue;
+        }
+
+        if (!literal.empty()) {
+            logpoint_segment text_seg;
+            text_seg.text.swap(literal);
+            bp.log_segments.push_back(text_seg);
+        }
+
+        logpoint_segment expr_seg;
+        expr_seg.is_expr = true;
+        expr_seg.text = tpl.substr(pos + 1, close - pos - 1);
+        expr_seg.is_name = is_lua_name(expr_seg.text);
+        expr_seg.chunk_ref = compile_expression(ctx, L, expr_seg.text, "[C Module] Log point expression compile error. expression: ");
+        bp.log_segments.push_back(expr_seg);
+        pos = close + 1;
+    }
+    if (!literal.empty()) {
+        logpoint_segment text_seg;
+        text_seg.text.swap(literal);
+        bp.log_segments.push_back(text_seg);
+    }
+    bp.log_native = true;
+}
+
+//按名字查找当前用户函数的局部变量和upvalue，找到时压栈并返回1
+int push_frame_variable(lua_State *L, const lua_Debug *frame, const char *var_name) {
+    //同名局部变量取最后一个(最内层作用域)
+    int local_idx = 0;
+    const char *name;
+    for (int i = 1; (name = lua_getlocal(L, frame, i)) != nullptr; i++) {
+        if (!strcmp(name, var_name)) {
+            local_idx = i;
+        }
+        lua_pop(L, 1);
+    }
+    if (local_idx != 0) {
+        lua_getlocal(L, frame, local_idx);
+        return 1;
+    }
+
+    lua_getinfo(L, "f", const_cast<lua_Debug*>(frame));
+    int func_idx = lua_gettop(L);
+    for (int i = 1; (name = lua_getupvalue(L, func_idx, i)) != nullptr; i++) {
+        if (!strcmp(name, var_name)) {
+            return 1;
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    return 0;
+}
+
+//把栈上的值格式化到out中。不调用__tostring，避免在hook中执行用户代码
+void append_lua_value(lua_State *L, int idx, std::string &out) {
+    static const char *type_names[] = { "nil", "boolean", "userdata", "number", "string", "table", "function", "userdata", "thread" };
+    int type = lua_type(L, idx);
+    switch (type) {
+        case LUA_TNIL:
+            out += "nil";
+            break;
+        case LUA_TBOOLEAN:
+            out += lua_toboolean(L, idx) ? "true" : "false";
+            break;
+        case LUA_TNUMBER: {
+            //lua_tostring会把number原地转为string，转换副本
+            lua_pushvalue(L, idx);
+            const char *str = lua_tostring(L, -1);
+            out += str != nullptr ? str : "";
+            lua_pop(L, 1);
+            break;
+        }
+        case LUA_TSTRING: {
+            size_t len = 0;
+            const char *str = lua_tolstring(L, idx, &len);
+            out.append(str, len);
+            break;
+        }
+        default: {
+            char buf[64];
+            const char *type_name = (type >= 0 && type < static_cast<int>(sizeof(type_names) / sizeof(type_names[0]))) ? type_names[type] : "unknown";
+            snprintf(buf, sizeof(buf), "%s: %p", type_name, lua_topointer(L, idx));
+            out += buf;
+            break;
+        }
+    }
+}
+
+//把缓冲区中的记录点输出一次性发送给VSCode
+void flush_logpoint_buffer(debugger_context *ctx, lua_State *L) {
+    if (ctx->logpoint_ring_count == 0) {
+        return;
+    }
+    std::string log_message;
+    size_t capacity = ctx->logpoint_ring.size();
+    for (size_t i = 0; i < ctx->logpoint_ring_count; i++) {
+        std::string &line = ctx->logpoint_ring[(ctx->logpoint_ring_head + i) % capacity];
+        if (i != 0) {
+            log_message += '\n';
+        }
+        log_message += line;
+        line.clear();
+    }
+    ctx->logpoint_ring_head = 0;
+    ctx->logpoint_ring_count = 0;
+
+    debug_auto_stack _tt(L);
+    call_lua_function(ctx, L, "printToVSCode", 0, log_message.c_str(), 2, 2);
+}
+
+//丢弃缓冲区中的记录点输出
+void clear_logpoint_buffer(debugger_context *ctx) {
+    for (std::vector<std::string>::iterator iter = ctx->logpoint_ring.begin(); iter != ctx->logpoint_ring.end(); ++iter) {
+        iter->clear();
+    }
+    ctx->logpoint_ring_head = 0;
+    ctx->logpoint_ring_count = 0;
+}
+
+//记录点输出放入缓冲区。缓冲区满或最早的输出超时时发送
+void push_logpoint_buffer(debugger_context *ctx, lua_State *L, std::string &line, double now) {
+    if (ctx->logpoint_ring.size() != ctx->logpoint_buffer_capacity) {
+        flush_logpoint_buffer(ctx, L);
+        ctx->logpoint_ring.resize(ctx->logpoint_buffer_capacity);
+    }
+    if (ctx->logpoint_ring_count == ctx->logpoint_ring.size()) {
+        flush_logpoint_buffer(ctx, L);
+    }
+    ctx->logpoint_ring[(ctx->logpoint_ring_head + ctx->logpoint_ring_count) % ctx->logpoint_ring.size()].swap(line);
+    ctx->logpoint_ring_count++;
+    if (ctx->logpoint_ring_count == 1) {
+        ctx->logpoint_oldest_time = now;
+    }
+    if (now - ctx->logpoint_oldest_time >= ctx->logpoint_flush_interval) {
+        flush_logpoint_buffer(ctx, L);
+    }
+}
+
+//每个记录点每秒最多输出logpoint_rate_limit条，超出的丢弃并计数
+int logpoint_rate_check(debugger_context *ctx, const breakpoint &bp, double now) {
+    if (ctx->logpoint_rate_limit <= 0) {
+        return 1;
+    }
+    if (now - bp.log_window_start >= 1000) {
+        bp.log_window_start = now;
+        bp.log_window_count = 0;
+    }
+    if (bp.log_window_count >= ctx->logpoint_rate_limit) {
+        bp.log_suppressed++;
+        return 0;
+    }
+    bp.log_window_count++;
+    return 1;
+}
+
+//处理命中的记录点：限流，按模板格式化，放入缓冲区
+void emit_logpoint(debugger_context *ctx, lua_State *L, const breakpoint &bp) {
+    double now = monotonic_ms();
+    if (!logpoint_rate_check(ctx, bp, now)) {
+        return;
+    }
+
+    debug_auto_stack _tt(L);
+    lua_Debug frame;
+    int has_frame = lua_getstack(L, 0, &frame);
+    std::string line;
+    for (std::vector<logpoint_segment>::const_iterator iter = bp.log_segments.begin(); iter != bp.log_segments.end(); ++iter) {
+        if (!iter->is_expr) {
+            line += iter->text;
+            continue;
+        }
+        int top = lua_gettop(L);
+        if (has_frame && iter->is_name && push_frame_variable(L, &frame, iter->text.c_str())) {
+            append_lua_value(L, -1, line);
+        } else if (iter->chunk_ref != LUA_NOREF && call_compiled_chunk(L, iter->chunk_ref)) {
+            append_lua_value(L, -1, line);
+        } else {
+            line += '{';
+            line += iter->text;
+            line += '}';
+        }
+        lua_settop(L, top);
+    }
+    if (bp.log_suppressed > 0) {
+        line += "  (";
+        line += std::to_string(bp.log_suppressed);
+        line += " suppressed)";
+        bp.log_suppressed = 0;
+    }
+    push_logpoint_buffer(ctx, L, line, now);
+}
+
+//设置记录点参数 -- 每个记录点每秒最多输出条数, 缓冲最长毫秒数, 缓冲区行数
+extern "C" int set_logpoint_config(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    ctx->logpoint_rate_limit = static_cast<int>(luaL_checkinteger(L, 1));
+    ctx->logpoint_flush_interval = static_cast<double>(luaL_checkinteger(L, 2));
+    int capacity = static_cast<int>(luaL_checkinteger(L, 3));
+    ctx->logpoint_buffer_capacity = capacity > 0 ? static_cast<size_t>(capacity) : 1;
+    flush_logpoint_buffer(ctx, L);
+    return 0;
+}
+
+//供lua调用,把断点列表同步给c端
+extern "C" int sync_breakpoints(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    debug_auto_stack _tt(L);
+    //取数组
+    lua_getglobal(L, LUA_DEBUGGER_NAME);     //-1 LuaPanda
+    if (!lua_istable(L, -1)) {
+        print_to_vscode(ctx, L, "[C Module Error] debug_ishit_bk get LUA_DEBUGGER_NAME error", 2);
+        return -1;
+    }
+
+    lua_getfield(L, -1, "breaks");
+    if (!lua_istable(L, -1)) {
+        print_to_vscode(ctx, L, "[C Module Error] debug_ishit_bk get breaks error", 2);
+        return -1;
     }
 
     //遍历breaks
-    all_breakpoint_map.clear();
+    ctx->all_breakpoint_map.clear();
+    //hook会跳过debugger自身的代码，同步期间不会用到旧的条件表达式
+    release_condition_chunks(ctx, L);
+    //断点变化时lua会清空fakeBreakPointCache，这里保持一致
+    ctx->fake_breakpoint_cache.clear();
     lua_pushnil(L);//breaks nil
     while (lua_next(L, -2)) {
         //breaks   k（string）   v(table)
         const char* source = luaL_checkstring(L, -2);
 
-        std::map<int, breakpoint> file_breakpoint_map;
+        std::multimap<int, breakpoint> file_breakpoint_map;
         lua_pushnil(L);//k，v, nil
         while (lua_next(L, -2)) {
-            if(lua_debugger_ver >= 30150){
+            if(ctx->lua_debugger_ver >= 30150){
+                //k(fullpath), v
+                const char* fullpath = lua_tostring(L, -2);
                 lua_pushnil(L);//k，v, nil
                 while (lua_next(L, -2)) {
                     //k,v,k,v
@@ -449,6 +1813,7 @@ extern "C" int sync_breakpoints(lua_State *L) {
                     lua_pop(L, 1); // type
                     
                     struct breakpoint bp;
+                    bp.opath = fullpath != nullptr ? fullpath : "";
                     switch (type) {
                         case CONDITION_BREAKPOINT: {
                             bp.type = CONDITION_BREAKPOINT;
@@ -457,6 +1822,7 @@ extern "C" int sync_breakpoints(lua_State *L) {
                             const char* condition = luaL_checkstring(L, -1);
                             lua_pop(L, 1); // condition
                             bp.info = condition;
+                            compile_condition(ctx, L, bp, bp.info);
                             break;
                         }
                             
@@ -467,6 +1833,7 @@ extern "C" int sync_breakpoints(lua_State *L) {
                             const char* log_message = luaL_checkstring(L, -1);
                             lua_pop(L, 1); // logMessage
                             bp.info = log_message;
+                            parse_logpoint_template(ctx, L, bp);
                             break;
                         }
                             
@@ -475,13 +1842,17 @@ extern "C" int sync_breakpoints(lua_State *L) {
                             
                             bp.info = std::to_string(line);
                             break;
+
+                        case HIT_CONDITION_BREAKPOINT:
+                            read_hit_condition_breakpoint(ctx, L, bp);
+                            break;
                             
                         default:
-                            print_to_vscode(L, "[C Module Error] Invalid breakpoint type!", 2);
+                            print_to_vscode(ctx, L, "[C Module Error] Invalid breakpoint type!", 2);
                             return -1;
                     }
                     
-                    file_breakpoint_map[line] = bp;
+                    file_breakpoint_map.insert(std::make_pair(line, bp));
                     
                     lua_pop(L, 1);//value
                     //k,v,k
@@ -508,6 +1879,7 @@ extern "C" int sync_breakpoints(lua_State *L) {
                         const char* condition = luaL_checkstring(L, -1);
                         lua_pop(L, 1); // condition
                         bp.info = condition;
+                        compile_condition(ctx, L, bp, bp.info);
                         break;
                     }
                         
@@ -526,216 +1898,3700 @@ extern "C" int sync_breakpoints(lua_State *L) {
                         
                         bp.info = std::to_string(line);
                         break;
+
+                    case HIT_CONDITION_BREAKPOINT:
+                        read_hit_condition_breakpoint(ctx, L, bp);
+                        break;
                         
                     default:
-                        print_to_vscode(L, "[C Module Error] Invalid breakpoint type!", 2);
+                        print_to_vscode(ctx, L, "[C Module Error] Invalid breakpoint type!", 2);
                         return -1;
                 }
                 
-                file_breakpoint_map[line] = bp;
+                file_breakpoint_map.insert(std::make_pair(line, bp));
                 
                 lua_pop(L, 1);//value
  
             }
         }
-        all_breakpoint_map[std::string(source)] = file_breakpoint_map;
-        //k,v
-        lua_pop(L, 1);//外部每次循环
-        //k
+        ctx->all_breakpoint_map[std::string(source)] = file_breakpoint_map;
+        //k,v
+        lua_pop(L, 1);//外部每次循环
+        //k
+    }
+    lua_pop(L, 1);//外部每次循环
+    build_breakpoint_index(ctx);
+
+    print_all_breakpoint_map(ctx, L);
+    //断点变化后其他协程按全局hook状态重新设置，当前协程按最近的位置判断
+    ctx->global_hook_version++;
+    thread_hook_state &thread_state = get_thread_state(ctx, L);
+    if (thread_state.last_source != NULL) {
+        check_hook_state(ctx, L, thread_state.last_source, thread_state.current_line, thread_state.def_line, thread_state.lastdef_line);
+    } else {
+        check_hook_state(ctx, L, ctx->last_source, ctx->ar_current_line ,ctx->ar_def_line, ctx->ar_lastdef_line);
+    }
+    return 0;
+}
+
+//在C中判断断点是否真实命中. 区分同名文件, 过滤假断点, 并根据断点类型处理
+int native_ishit_bk(debugger_context *ctx, lua_State *L, path_transfer_node *path_node, const file_breakpoint_index *file_index, int current_line) {
+    const std::vector<breakpoint> *bps = file_index->find_breakpoints(current_line);
+    if (bps == nullptr || check_fake_breakpoint(ctx, L, path_node, current_line)) {
+        return 0;
+    }
+
+    for (std::vector<breakpoint>::const_iterator iter = bps->begin(); iter != bps->end(); ++iter) {
+        if (ctx->distinguish_same_name_file && !check_opath_match(ctx, L, path_node, iter->opath)) {
+            continue;
+        }
+
+        switch (iter->type) {
+            // 直接从hook调用, 用户函数位于栈第3层
+            case CONDITION_BREAKPOINT:
+                return is_meet_condition(ctx, L, *iter, iter->info, 3);
+
+            case HIT_CONDITION_BREAKPOINT:
+                return check_hit_condition(ctx, L, *iter, 3);
+
+            case LOG_POINT: {
+                if (iter->log_native) {
+                    emit_logpoint(ctx, L, *iter);
+                    return 0;
+                }
+                std::string log_message = "[LogPoint Output]: ";
+                log_message.append(iter->info);
+                call_lua_function(ctx, L, "printToVSCode", 0, log_message.c_str(), 2, 2);
+                return 0;
+            }
+
+            default:
+                return 1;
+        }
+    }
+    return 0;
+}
+
+//断点命中判断
+int debug_ishit_bk(debugger_context *ctx, lua_State *L, const char * curPath, int current_line) {
+    debug_auto_stack _tt(L);
+    // 获取标准路径[文件名.后缀]
+    path_transfer_node *path_node = getPathNode(ctx, L, curPath);
+    if (path_node == nullptr) {
+        return 0;
+    }
+    // 判断是否存在同名文件, 以及是否存在相同行号
+    const file_breakpoint_index *file_index = get_file_breakpoint_index(ctx, path_node);
+    if (file_index == nullptr || !file_index->has_line(current_line)) {
+        return 0;
+    }
+    const char *standardPath = path_node->dst.c_str();
+
+    if(ctx->native_hit_check){
+        // 在C中区分同名文件，过滤假断点。只有确认命中条件断点/记录点时才调用lua
+        return native_ishit_bk(ctx, L, path_node, file_index, current_line);
+    }else if(ctx->lua_debugger_ver >= 30160){
+        // luapanda.lua >= 3.1.6 才会调用
+        // 初步命中，到lua层中检测是否真正命中，以及断点类型
+        int lua_ret = call_lua_function(ctx, L, "isHitBreakpoint", 1, standardPath, curPath, current_line);
+        if (lua_ret != 0) {
+            // 调用出错时，按命中处理
+            return 1;
+        }
+        
+        int realHit = lua_toboolean(L, -1);
+        return realHit;
+    }else{
+        // 兼容旧版本
+        const breakpoint *bp = &file_index->find_breakpoints(current_line)->front();
+        // 条件断点
+        if (bp->type == CONDITION_BREAKPOINT) {
+            return is_meet_condition(ctx, L, *bp, bp->info, 0);
+        }
+
+        // 命中次数断点
+        if (bp->type == HIT_CONDITION_BREAKPOINT) {
+            return check_hit_condition(ctx, L, *bp, 0);
+        }
+        
+        // 记录点
+        if (bp->type == LOG_POINT) {
+            std::string log_message = "[log point output]: ";
+            log_message.append(bp->info);
+            print_to_vscode(ctx, L, log_message.c_str() , 1);
+            return 0;
+        }
+        return 1;
+    }
+}
+
+//判断字符串是否匹配[string "
+int isCodeSection(char *str) {
+    if (strlen(str) > 9) {
+        if (str[0] == '[' && str[7] == ' ' && str[8] == '"') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//断点命中判断 retuen : is_hit
+int breakpoint_process(debugger_context *ctx, lua_State *L, lua_Debug *ar){
+    int is_hit = 0;
+    if (ar->event == LINE) {
+        is_hit = debug_ishit_bk(ctx, L, ar->source, ar->currentline);
+        // 同名文件可能会命中假断点 folder1/a.lua 和 folder2/a.lua 截取文件名都是 a.lua, 可能导致命中混淆
+        if(is_hit && ctx->lua_debugger_ver >= 30160 && !ctx->native_hit_check){
+            // luapanda.lua >= 3.1.6 版本才会调用
+            is_hit = checkRealHitBreakpoint(ctx, L, ar->source, ar->currentline);
+        }
+
+        if (is_hit == 1 || ctx->BPhit) {
+            print_to_vscode(ctx, L, "[C Module] Breakpoint hit!");
+            int record_stackdeep_counter = ctx->cur_thread_state->stackdeep_counter;
+            int record_cur_run_state = ctx->cur_run_state;
+            ctx->cur_thread_state->stackdeep_counter = 0;
+            sync_runstate_toLua(ctx, L, HIT_BREAKPOINT);
+            ctx->bp_twice_check_res = 1;
+            //c层掌握 STEPOVER 计数器，状态机放在lua层，c主要去读（毕竟C作为lua的扩展）
+            //通知lua层,lua层阻塞，发消息
+            if(ctx->BPhit){
+                ctx->BPhit = 0;
+                call_lua_function(ctx, L, "SendMsgWithStack", 0, "stopOnCodeBreakpoint");
+            }else{
+                call_lua_function(ctx, L, "SendMsgWithStack", 0, "stopOnBreakpoint");
+                if( ctx->bp_twice_check_res == 0 ){
+                    is_hit = 0;
+                    ctx->cur_thread_state->stackdeep_counter = record_stackdeep_counter;
+                    sync_runstate_toLua(ctx, L, record_cur_run_state);
+                }
+            }
+        }
+    }
+    return is_hit;
+}
+
+//开始单步的协程是否还在执行中(正在运行或resume了其他协程)。已yield、出错或函数已全部返回时不再执行
+int step_thread_running(debugger_context *ctx) {
+    lua_Debug ar;
+    return ctx->step_thread != NULL && lua_status(ctx->step_thread) == 0 && lua_getstack(ctx->step_thread, 0, &ar) != 0;
+}
+
+//单步处理
+//STEPOVER/STEPOUT只在开始单步的协程中计数和停止，其他协程(如被resume的协程)直接运行；STEPIN在任意协程的下一行停止
+//开始单步的协程yield或执行结束后，控制权回到resume它的协程，此时不再限定协程，在下一行停止
+void step_process(debugger_context *ctx, lua_State *L, lua_Debug *ar){
+    if ((ctx->cur_run_state == STEPOVER || ctx->cur_run_state == STEPOUT) && L != ctx->step_thread) {
+        if (step_thread_running(ctx)) {
+            return;
+        }
+        ctx->step_thread = NULL;
+        if (ar->event == LINE) {
+            ctx->cur_thread_state->stackdeep_counter = 0;
+            if (ctx->cur_run_state == STEPOVER) {
+                sync_runstate_toLua(ctx, L, STEPOVER_STOP);
+                call_lua_function(ctx, L, "SendMsgWithStack", 0,"stopOnStep");
+            } else {
+                sync_runstate_toLua(ctx, L, STEPOUT_STOP);
+                call_lua_function(ctx, L, "SendMsgWithStack", 0,"stopOnStepOut");
+            }
+        }
+        return;
+    }
+    thread_hook_state &thread_state = *ctx->cur_thread_state;
+    //目前没有判断jump flag
+    if (ctx->cur_run_state == STEPOVER) {
+        if (ar->event == LINE && thread_state.stackdeep_counter <= 0) {
+            sync_runstate_toLua(ctx, L, STEPOVER_STOP);
+            call_lua_function(ctx, L, "SendMsgWithStack", 0,"stopOnStep");
+        }
+        else if (ar->event == CALL) {
+            thread_state.stackdeep_counter++;
+        }
+        //5.3 的tailcall暂时不需要处理。
+        else if (ar->event == RETURN) {
+            if (thread_state.stackdeep_counter != 0) {
+                thread_state.stackdeep_counter--;
+            }
+        }
+    }
+    else if (ctx->cur_run_state == STEPIN) {
+        if (ar->event == LINE) {
+            sync_runstate_toLua(ctx, L, STEPIN_STOP);
+            call_lua_function(ctx, L, "SendMsgWithStack", 0,"stopOnStepIn");
+        }
+
+    }
+    else if (ctx->cur_run_state == STEPOUT) {
+        if (ar->event == LINE) {
+            if (thread_state.stackdeep_counter <= -1) {
+                thread_state.stackdeep_counter = 0;
+                sync_runstate_toLua(ctx, L, STEPOUT_STOP);
+                call_lua_function(ctx, L, "SendMsgWithStack", 0,"stopOnStepOut");
+            }
+        }
+        else if (ar->event == CALL) {
+            thread_state.stackdeep_counter++;
+        }
+        //5.3 的tailcall暂时不需要处理。
+        else if (ar->event == RETURN) {
+            thread_state.stackdeep_counter--;
+        }
+    }
+}
+
+//------------调用栈------------
+//停止时在C中遍历调用栈，路径使用路径缓存，避免每层都在lua中getinfo并处理路径
+int native_stack_available() {
+#if !defined(USE_SOURCE_CODE) && defined(_WIN32)
+    return lua_getstack != NULL && lua_createtable != NULL && lua_setfield != NULL && lua_rawseti != NULL &&
+           lua_pushlstring != NULL && lua_checkstack != NULL;
+#else
+    return 1;
+#endif
+}
+
+void set_string_field(lua_State *L, const char *key, const std::string &value) {
+    lua_pushlstring(L, value.data(), value.size());
+    lua_setfield(L, -2, key);
+}
+
+//lua调用，和getStackTable的处理一致。参数: 开始的栈层级(相对调用本函数的lua函数)
+//返回: 堆栈信息数组, 用户函数的栈层级, currentCallStack中要加入的信息数组
+extern "C" int get_stack_table(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    int function_level = static_cast<int>(luaL_checknumber(L, 1));
+    if (!native_stack_available()) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_settop(L, 1);
+    lua_newtable(L);    // 2: stack
+    lua_newtable(L);    // 3: call stack
+    int user_func_level = 0;
+    int stack_count = 0;
+    int call_stack_count = 0;
+    char num_buf[32];
+    lua_Debug ar;
+    //本函数也占一层栈，和在调用者中执行debug.getinfo(level)时的层级相同
+    while (lua_getstack(L, function_level, &ar) != 0) {
+        if (!lua_checkstack(L, 4)) {
+            break;
+        }
+        lua_getinfo(L, "Slf", &ar);    //压入function
+        int func_idx = lua_gettop(L);
+        lua_newtable(L);
+        if (ar.source != nullptr && strcmp(ar.source, "=[C]") != 0) {
+            path_transfer_node *nd = getPathNode(ctx, L, ar.source);
+            snprintf(num_buf, sizeof(num_buf), "%d", ar.currentline);
+            lua_newtable(L);
+            if (nd != nullptr) {
+                set_string_field(L, "file", nd->dst);
+                set_string_field(L, "oPath", get_formated_opath(ctx, L, nd));
+            } else {
+                lua_pushstring(L, "");
+                lua_setfield(L, -2, "file");
+            }
+            lua_pushstring(L, "文件名");
+            lua_setfield(L, -2, "name");
+            lua_pushstring(L, num_buf);
+            lua_setfield(L, -2, "line");
+            //使用hookLib时，统一调用栈顶编号2
+            snprintf(num_buf, sizeof(num_buf), "%d", function_level - 1);
+            lua_pushstring(L, num_buf);
+            lua_setfield(L, -2, "index");
+            lua_rawseti(L, 2, ++stack_count);
+
+            lua_pushstring(L, nd != nullptr ? nd->dst.c_str() : "");
+            lua_setfield(L, -2, "name");
+            snprintf(num_buf, sizeof(num_buf), "%d", ar.currentline);
+            lua_pushstring(L, num_buf);
+            lua_setfield(L, -2, "line");
+            if (user_func_level == 0) {
+                user_func_level = function_level;
+            }
+        } else {
+            lua_pushstring(L, ar.source != nullptr ? ar.source : "");
+            lua_setfield(L, -2, "name");
+            lua_pushnumber(L, ar.currentline);      //C函数行号
+            lua_setfield(L, -2, "line");
+        }
+        lua_pushvalue(L, func_idx);
+        lua_setfield(L, -2, "func");                //保存的function
+        lua_pushnumber(L, function_level);
+        lua_setfield(L, -2, "realLy");              //真实堆栈层functionLevel(仅debug时用)
+        lua_rawseti(L, 3, ++call_stack_count);
+        lua_settop(L, 3);
+        function_level++;
+    }
+    lua_pushvalue(L, 2);
+    lua_pushnumber(L, user_func_level);
+    lua_pushvalue(L, 3);
+    return 3;
+}
+
+//------------变量------------
+//停止时展开变量(局部变量，upvalue，全局变量，table成员)，和lua中格式化后的结构一致
+//遍历受深度、成员数、字符串长度和时间限制，超出时加入截断标记
+int native_variable_available() {
+#if !defined(USE_SOURCE_CODE) && defined(_WIN32)
+    return native_stack_available() && native_json_available() && lua_getlocal != NULL && lua_getupvalue != NULL &&
+           lua_getmetatable != NULL;
+#else
+    return 1;
+#endif
+}
+
+//和lua中type()的结果一致
+const char* variable_type_name(int type) {
+    static const char *type_names[] = { "nil", "boolean", "userdata", "number", "string", "table", "function", "userdata", "thread" };
+    return (type >= 0 && type < static_cast<int>(sizeof(type_names) / sizeof(type_names[0]))) ? type_names[type] : "unknown";
+}
+
+struct variable_walker {
+    lua_State *L;
+    int ref_tab;            //variableRefTab
+    int ref_idx;            //下一个可用的variableRefIdx
+    int child_depth;        //本次生成的引用的深度
+    int tostring_idx;       //tostring函数
+    int count;
+    double deadline;
+    bool truncated;
+    const char *truncate_reason;
+};
+
+//检查是否超出时间预算。每隔一定个数才读一次时钟
+bool variable_time_exceeded(debugger_context *ctx, variable_walker &walker) {
+    if (walker.truncated) {
+        return true;
+    }
+    if (ctx->variable_time_budget_ms > 0 && (walker.count & 63) == 0 && monotonic_ms() > walker.deadline) {
+        walker.truncated = true;
+        walker.truncate_reason = "time budget exceeded";
+    }
+    return walker.truncated;
+}
+
+//调用tostring(会使用__tostring)，和lua中一样出错时返回"[value can't trans to string]"
+void variable_tostring(variable_walker &walker, int idx, std::string &out) {
+    lua_State *L = walker.L;
+    int type = lua_type(L, idx);
+    if (type != LUA_TTABLE && type != LUA_TUSERDATA && type != LUA_TFUNCTION && type != LUA_TTHREAD) {
+        append_lua_value(L, idx, out);
+        return;
+    }
+    lua_pushvalue(L, walker.tostring_idx);
+    lua_pushvalue(L, idx);
+    const char *str = nullptr;
+    size_t len = 0;
+    if (lua_pcall(L, 1, 1, 0) == 0 && lua_type(L, -1) == LUA_TSTRING) {
+        str = lua_tolstring(L, -1, &len);
+    }
+    if (str != nullptr) {
+        out.append(str, len);
+    } else {
+        out += variable_type_name(type);
+        out += " [value can't trans to string]";
+    }
+    lua_pop(L, 1);
+}
+
+//统计table成员数并返回，最多统计variable_max_children个。分页时VSCode最多展开到统计的个数
+int append_member_num(debugger_context *ctx, lua_State *L, int idx, std::string &out) {
+    int num = 0;
+    bool overflow = false;
+    int limit = ctx->variable_max_children;
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) {
+        lua_pop(L, 1);
+        if (limit > 0 && num >= limit) {
+            lua_pop(L, 1);
+            overflow = true;
+            break;
+        }
+        num++;
+    }
+    out += std::to_string(num);
+    if (overflow) {
+        out += '+';
+    }
+    out += " Members ";
+    return num;
+}
+
+//把一个变量记录压栈，值在value_idx处
+void push_variable_record(debugger_context *ctx, variable_walker &walker, int value_idx, const std::string &name) {
+    lua_State *L = walker.L;
+    int type = lua_type(L, value_idx);
+    lua_newtable(L);
+    lua_pushlstring(L, name.data(), name.size());
+    lua_setfield(L, -2, "name");
+    lua_pushstring(L, variable_type_name(type));
+    lua_setfield(L, -2, "type");
+
+    std::string value;
+    bool has_ref = false;
+    if (type == LUA_TTABLE || type == LUA_TFUNCTION || type == LUA_TUSERDATA || type == LUA_TLIGHTUSERDATA) {
+        if (ctx->variable_max_depth <= 0 || walker.child_depth <= ctx->variable_max_depth) {
+            has_ref = true;
+            lua_pushvalue(L, value_idx);
+            lua_rawseti(L, walker.ref_tab, walker.ref_idx);
+            ctx->variable_ref_depth[walker.ref_idx] = walker.child_depth;
+            lua_pushnumber(L, walker.ref_idx);
+            lua_setfield(L, -2, "variablesReference");
+            walker.ref_idx++;
+        }
+        if (type == LUA_TTABLE) {
+            int num = append_member_num(ctx, L, value_idx, value);
+            if (has_ref && ctx->variable_page_size > 0 && num > ctx->variable_page_size) {
+                lua_pushnumber(L, num);
+                lua_setfield(L, -2, "indexedVariables");
+            }
+        }
+        variable_tostring(walker, value_idx, value);
+        if (!has_ref) {
+            value += " (max depth)";
+        }
+    } else if (type == LUA_TSTRING) {
+        size_t len = 0;
+        const char *str = lua_tolstring(L, value_idx, &len);
+        value += '"';
+        if (ctx->variable_max_string_len > 0 && len > static_cast<size_t>(ctx->variable_max_string_len)) {
+            value.append(str, ctx->variable_max_string_len);
+            value += "...\" (";
+            value += std::to_string(len);
+            value += " bytes)";
+        } else {
+            value.append(str, len);
+            value += '"';
+        }
+    } else {
+        variable_tostring(walker, value_idx, value);
+    }
+    lua_pushlstring(L, value.data(), value.size());
+    lua_setfield(L, -2, "value");
+    if (!has_ref) {
+        lua_pushstring(L, "0");
+        lua_setfield(L, -2, "variablesReference");
+    }
+}
+
+//截断标记
+void push_truncate_record(variable_walker &walker, int shown) {
+    lua_State *L = walker.L;
+    std::string value = "(";
+    value += walker.truncate_reason != nullptr ? walker.truncate_reason : "truncated";
+    value += ", ";
+    value += std::to_string(shown);
+    value += " shown)";
+    lua_newtable(L);
+    lua_pushstring(L, "...");
+    lua_setfield(L, -2, "name");
+    lua_pushstring(L, "string");
+    lua_setfield(L, -2, "type");
+    lua_pushlstring(L, value.data(), value.size());
+    lua_setfield(L, -2, "value");
+    lua_pushstring(L, "0");
+    lua_setfield(L, -2, "variablesReference");
+}
+
+//是否已达到成员数上限
+bool variable_count_exceeded(debugger_context *ctx, variable_walker &walker) {
+    if (ctx->variable_max_children > 0 && walker.count >= ctx->variable_max_children) {
+        walker.truncated = true;
+        walker.truncate_reason = "too many members";
+    }
+    return walker.truncated;
+}
+
+//lua_next得到的一个成员加入结果，栈顶是值，下面是键。quote_string_key为true时字符串键加引号
+void push_table_member(debugger_context *ctx, variable_walker &walker, int result, bool quote_string_key) {
+    lua_State *L = walker.L;
+    int value_idx = lua_gettop(L);
+    std::string name;
+    if (quote_string_key && lua_type(L, value_idx - 1) == LUA_TSTRING) {
+        name += '"';
+        append_lua_value(L, value_idx - 1, name);
+        name += '"';
+    } else {
+        variable_tostring(walker, value_idx - 1, name);
+    }
+    push_variable_record(ctx, walker, value_idx, name);
+    lua_rawseti(L, result, ++walker.count);
+    lua_settop(L, value_idx - 1);
+}
+
+//元表
+void push_table_metatable(debugger_context *ctx, variable_walker &walker, int result, int table_idx) {
+    lua_State *L = walker.L;
+    if (lua_getmetatable(L, table_idx) != 0) {
+        int mt_idx = lua_gettop(L);
+        if (lua_type(L, mt_idx) == LUA_TTABLE) {
+            push_variable_record(ctx, walker, mt_idx, "_Metatable_");
+            std::string value = "元表 ";
+            variable_tostring(walker, mt_idx, value);
+            lua_pushlstring(L, value.data(), value.size());
+            lua_setfield(L, -2, "value");
+            lua_rawseti(L, result, ++walker.count);
+        }
+        lua_settop(L, mt_idx - 1);
+    }
+}
+
+//table成员。quote_string_key为true时字符串键加引号(getVariableRef)，否则不加(getGlobalVariable)
+void walk_table_variables(debugger_context *ctx, variable_walker &walker, int result, int table_idx, bool quote_string_key, bool with_metatable) {
+    lua_State *L = walker.L;
+    lua_pushnil(L);
+    while (lua_next(L, table_idx) != 0) {
+        if (variable_count_exceeded(ctx, walker) || variable_time_exceeded(ctx, walker)) {
+            lua_pop(L, 2);
+            break;
+        }
+        push_table_member(ctx, walker, result, quote_string_key);
+    }
+    if (with_metatable) {
+        push_table_metatable(ctx, walker, result, table_idx);
+    }
+}
+
+void release_variable_cursor(lua_State *L, variable_cursor &cursor) {
+    luaL_unref(L, LUA_REGISTRYINDEX, cursor.table_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, cursor.key_ref);
+}
+
+void release_variable_cursors(debugger_context *ctx, lua_State *L) {
+    for (std::map<int, variable_cursor>::iterator iter = ctx->variable_cursors.begin(); iter != ctx->variable_cursors.end(); ++iter) {
+        release_variable_cursor(L, iter->second);
+    }
+    ctx->variable_cursors.clear();
+}
+
+//按VSCode的start/count分页展开table。从ref对应的遍历位置继续，不必每页都从头遍历。count<=0表示展开start之后的全部成员
+void walk_table_page(debugger_context *ctx, variable_walker &walker, int result, int table_idx, int ref, int start, int count) {
+    lua_State *L = walker.L;
+    std::map<int, variable_cursor>::iterator iter = ctx->variable_cursors.find(ref);
+    if (iter != ctx->variable_cursors.end()) {
+        //引用id已被其他table使用(variableRefTab重置后)
+        lua_rawgeti(L, LUA_REGISTRYINDEX, iter->second.table_ref);
+        bool same_table = lua_topointer(L, -1) == lua_topointer(L, table_idx);
+        lua_pop(L, 1);
+        if (!same_table || iter->second.position > start) {
+            release_variable_cursor(L, iter->second);
+            ctx->variable_cursors.erase(iter);
+            iter = ctx->variable_cursors.end();
+        }
+    }
+    if (iter == ctx->variable_cursors.end()) {
+        if (ctx->variable_cursors.size() >= variable_cursor_capacity) {
+            release_variable_cursor(L, ctx->variable_cursors.begin()->second);
+            ctx->variable_cursors.erase(ctx->variable_cursors.begin());
+        }
+        variable_cursor cursor;
+        lua_pushvalue(L, table_idx);
+        cursor.table_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        cursor.key_ref = LUA_NOREF;
+        cursor.position = 0;
+        cursor.finished = false;
+        iter = ctx->variable_cursors.insert(std::make_pair(ref, cursor)).first;
+    }
+
+    variable_cursor &cursor = iter->second;
+    if (cursor.finished) {
+        return;
+    }
+    if (cursor.key_ref == LUA_NOREF) {
+        lua_pushnil(L);
+    } else {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, cursor.key_ref);
+    }
+    bool has_key = true;
+    while (count <= 0 || cursor.position - start < count) {
+        if (lua_next(L, table_idx) == 0) {
+            has_key = false;
+            break;
+        }
+        if (cursor.position >= start) {
+            if (variable_time_exceeded(ctx, walker)) {
+                lua_pop(L, 2);
+                has_key = false;
+                break;
+            }
+            push_table_member(ctx, walker, result, true);
+        } else {
+            lua_pop(L, 1);
+        }
+        cursor.position++;
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, cursor.key_ref);
+    cursor.key_ref = LUA_NOREF;
+    if (has_key) {
+        cursor.key_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    } else if (!walker.truncated) {
+        cursor.finished = true;
+    } else {
+        //超时后下次从头遍历
+        cursor.position = 0;
+    }
+}
+
+//局部变量，同名变量只保留后定义的(位置不变)，和checkSameNameVar一致
+void walk_local_variables(debugger_context *ctx, variable_walker &walker, int result, int level) {
+    lua_State *L = walker.L;
+    lua_Debug ar;
+    if (lua_getstack(L, level, &ar) == 0) {
+        return;
+    }
+    std::unordered_map<std::string, int> name_index;
+    for (int k = 1; ; k++) {
+        const char *name = lua_getlocal(L, &ar, k);
+        if (name == nullptr) {
+            break;
+        }
+        int value_idx = lua_gettop(L);
+        if (strcmp(name, "(*temporary)") != 0 && strcmp(name, "(temporary)") != 0) {
+            std::unordered_map<std::string, int>::iterator iter = name_index.find(name);
+            if (iter == name_index.end() && (variable_count_exceeded(ctx, walker) || variable_time_exceeded(ctx, walker))) {
+                lua_settop(L, value_idx - 1);
+                break;
+            }
+            push_variable_record(ctx, walker, value_idx, name);
+            lua_pushnumber(L, k);
+            lua_setfield(L, -2, "index");
+            if (iter != name_index.end()) {
+                lua_rawseti(L, result, iter->second);
+            } else {
+                name_index[name] = ++walker.count;
+                lua_rawseti(L, result, walker.count);
+            }
+        }
+        lua_settop(L, value_idx - 1);
+    }
+}
+
+void walk_upvalue_variables(debugger_context *ctx, variable_walker &walker, int result, int func_idx) {
+    lua_State *L = walker.L;
+    for (int i = 1; ; i++) {
+        const char *name = lua_getupvalue(L, func_idx, i);
+        if (name == nullptr) {
+            break;
+        }
+        int value_idx = lua_gettop(L);
+        if (variable_count_exceeded(ctx, walker) || variable_time_exceeded(ctx, walker)) {
+            lua_settop(L, value_idx - 1);
+            break;
+        }
+        push_variable_record(ctx, walker, value_idx, name);
+        lua_rawseti(L, result, ++walker.count);
+        lua_settop(L, value_idx - 1);
+    }
+}
+
+//lua调用，设置变量展开的限制。参数: 引用深度, 成员数, 字符串长度, 时间(ms), 分页大小(可选)。<=0表示不限制
+extern "C" int set_variable_config(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    ctx->variable_max_depth = static_cast<int>(luaL_checkinteger(L, 1));
+    ctx->variable_max_children = static_cast<int>(luaL_checkinteger(L, 2));
+    ctx->variable_max_string_len = static_cast<int>(luaL_checkinteger(L, 3));
+    ctx->variable_time_budget_ms = luaL_checknumber(L, 4);
+    if (lua_type(L, 5) == LUA_TNUMBER) {
+        ctx->variable_page_size = static_cast<int>(luaL_checkinteger(L, 5));
+    }
+    return 0;
+}
+
+//lua调用，展开变量并生成格式化后的变量信息
+//参数: 类型("local"|"upvalue"|"global"|"table"), 目标(栈层级|function|table), variableRefTab, variableRefIdx, 父引用id(table时)
+//      分页展开table时还有: filter("indexed"|"named"), start, count
+//返回: 变量信息数组, 新的variableRefIdx
+extern "C" int get_variables(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    const char *kind = luaL_checkstring(L, 1);
+    if (!native_variable_available() || lua_type(L, 3) != LUA_TTABLE) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_settop(L, 8);
+    variable_walker walker;
+    walker.L = L;
+    walker.ref_tab = 3;
+    walker.ref_idx = static_cast<int>(luaL_checknumber(L, 4));
+    walker.count = 0;
+    walker.deadline = monotonic_ms() + ctx->variable_time_budget_ms;
+    walker.truncated = false;
+    walker.truncate_reason = nullptr;
+    //variableRefTab重置后引用深度信息失效
+    if (walker.ref_idx <= 1) {
+        ctx->variable_ref_depth.clear();
+        release_variable_cursors(ctx, L);
+    }
+    walker.child_depth = 1;
+    if (lua_type(L, 5) == LUA_TNUMBER) {
+        std::unordered_map<int, int>::const_iterator iter = ctx->variable_ref_depth.find(static_cast<int>(lua_tonumber(L, 5)));
+        if (iter != ctx->variable_ref_depth.end()) {
+            walker.child_depth = iter->second + 1;
+        }
+    }
+    lua_getglobal(L, "tostring");   // 9
+    walker.tostring_idx = 9;
+    lua_newtable(L);                // 10: result
+    int result = 10;
+    const char *filter = lua_type(L, 6) == LUA_TSTRING ? lua_tostring(L, 6) : nullptr;
+
+    if (strcmp(kind, "local") == 0) {
+        walk_local_variables(ctx, walker, result, static_cast<int>(luaL_checknumber(L, 2)));
+    } else if (strcmp(kind, "upvalue") == 0) {
+        if (lua_type(L, 2) == LUA_TFUNCTION) {
+            walk_upvalue_variables(ctx, walker, result, 2);
+        }
+    } else if (strcmp(kind, "global") == 0 || strcmp(kind, "table") == 0) {
+        bool is_table = (strcmp(kind, "table") == 0);
+        if (lua_type(L, 2) == LUA_TTABLE) {
+            if (is_table && filter != nullptr && strcmp(filter, "named") == 0) {
+                //分页的table，成员都在indexed中
+                push_table_metatable(ctx, walker, result, 2);
+            } else if (is_table && filter != nullptr && strcmp(filter, "indexed") == 0 && lua_type(L, 5) == LUA_TNUMBER) {
+                int start = lua_type(L, 7) == LUA_TNUMBER ? static_cast<int>(lua_tonumber(L, 7)) : 0;
+                int count = lua_type(L, 8) == LUA_TNUMBER ? static_cast<int>(lua_tonumber(L, 8)) : ctx->variable_page_size;
+                walk_table_page(ctx, walker, result, 2, static_cast<int>(lua_tonumber(L, 5)), std::max(start, 0), count);
+            } else {
+                walk_table_variables(ctx, walker, result, 2, is_table, is_table);
+            }
+        }
+    } else {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (walker.truncated) {
+        push_truncate_record(walker, walker.count);
+        lua_rawseti(L, result, walker.count + 1);
+    }
+    lua_settop(L, result);
+    lua_pushnumber(L, walker.ref_idx);
+    return 2;
+}
+
+//------------JSON------------
+//发给adapter的消息在C中编码为json。和tools.createJson中json.encode的语义保持一致:
+//数组判定规则相同，跳过不能编码的键值(function/userdata/thread)，字符串中的'/'也转义
+const int json_max_depth = 64;       //最大嵌套深度，超出的部分和循环引用一样编码为null
+
+//需要转义的字符，值为转义后'\'后面的字符
+//进程内所有虚拟机共享，只初始化一次
+static unsigned char json_escape_table[256];
+std::once_flag json_escape_table_once;
+
+void build_json_escape_table() {
+    json_escape_table['"'] = '"';
+    json_escape_table['\\'] = '\\';
+    json_escape_table['/'] = '/';
+    json_escape_table['\b'] = 'b';
+    json_escape_table['\f'] = 'f';
+    json_escape_table['\n'] = 'n';
+    json_escape_table['\r'] = 'r';
+    json_escape_table['\t'] = 't';
+}
+
+void init_json_escape_table() {
+    std::call_once(json_escape_table_once, build_json_escape_table);
+}
+
+int native_json_available() {
+#if !defined(USE_SOURCE_CODE) && defined(_WIN32)
+#if LUA_VERSION_NUM == 501
+    if (lua_tonumber == NULL) {
+        return 0;
+    }
+#else
+    if (lua_tonumberx == NULL) {
+        return 0;
+    }
+#endif
+    return lua_createtable != NULL && lua_pushvalue != NULL && lua_pushlstring != NULL && lua_pushboolean != NULL &&
+           lua_rawgeti != NULL && lua_rawseti != NULL && lua_rawset != NULL && lua_topointer != NULL && lua_checkstack != NULL;
+#else
+    return 1;
+#endif
+}
+
+struct json_encoder {
+    lua_State *L;
+    std::string &out;
+    const void *null_value;          //json.null
+    const void *empty_array;         //json.EMPTY_ARRAY
+    const void *empty_object;        //json.EMPTY_OBJECT
+    std::vector<const void*> table_stack;    //正在编码的table，用于检测循环引用
+
+    json_encoder(lua_State *state, std::string &buffer) : L(state), out(buffer), null_value(nullptr), empty_array(nullptr), empty_object(nullptr) {}
+};
+
+void json_append_string(std::string &out, const char *str, size_t len) {
+    out += '"';
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char escape = json_escape_table[static_cast<unsigned char>(str[i])];
+        if (escape != 0) {
+            out.append(str + start, i - start);
+            out += '\\';
+            out += static_cast<char>(escape);
+            start = i + 1;
+        }
+    }
+    out.append(str + start, len - start);
+    out += '"';
+}
+
+//和lua中的isEncodable一致
+bool json_is_encodable(json_encoder &encoder, int idx) {
+    switch (lua_type(encoder.L, idx)) {
+        case LUA_TNIL:
+        case LUA_TBOOLEAN:
+        case LUA_TNUMBER:
+        case LUA_TSTRING:
+        case LUA_TTABLE:
+            return true;
+        case LUA_TFUNCTION:
+            return encoder.null_value != nullptr && lua_topointer(encoder.L, idx) == encoder.null_value;
+        default:
+            return false;
+    }
+}
+
+//和lua中的isArray一致。是数组时返回true，max_index为最大下标
+bool json_is_array(json_encoder &encoder, int idx, double &max_index) {
+    lua_State *L = encoder.L;
+    max_index = 0;
+    const void *ptr = lua_topointer(L, idx);
+    if (ptr == encoder.empty_array) {
+        return true;
+    }
+    if (ptr == encoder.empty_object) {
+        return false;
+    }
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) {
+        bool is_index = false;
+        if (lua_type(L, -2) == LUA_TNUMBER) {
+            double key = lua_tonumber(L, -2);
+            is_index = (key >= 1 && static_cast<double>(static_cast<long long>(key)) == key);
+            if (is_index) {
+                if (!json_is_encodable(encoder, -1)) {
+                    lua_pop(L, 2);
+                    return false;
+                }
+                max_index = std::max(max_index, key);
+            }
+        }
+        if (!is_index) {
+            size_t len = 0;
+            const char *key = lua_type(L, -2) == LUA_TSTRING ? lua_tolstring(L, -2, &len) : nullptr;
+            //键n的值总等于t.n，lua中对它的判断恒为真
+            bool is_n = (key != nullptr && len == 1 && key[0] == 'n');
+            if (!is_n && json_is_encodable(encoder, -1)) {
+                lua_pop(L, 2);
+                return false;
+            }
+        }
+        lua_pop(L, 1);
+    }
+    return true;
+}
+
+//编码键，非string键和lua中一样使用tostring的结果
+void json_append_key(json_encoder &encoder, int idx) {
+    if (lua_type(encoder.L, idx) == LUA_TSTRING) {
+        size_t len = 0;
+        const char *str = lua_tolstring(encoder.L, idx, &len);
+        json_append_string(encoder.out, str, len);
+        return;
+    }
+    std::string key;
+    append_lua_value(encoder.L, idx, key);
+    json_append_string(encoder.out, key.c_str(), key.size());
+}
+
+bool json_encode_value(json_encoder &encoder, int idx, int depth);
+
+void json_encode_table(json_encoder &encoder, int idx, int depth) {
+    lua_State *L = encoder.L;
+    const void *ptr = lua_topointer(L, idx);
+    if (depth >= json_max_depth || !lua_checkstack(L, 4) ||
+        std::find(encoder.table_stack.begin(), encoder.table_stack.end(), ptr) != encoder.table_stack.end()) {
+        encoder.out += "null";
+        return;
+    }
+    encoder.table_stack.push_back(ptr);
+
+    double max_index = 0;
+    if (json_is_array(encoder, idx, max_index)) {
+        encoder.out += '[';
+        for (double i = 1; i <= max_index; i++) {
+            if (i > 1) {
+                encoder.out += ',';
+            }
+            lua_rawgeti(L, idx, static_cast<int>(i));
+            json_encode_value(encoder, lua_gettop(L), depth + 1);
+            lua_pop(L, 1);
+        }
+        encoder.out += ']';
+    } else {
+        bool first = true;
+        encoder.out += '{';
+        lua_pushnil(L);
+        while (lua_next(L, idx) != 0) {
+            int top = lua_gettop(L);
+            if (json_is_encodable(encoder, top - 1) && json_is_encodable(encoder, top)) {
+                if (!first) {
+                    encoder.out += ',';
+                }
+                first = false;
+                json_append_key(encoder, top - 1);
+                encoder.out += ':';
+                json_encode_value(encoder, top, depth + 1);
+            }
+            lua_pop(L, 1);
+        }
+        encoder.out += '}';
+    }
+    encoder.table_stack.pop_back();
+}
+
+//编码单个值。idx必须是正数索引。不能编码的类型返回false(table内的值在编码前已用json_is_encodable过滤)
+bool json_encode_value(json_encoder &encoder, int idx, int depth) {
+    lua_State *L = encoder.L;
+    switch (lua_type(L, idx)) {
+        case LUA_TNIL:
+            encoder.out += "null";
+            return true;
+        case LUA_TBOOLEAN:
+            encoder.out += lua_toboolean(L, idx) ? "true" : "false";
+            return true;
+        case LUA_TNUMBER:
+            //和tostring的结果一致
+            append_lua_value(L, idx, encoder.out);
+            return true;
+        case LUA_TSTRING: {
+            size_t len = 0;
+            const char *str = lua_tolstring(L, idx, &len);
+            json_append_string(encoder.out, str, len);
+            return true;
+        }
+        case LUA_TTABLE:
+            json_encode_table(encoder, idx, depth);
+            return true;
+        case LUA_TFUNCTION:
+            if (json_is_encodable(encoder, idx)) {
+                encoder.out += "null";
+                return true;
+            }
+            return false;
+        default:
+            return false;
+    }
+}
+
+//消息的快速路径: 带cmd字段的消息一定是对象，常用字段直接按名字取，其余字段再遍历
+void json_encode_message(json_encoder &encoder, int idx) {
+    static const char *known_fields[] = { "cmd", "callbackId", "stack", "info" };
+    const int known_count = sizeof(known_fields) / sizeof(known_fields[0]);
+    lua_State *L = encoder.L;
+    encoder.table_stack.push_back(lua_topointer(L, idx));
+    bool first = true;
+    encoder.out += '{';
+    for (int i = 0; i < known_count; i++) {
+        lua_getfield(L, idx, known_fields[i]);
+        int top = lua_gettop(L);
+        if (lua_type(L, top) != LUA_TNIL && json_is_encodable(encoder, top)) {
+            if (!first) {
+                encoder.out += ',';
+            }
+            first = false;
+            json_append_string(encoder.out, known_fields[i], strlen(known_fields[i]));
+            encoder.out += ':';
+            json_encode_value(encoder, top, 1);
+        }
+        lua_pop(L, 1);
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) {
+        int top = lua_gettop(L);
+        bool is_known = false;
+        if (lua_type(L, top - 1) == LUA_TSTRING) {
+            const char *key = lua_tostring(L, top - 1);
+            for (int i = 0; i < known_count && !is_known; i++) {
+                is_known = (strcmp(key, known_fields[i]) == 0);
+            }
+        }
+        if (!is_known && json_is_encodable(encoder, top - 1) && json_is_encodable(encoder, top)) {
+            if (!first) {
+                encoder.out += ',';
+            }
+            first = false;
+            json_append_key(encoder, top - 1);
+            encoder.out += ':';
+            json_encode_value(encoder, top, 1);
+        }
+        lua_pop(L, 1);
+    }
+    encoder.out += '}';
+    encoder.table_stack.pop_back();
+}
+
+//lua调用，把值编码为json字符串
+//参数: 值, json.null, json.EMPTY_ARRAY, json.EMPTY_OBJECT(后三个可选)
+//返回: json字符串 / nil, 错误信息。返回nil时lua使用json.encode
+extern "C" int encode_json(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    if (!native_json_available()) {
+        lua_pushnil(L);
+        lua_pushstring(L, "native json unavailable");
+        return 2;
+    }
+    init_json_escape_table();
+    lua_settop(L, 4);
+    ctx->json_buffer.clear();
+    json_encoder encoder(L, ctx->json_buffer);
+    encoder.null_value = lua_type(L, 2) != LUA_TNIL ? lua_topointer(L, 2) : nullptr;
+    encoder.empty_array = lua_type(L, 3) != LUA_TNIL ? lua_topointer(L, 3) : nullptr;
+    encoder.empty_object = lua_type(L, 4) != LUA_TNIL ? lua_topointer(L, 4) : nullptr;
+
+    bool success = true;
+    if (lua_type(L, 1) == LUA_TTABLE && lua_checkstack(L, 4)) {
+        lua_getfield(L, 1, "cmd");
+        bool is_message = lua_type(L, -1) == LUA_TSTRING;
+        lua_pop(L, 1);
+        if (is_message) {
+            json_encode_message(encoder, 1);
+        } else {
+            json_encode_table(encoder, 1, 0);
+        }
+    } else {
+        success = json_encode_value(encoder, 1, 0);
+    }
+
+    if (!success) {
+        lua_pushnil(L);
+        lua_pushstring(L, "encode attempt to encode unsupported type");
+        return 2;
+    }
+    lua_pushlstring(L, ctx->json_buffer.data(), ctx->json_buffer.size());
+    //超大的消息发送后释放缓冲区，避免长期占用内存
+    if (ctx->json_buffer.capacity() > 1024 * 1024) {
+        std::string().swap(ctx->json_buffer);
+    }
+    return 1;
+}
+
+//json解码，和json.decode的语义保持一致: 数字解码为字符串，null解码为nil，支持单引号字符串和/* */注释
+struct json_decoder {
+    lua_State *L;
+    const char *str;
+    size_t len;
+    size_t pos;
+
+    json_decoder(lua_State *state, const char *s, size_t l) : L(state), str(s), len(l), pos(0) {}
+};
+
+void json_skip_whitespace(json_decoder &decoder) {
+    while (decoder.pos < decoder.len) {
+        char c = decoder.str[decoder.pos];
+        if (c != ' ' && c != '\n' && c != '\r' && c != '\t') {
+            break;
+        }
+        decoder.pos++;
+    }
+}
+
+bool json_is_number_char(char c) {
+    return (c >= '0' && c <= '9') || c == '+' || c == '-' || c == '.' || c == 'e';
+}
+
+int json_hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+//把\uXXXX按utf-8写入，和lua中一样最多3字节，不处理代理对
+void json_append_utf8(std::string &out, unsigned int n) {
+    if (n < 0x80) {
+        out += static_cast<char>(n);
+    } else if (n < 0x800) {
+        out += static_cast<char>(0xC0 + ((n >> 6) & 0x1F));
+        out += static_cast<char>(0x80 + (n & 0x3F));
+    } else {
+        out += static_cast<char>(0xE0 + ((n >> 12) & 0x0F));
+        out += static_cast<char>(0x80 + ((n >> 6) & 0x3F));
+        out += static_cast<char>(0x80 + (n & 0x3F));
+    }
+}
+
+bool json_decode_string(json_decoder &decoder) {
+    const char *str = decoder.str;
+    char quote = str[decoder.pos++];
+    size_t start = decoder.pos;
+    //没有转义时直接从原串压栈，不经过临时缓冲区
+    while (decoder.pos < decoder.len && str[decoder.pos] != quote && str[decoder.pos] != '\\') {
+        decoder.pos++;
+    }
+    if (decoder.pos < decoder.len && str[decoder.pos] == quote) {
+        lua_pushlstring(decoder.L, str + start, decoder.pos - start);
+        decoder.pos++;
+        return true;
+    }
+
+    std::string value(str + start, decoder.pos - start);
+    while (decoder.pos < decoder.len && str[decoder.pos] != quote) {
+        char c = str[decoder.pos++];
+        if (c != '\\') {
+            value += c;
+            continue;
+        }
+        if (decoder.pos >= decoder.len) {
+            break;
+        }
+        char escape = str[decoder.pos++];
+        switch (escape) {
+            case 't': value += '\t'; break;
+            case 'f': value += '\f'; break;
+            case 'r': value += '\r'; break;
+            case 'n': value += '\n'; break;
+            case 'b': value += '\b'; break;
+            case 'u': {
+                unsigned int n = 0;
+                for (int i = 0; i < 4; i++) {
+                    int hex = decoder.pos < decoder.len ? json_hex_value(str[decoder.pos]) : -1;
+                    if (hex < 0) {
+                        return false;    //\u转义错误
+                    }
+                    n = n * 16 + hex;
+                    decoder.pos++;
+                }
+                json_append_utf8(value, n);
+                break;
+            }
+            default:
+                //其他转义去掉'\'
+                value += escape;
+                break;
+        }
+    }
+    if (decoder.pos >= decoder.len) {
+        return false;    //字符串没有结束引号
+    }
+    decoder.pos++;
+    lua_pushlstring(decoder.L, value.data(), value.size());
+    return true;
+}
+
+bool json_decode_value(json_decoder &decoder, int depth);
+
+bool json_decode_array(json_decoder &decoder, int depth) {
+    lua_State *L = decoder.L;
+    decoder.pos++;
+    lua_newtable(L);
+    int index = 1;
+    while (true) {
+        json_skip_whitespace(decoder);
+        if (decoder.pos >= decoder.len) {
+            return false;    //数组没有结束
+        }
+        if (decoder.str[decoder.pos] == ']') {
+            decoder.pos++;
+            return true;
+        }
+        if (decoder.str[decoder.pos] == ',') {
+            decoder.pos++;
+            json_skip_whitespace(decoder);
+        }
+        if (!json_decode_value(decoder, depth + 1)) {
+            return false;
+        }
+        lua_rawseti(L, -2, index++);
+    }
+}
+
+bool json_decode_object(json_decoder &decoder, int depth) {
+    lua_State *L = decoder.L;
+    decoder.pos++;
+    lua_newtable(L);
+    while (true) {
+        json_skip_whitespace(decoder);
+        if (decoder.pos >= decoder.len) {
+            return false;    //对象没有结束
+        }
+        if (decoder.str[decoder.pos] == '}') {
+            decoder.pos++;
+            return true;
+        }
+        if (decoder.str[decoder.pos] == ',') {
+            decoder.pos++;
+            json_skip_whitespace(decoder);
+        }
+        if (!json_decode_value(decoder, depth + 1)) {
+            return false;
+        }
+        if (lua_type(L, -1) == LUA_TNIL) {
+            return false;    //键为null
+        }
+        json_skip_whitespace(decoder);
+        if (decoder.pos >= decoder.len || decoder.str[decoder.pos] != ':') {
+            return false;    //缺少':'
+        }
+        decoder.pos++;
+        json_skip_whitespace(decoder);
+        if (!json_decode_value(decoder, depth + 1)) {
+            return false;
+        }
+        lua_rawset(L, -3);
+    }
+}
+
+//解码一个值并压栈
+bool json_decode_value(json_decoder &decoder, int depth) {
+    if (depth >= json_max_depth || !lua_checkstack(decoder.L, 3)) {
+        return false;    //嵌套过深
+    }
+    json_skip_whitespace(decoder);
+    if (decoder.pos >= decoder.len) {
+        return false;    //数据不完整
+    }
+    const char *str = decoder.str;
+    char c = str[decoder.pos];
+    switch (c) {
+        case '{':
+            return json_decode_object(decoder, depth);
+        case '[':
+            return json_decode_array(decoder, depth);
+        case '"':
+        case '\'':
+            return json_decode_string(decoder);
+        default:
+            break;
+    }
+    if (json_is_number_char(c)) {
+        //和lua中一样，数字保留为字符串
+        size_t start = decoder.pos++;
+        while (decoder.pos < decoder.len && json_is_number_char(str[decoder.pos])) {
+            decoder.pos++;
+        }
+        lua_pushlstring(decoder.L, str + start, decoder.pos - start);
+        return true;
+    }
+    if (c == '/' && decoder.pos + 1 < decoder.len && str[decoder.pos + 1] == '*') {
+        const char *end = nullptr;
+        for (size_t i = decoder.pos + 2; i + 1 < decoder.len; i++) {
+            if (str[i] == '*' && str[i + 1] == '/') {
+                end = str + i;
+                break;
+            }
+        }
+        if (end == nullptr) {
+            return false;    //注释没有结束
+        }
+        decoder.pos = (end - str) + 2;
+        return json_decode_value(decoder, depth);
+    }
+    static const char *constants[] = { "true", "false", "null" };
+    for (int i = 0; i < 3; i++) {
+        size_t const_len = strlen(constants[i]);
+        if (decoder.len - decoder.pos >= const_len && strncmp(str + decoder.pos, constants[i], const_len) == 0) {
+            decoder.pos += const_len;
+            if (i == 2) {
+                lua_pushnil(decoder.L);
+            } else {
+                lua_pushboolean(decoder.L, i == 0);
+            }
+            return true;
+        }
+    }
+    return false;    //无法识别的值
+}
+
+//lua调用，按分隔符切分收到的数据，并把每条消息解码为table。只扫描一遍，不产生子串副本
+//参数: 收到的数据(一行), 分隔符。返回: 消息字符串数组, 解码结果数组(解码失败的位置为false，由lua重新解码报告错误)
+extern "C" int decode_messages(lua_State *L) {
+    size_t len = 0;
+    size_t split_len = 0;
+    const char *str = luaL_checklstring(L, 1, &len);
+    const char *split = luaL_checklstring(L, 2, &split_len);
+    if (!native_json_available()) {
+        lua_pushnil(L);
+        lua_pushstring(L, "native json unavailable");
+        return 2;
+    }
+    lua_settop(L, 2);
+    lua_newtable(L);    // 3: frames
+    lua_newtable(L);    // 4: commands
+
+    //每条消息以分隔符结尾，去掉最后一个分隔符
+    if (split_len > 0 && len >= split_len && memcmp(str + len - split_len, split, split_len) == 0) {
+        len -= split_len;
+    }
+    int frame_count = 0;
+    size_t start = 0;
+    while (start <= len) {
+        const char *found = nullptr;
+        if (split_len > 0) {
+            for (const char *p = str + start; p + split_len <= str + len; p++) {
+                p = static_cast<const char*>(memchr(p, split[0], (str + len) - p));
+                if (p == nullptr || p + split_len > str + len) {
+                    break;
+                }
+                if (memcmp(p, split, split_len) == 0) {
+                    found = p;
+                    break;
+                }
+            }
+        }
+        size_t end = found != nullptr ? static_cast<size_t>(found - str) : len;
+        //跳过空消息
+        size_t frame_start = start;
+        while (frame_start < end && (str[frame_start] == ' ' || str[frame_start] == '\n' || str[frame_start] == '\r' || str[frame_start] == '\t')) {
+            frame_start++;
+        }
+        if (frame_start < end) {
+            frame_count++;
+            lua_pushlstring(L, str + start, end - start);
+            lua_rawseti(L, 3, frame_count);
+
+            json_decoder decoder(L, str + start, end - start);
+            int top = lua_gettop(L);
+            if (!json_decode_value(decoder, 0) || lua_type(L, -1) != LUA_TTABLE) {
+                lua_settop(L, top);
+                lua_pushboolean(L, 0);
+            }
+            lua_rawseti(L, 4, frame_count);
+        }
+        if (found == nullptr) {
+            break;
+        }
+        start = end + split_len;
+    }
+    return 2;
+}
+
+//------------base64------------
+//编码结果和tools.base64encode一致。解码和tools.base64decode一致，跳过不在字母表中的字符
+//x86上运行时检测CPU，支持AVX2/SSSE3时使用向量化实现(字节重排需要pshufb，SSE2中没有)，否则使用查表实现
+//向量化函数用target属性单独编译，不依赖编译参数，默认的x86-64构建也可以使用
+static const char base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#ifdef BASE64_SIMD
+#ifdef _MSC_VER
+#define BASE64_TARGET(isa)
+#else
+#define BASE64_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+enum base64_simd_level {
+    BASE64_SCALAR = 0,
+    BASE64_SSSE3,
+    BASE64_AVX2
+};
+
+int detect_base64_simd_level() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    int max_leaf = info[0];
+    __cpuid(info, 1);
+    bool ssse3 = (info[2] & (1 << 9)) != 0;
+    //AVX需要操作系统保存ymm寄存器(OSXSAVE且XCR0中开启了SSE和AVX状态)
+    bool os_avx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+    bool avx2 = false;
+    if (max_leaf >= 7 && os_avx) {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
+    }
+#else
+    __builtin_cpu_init();
+    bool ssse3 = __builtin_cpu_supports("ssse3") != 0;
+    bool avx2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+    if (avx2) {
+        return BASE64_AVX2;
+    }
+    return ssse3 ? BASE64_SSSE3 : BASE64_SCALAR;
+}
+
+//只检测一次，所有线程共享
+int base64_simd() {
+    static const int level = detect_base64_simd_level();
+    return level;
+}
+
+//一次编码24字节，输出32个字符。需要读取src[0, 28)
+BASE64_TARGET("avx2")
+size_t base64_encode_avx2(const unsigned char *src, size_t len, char *dst) {
+    const __m256i shuffle = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                                             1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i shift_lut = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                               '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+                                               'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                               '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    size_t done = 0;
+    while (len - done >= 28) {
+        __m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + done))),
+                                             _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + done + 12)), 1);
+        in = _mm256_shuffle_epi8(in, shuffle);
+        __m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+        __m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+        __m256i indices = _mm256_or_si256(t0, t1);
+        //0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12
+        __m256i offset = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        offset = _mm256_or_si256(offset, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        __m256i out = _mm256_add_epi8(_mm256_shuffle_epi8(shift_lut, offset), indices);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), out);
+        done += 24;
+        dst += 32;
+    }
+    return done;
+}
+
+//一次编码12字节，输出16个字符。需要读取src[0, 16)
+BASE64_TARGET("ssse3")
+size_t base64_encode_ssse3(const unsigned char *src, size_t len, char *dst) {
+    const __m128i shuffle = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m128i shift_lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                            '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    size_t done = 0;
+    while (len - done >= 16) {
+        __m128i in = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + done)), shuffle);
+        __m128i t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+        __m128i t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+        __m128i indices = _mm_or_si128(t0, t1);
+        __m128i offset = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+        __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+        offset = _mm_or_si128(offset, _mm_and_si128(less, _mm_set1_epi8(13)));
+        __m128i out = _mm_add_epi8(_mm_shuffle_epi8(shift_lut, offset), indices);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), out);
+        done += 12;
+        dst += 16;
+    }
+    return done;
+}
+
+//一次解码16个字符，输出12字节(写入16字节)。遇到不在字母表中的字符('=',换行等)时停止，剩余部分由查表实现处理
+BASE64_TARGET("ssse3")
+size_t base64_decode_ssse3(const unsigned char *src, size_t len, unsigned char *dst, size_t &written) {
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i pack_shuffle = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    size_t done = 0;
+    written = 0;
+    while (len - done >= 16) {
+        __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + done));
+        __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+        __m128i lo_nibbles = _mm_and_si128(in, _mm_set1_epi8(0x2f));
+        __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+        __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0) {
+            break;
+        }
+        __m128i eq_2f = _mm_cmpeq_epi8(in, _mm_set1_epi8(0x2f));
+        __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+        __m128i values = _mm_add_epi8(in, roll);
+        __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+        __m128i packed = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + written), _mm_shuffle_epi8(packed, pack_shuffle));
+        done += 16;
+        written += 12;
+    }
+    return done;
+}
+#endif
+
+void base64_encode_buffer(const unsigned char *src, size_t len, std::string &out) {
+    out.resize((len + 2) / 3 * 4);
+    char *dst = &out[0];
+    size_t done = 0;
+#ifdef BASE64_SIMD
+    int simd = base64_simd();
+    if (simd >= BASE64_AVX2) {
+        done = base64_encode_avx2(src, len, dst);
+        dst += done / 3 * 4;
+    }
+    if (simd >= BASE64_SSSE3) {
+        size_t sse_done = base64_encode_ssse3(src + done, len - done, dst);
+        done += sse_done;
+        dst += sse_done / 3 * 4;
+    }
+#endif
+    for (; len - done >= 3; done += 3) {
+        unsigned int n = (src[done] << 16) | (src[done + 1] << 8) | src[done + 2];
+        *dst++ = base64_chars[(n >> 18) & 0x3f];
+        *dst++ = base64_chars[(n >> 12) & 0x3f];
+        *dst++ = base64_chars[(n >> 6) & 0x3f];
+        *dst++ = base64_chars[n & 0x3f];
+    }
+    if (len - done == 1) {
+        unsigned int n = src[done] << 16;
+        *dst++ = base64_chars[(n >> 18) & 0x3f];
+        *dst++ = base64_chars[(n >> 12) & 0x3f];
+        *dst++ = '=';
+        *dst++ = '=';
+    } else if (len - done == 2) {
+        unsigned int n = (src[done] << 16) | (src[done + 1] << 8);
+        *dst++ = base64_chars[(n >> 18) & 0x3f];
+        *dst++ = base64_chars[(n >> 12) & 0x3f];
+        *dst++ = base64_chars[(n >> 6) & 0x3f];
+        *dst++ = '=';
+    }
+}
+
+//进程内所有虚拟机共享，只初始化一次
+static signed char base64_decode_table[256];
+std::once_flag base64_decode_table_once;
+
+void build_base64_decode_table() {
+    memset(base64_decode_table, -1, sizeof(base64_decode_table));
+    for (int i = 0; i < 64; i++) {
+        base64_decode_table[static_cast<unsigned char>(base64_chars[i])] = static_cast<signed char>(i);
+    }
+}
+
+void base64_decode_buffer(const unsigned char *src, size_t len, std::string &out) {
+    std::call_once(base64_decode_table_once, build_base64_decode_table);
+    const signed char *decode_table = base64_decode_table;
+    //向量化实现每次写入16字节，多留出空间
+    out.resize(len / 4 * 3 + 16);
+    unsigned char *dst = reinterpret_cast<unsigned char*>(&out[0]);
+    size_t written = 0;
+    size_t done = 0;
+#ifdef BASE64_SIMD
+    if (base64_simd() >= BASE64_SSSE3) {
+        done = base64_decode_ssse3(src, len, dst, written);
+    }
+#endif
+    unsigned int bits = 0;
+    int bit_count = 0;
+    for (; done < len; done++) {
+        signed char value = decode_table[src[done]];
+        if (value < 0) {
+            continue;
+        }
+        bits = (bits << 6) | static_cast<unsigned int>(value);
+        bit_count += 6;
+        if (bit_count >= 8) {
+            bit_count -= 8;
+            dst[written++] = static_cast<unsigned char>((bits >> bit_count) & 0xff);
+        }
+    }
+    out.resize(written);
+}
+
+//lua调用，base64编码
+extern "C" int base64_encode(lua_State *L) {
+    size_t len = 0;
+    const char *str = luaL_checklstring(L, 1, &len);
+#if !defined(USE_SOURCE_CODE) && defined(_WIN32)
+    if (lua_pushlstring == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+#endif
+    std::string out;
+    base64_encode_buffer(reinterpret_cast<const unsigned char*>(str), len, out);
+    lua_pushlstring(L, out.data(), out.size());
+    return 1;
+}
+
+//lua调用，base64解码
+extern "C" int base64_decode(lua_State *L) {
+    size_t len = 0;
+    const char *str = luaL_checklstring(L, 1, &len);
+#if !defined(USE_SOURCE_CODE) && defined(_WIN32)
+    if (lua_pushlstring == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+#endif
+    std::string out;
+    base64_decode_buffer(reinterpret_cast<const unsigned char*>(str), len, out);
+    lua_pushlstring(L, out.data(), out.size());
+    return 1;
+}
+
+//------------采样分析------------
+//count模式每N条指令在count hook中采样一次lua调用栈；timer模式由后台线程定时置位标记，count hook中检查标记后采样
+//调用栈按帧(source, linedefined, currentline)聚合，可导出为folded stacks(火焰图)或pprof
+const int profiler_max_frames = 128;        //每次采样最多记录的栈层数
+const size_t profiler_source_ptr_capacity = 4096;
+struct profiler_frame {
+    int source_id;
+    int linedefined;
+    int currentline;
+};
+
+int profiler_source_id(debugger_context *ctx, const char *source) {
+    if (source == NULL) {
+        source = "?";
+    }
+    std::unordered_map<const char*, int>::iterator ptr_iter = ctx->profiler_source_ptr.find(source);
+    if (ptr_iter != ctx->profiler_source_ptr.end() && ctx->profiler_sources[ptr_iter->second] == source) {
+        return ptr_iter->second;
+    }
+    int source_id;
+    std::unordered_map<std::string, int>::iterator iter = ctx->profiler_source_ids.find(source);
+    if (iter != ctx->profiler_source_ids.end()) {
+        source_id = iter->second;
+    } else {
+        source_id = static_cast<int>(ctx->profiler_sources.size());
+        ctx->profiler_sources.push_back(source);
+        ctx->profiler_source_ids[ctx->profiler_sources.back()] = source_id;
+    }
+    //source字符串被回收后地址可能被复用，地址缓存只作加速，满了就清空
+    if (ctx->profiler_source_ptr.size() >= profiler_source_ptr_capacity) {
+        ctx->profiler_source_ptr.clear();
+    }
+    ctx->profiler_source_ptr[source] = source_id;
+    return source_id;
+}
+
+int profiler_frame_id(debugger_context *ctx, const char *source, int linedefined, int currentline) {
+    int source_id = profiler_source_id(ctx, source);
+    unsigned long long key = (static_cast<unsigned long long>(source_id) << 40)
+        | (static_cast<unsigned long long>(linedefined & 0xfffff) << 20)
+        | static_cast<unsigned long long>(currentline & 0xfffff);
+    std::unordered_map<unsigned long long, int>::iterator iter = ctx->profiler_frame_ids.find(key);
+    if (iter != ctx->profiler_frame_ids.end()) {
+        return iter->second;
+    }
+    profiler_frame frame;
+    frame.source_id = source_id;
+    frame.linedefined = linedefined;
+    frame.currentline = currentline;
+    int frame_id = static_cast<int>(ctx->profiler_frames.size());
+    ctx->profiler_frames.push_back(frame);
+    ctx->profiler_frame_ids[key] = frame_id;
+    return frame_id;
+}
+
+//在count hook中调用，记录当前的lua调用栈
+//count hook的间隔可能小于采样间隔(受hook_instruction_budget影响)，count模式按每个协程执行的指令数倒计时
+void profiler_sample(debugger_context *ctx, lua_State *L) {
+    if (ctx->profiler_mode == PROFILER_TIMER) {
+        if (!ctx->profiler_timer_state.tick.load(std::memory_order_relaxed) || !ctx->profiler_timer_state.tick.exchange(false)) {
+            return;
+        }
+    } else {
+        thread_hook_state &thread_state = *ctx->cur_thread_state;
+        thread_state.profiler_countdown -= thread_state.installed_count;
+        if (thread_state.profiler_countdown > 0) {
+            return;
+        }
+        thread_state.profiler_countdown += ctx->profiler_interval;
+        if (thread_state.profiler_countdown <= 0) {
+            thread_state.profiler_countdown = ctx->profiler_interval;
+        }
+    }
+    lua_Debug frame;
+    ctx->profiler_stack_key.clear();
+    for (int level = 0; level < profiler_max_frames && lua_getstack(L, level, &frame); level++) {
+        if (lua_getinfo(L, "Sl", &frame) == 0) {
+            break;
+        }
+        int frame_id = profiler_frame_id(ctx, frame.source, frame.linedefined, frame.currentline);
+        ctx->profiler_stack_key.append(reinterpret_cast<const char*>(&frame_id), sizeof(frame_id));
+    }
+    if (ctx->profiler_stack_key.empty()) {
+        return;
+    }
+    ctx->profiler_stacks[ctx->profiler_stack_key]++;
+    ctx->profiler_sample_total++;
+}
+
+void profiler_timer_main(profiler_timer *timer, int interval_us) {
+    while (!timer->stop.load()) {
+        std::this_thread::sleep_for(std::chrono::microseconds(interval_us));
+        timer->tick.store(true, std::memory_order_relaxed);
+    }
+}
+
+//停止采样(保留结果)
+void profiler_shutdown(debugger_context *ctx) {
+    if (ctx->profiler_mode == PROFILER_OFF) {
+        return;
+    }
+    ctx->profiler_timer_state.shutdown();
+    ctx->profiler_elapsed_ms += monotonic_ms() - ctx->profiler_start_time;
+    ctx->profiler_mode = PROFILER_OFF;
+    ctx->profiler_count_instructions = 0;
+}
+
+//文件名和函数名。source去掉@和=前缀，代码串只保留第一行
+std::string profiler_source_name(const std::string &source) {
+    size_t begin = (!source.empty() && (source[0] == '@' || source[0] == '=')) ? 1 : 0;
+    size_t end = source.find_first_of("\r\n", begin);
+    if (end == std::string::npos) {
+        end = source.size();
+    }
+    if (end - begin > 60) {
+        end = begin + 60;
+    }
+    std::string name = source.substr(begin, end - begin);
+    //';'是folded格式的分隔符
+    std::replace(name.begin(), name.end(), ';', ',');
+    return name;
+}
+
+std::string profiler_function_name(debugger_context *ctx, const profiler_frame &frame) {
+    if (frame.linedefined < 0) {
+        return "[C]";
+    }
+    std::string name = profiler_source_name(ctx->profiler_sources[frame.source_id]);
+    if (frame.linedefined == 0) {
+        return name + ":main";
+    }
+    return name + ":" + std::to_string(frame.linedefined);
+}
+
+//folded stacks: 每行"栈底;...;栈顶 次数"，可直接用于flamegraph.pl / speedscope
+void profiler_export_folded(debugger_context *ctx, std::string &out) {
+    std::vector<std::string> labels(ctx->profiler_frames.size());
+    for (size_t i = 0; i < ctx->profiler_frames.size(); i++) {
+        labels[i] = profiler_function_name(ctx, ctx->profiler_frames[i]);
+        if (ctx->profiler_frames[i].currentline > 0) {
+            labels[i] += ":" + std::to_string(ctx->profiler_frames[i].currentline);
+        }
+    }
+    for (std::unordered_map<std::string, unsigned long long>::iterator iter = ctx->profiler_stacks.begin(); iter != ctx->profiler_stacks.end(); ++iter) {
+        const std::string &key = iter->first;
+        size_t depth = key.size() / sizeof(int);
+        for (size_t i = depth; i > 0; i--) {
+            int frame_id;
+            memcpy(&frame_id, key.data() + (i - 1) * sizeof(int), sizeof(int));
+            if (i != depth) {
+                out += ';';
+            }
+            out += labels[frame_id];
+        }
+        out += ' ';
+        out += std::to_string(iter->second);
+        out += '\n';
+    }
+}
+
+//pprof使用protobuf编码(profile.proto)，这里只写出用到的字段。输出未压缩，pprof工具可直接读取
+void pb_varint(std::string &out, unsigned long long value) {
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+void pb_uint(std::string &out, int field, unsigned long long value) {
+    pb_varint(out, static_cast<unsigned long long>(field) << 3);
+    pb_varint(out, value);
+}
+
+void pb_bytes(std::string &out, int field, const std::string &value) {
+    pb_varint(out, (static_cast<unsigned long long>(field) << 3) | 2);
+    pb_varint(out, value.size());
+    out += value;
+}
+
+struct pprof_strings {
+    std::vector<std::string> table;
+    std::unordered_map<std::string, int> index;
+    pprof_strings() {
+        get("");    //string_table[0]必须是空串
+    }
+    int get(const std::string &str) {
+        std::unordered_map<std::string, int>::iterator iter = index.find(str);
+        if (iter != index.end()) {
+            return iter->second;
+        }
+        int id = static_cast<int>(table.size());
+        table.push_back(str);
+        index[str] = id;
+        return id;
+    }
+};
+
+std::string pprof_value_type(pprof_strings &strings, const char *type, const char *unit) {
+    std::string value_type;
+    pb_uint(value_type, 1, strings.get(type));
+    pb_uint(value_type, 2, strings.get(unit));
+    return value_type;
+}
+
+void profiler_export_pprof(debugger_context *ctx, std::string &out) {
+    pprof_strings strings;
+    bool timer = ctx->profiler_sample_by_time;
+    //每个样本两个值: 采样次数，以及折算的cpu时间(timer)或指令数(count)
+    unsigned long long period = timer ? static_cast<unsigned long long>(ctx->profiler_interval) * 1000 : static_cast<unsigned long long>(ctx->profiler_interval);
+    std::string samples_type = pprof_value_type(strings, "samples", "count");
+    std::string period_type = timer ? pprof_value_type(strings, "cpu", "nanoseconds") : pprof_value_type(strings, "instructions", "count");
+    pb_bytes(out, 1, samples_type);
+    pb_bytes(out, 1, period_type);
+
+    for (std::unordered_map<std::string, unsigned long long>::iterator iter = ctx->profiler_stacks.begin(); iter != ctx->profiler_stacks.end(); ++iter) {
+        const std::string &key = iter->first;
+        std::string location_ids;
+        for (size_t i = 0; i < key.size() / sizeof(int); i++) {
+            int frame_id;
+            memcpy(&frame_id, key.data() + i * sizeof(int), sizeof(int));
+            pb_varint(location_ids, static_cast<unsigned long long>(frame_id) + 1);
+        }
+        std::string values;
+        pb_varint(values, iter->second);
+        pb_varint(values, iter->second * period);
+        std::string sample;
+        pb_bytes(sample, 1, location_ids);
+        pb_bytes(sample, 2, values);
+        pb_bytes(out, 2, sample);
+    }
+
+    //location和帧一一对应，function按(source, linedefined)合并
+    std::map<std::pair<int, int>, int> function_ids;
+    std::string functions;
+    for (size_t i = 0; i < ctx->profiler_frames.size(); i++) {
+        const profiler_frame &frame = ctx->profiler_frames[i];
+        std::pair<int, int> function_key(frame.source_id, frame.linedefined);
+        std::map<std::pair<int, int>, int>::iterator func_iter = function_ids.find(function_key);
+        int function_id;
+        if (func_iter == function_ids.end()) {
+            function_id = static_cast<int>(function_ids.size()) + 1;
+            function_ids[function_key] = function_id;
+            std::string function;
+            int name = strings.get(profiler_function_name(ctx, frame));
+            pb_uint(function, 1, function_id);
+            pb_uint(function, 2, name);
+            pb_uint(function, 3, name);
+            pb_uint(function, 4, strings.get(profiler_source_name(ctx->profiler_sources[frame.source_id])));
+            pb_uint(function, 5, frame.linedefined > 0 ? frame.linedefined : 0);
+            pb_bytes(functions, 5, function);
+        } else {
+            function_id = func_iter->second;
+        }
+        std::string line;
+        pb_uint(line, 1, function_id);
+        pb_uint(line, 2, frame.currentline > 0 ? frame.currentline : 0);
+        std::string location;
+        pb_uint(location, 1, i + 1);
+        pb_bytes(location, 4, line);
+        pb_bytes(out, 4, location);
+    }
+    out += functions;
+
+    for (size_t i = 0; i < strings.table.size(); i++) {
+        pb_bytes(out, 6, strings.table[i]);
+    }
+    double elapsed_ms = ctx->profiler_elapsed_ms;
+    if (ctx->profiler_mode != PROFILER_OFF) {
+        elapsed_ms += monotonic_ms() - ctx->profiler_start_time;
+    }
+    pb_uint(out, 10, static_cast<unsigned long long>(elapsed_ms * 1000000));
+    pb_bytes(out, 11, period_type);
+    pb_uint(out, 12, period);
+}
+
+//lua调用，开始采样。参数: 模式("count"|"timer"), 间隔(count为指令数，timer为微秒，<=0使用默认值1000)
+//需在LuaPanda.start之后调用，采样依赖debug_hook_c中的count hook
+extern "C" int profiler_start(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    const char *mode = luaL_checkstring(L, 1);
+    int interval = static_cast<int>(luaL_checkinteger(L, 2));
+    if (interval <= 0) {
+        interval = 1000;
+    }
+    profiler_shutdown(ctx);
+    ctx->profiler_interval = interval;
+    ctx->profiler_sample_by_time = !strcmp(mode, "timer");
+    if (ctx->profiler_sample_by_time) {
+        ctx->profiler_mode = PROFILER_TIMER;
+        ctx->profiler_count_instructions = profiler_timer_check_instructions;
+        ctx->profiler_timer_state.thread = std::thread(profiler_timer_main, &ctx->profiler_timer_state, interval);
+    } else {
+        ctx->profiler_mode = PROFILER_COUNT;
+        ctx->profiler_count_instructions = interval;
+    }
+    for (std::unordered_map<lua_State*, thread_hook_state>::iterator iter = ctx->thread_states.begin(); iter != ctx->thread_states.end(); ++iter) {
+        iter->second.profiler_countdown = interval;
+    }
+    ctx->profiler_start_time = monotonic_ms();
+    refresh_thread_hooks(ctx, L, ctx->cur_hook_state);
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+//lua调用，停止采样，保留已采样的结果。返回采样总次数
+extern "C" int profiler_stop(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    if (ctx->profiler_mode != PROFILER_OFF) {
+        profiler_shutdown(ctx);
+        refresh_thread_hooks(ctx, L, ctx->cur_hook_state);
+    }
+    lua_pushnumber(L, static_cast<lua_Number>(ctx->profiler_sample_total));
+    return 1;
+}
+
+//lua调用，清空采样结果
+extern "C" int profiler_clear(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    ctx->profiler_sources.clear();
+    ctx->profiler_source_ptr.clear();
+    ctx->profiler_source_ids.clear();
+    ctx->profiler_frames.clear();
+    ctx->profiler_frame_ids.clear();
+    ctx->profiler_stacks.clear();
+    ctx->profiler_sample_total = 0;
+    ctx->profiler_elapsed_ms = 0;
+    ctx->profiler_start_time = monotonic_ms();
+    return 0;
+}
+
+//临时文件目录中的文件路径
+std::string tempfile_path(debugger_context *ctx, const std::string &name) {
+    std::string path = ctx->config_tempfile_path;
+    if (!path.empty()) {
+        path += '/';
+    }
+    return path + name;
+}
+
+//把文件写入临时文件目录，结果压栈。返回: 文件路径 / nil, 错误信息
+int write_tempfile(debugger_context *ctx, lua_State *L, const std::string &name, const std::string &content) {
+    std::string path = tempfile_path(ctx, name);
+    FILE *file = fopen(path.c_str(), "wb");
+    if (file == NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L, ("open file failed: " + path).c_str());
+        return 2;
+    }
+    size_t written = fwrite(content.data(), 1, content.size(), file);
+    fclose(file);
+    if (written != content.size()) {
+        lua_pushnil(L);
+        lua_pushstring(L, ("write file failed: " + path).c_str());
+        return 2;
+    }
+    lua_pushstring(L, path.c_str());
+    return 1;
+}
+
+//lua调用，把采样结果写入临时文件目录。参数: 格式("folded"|"pprof")
+//返回: 文件路径 / nil, 错误信息
+extern "C" int profiler_dump(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    const char *format = luaL_checkstring(L, 1);
+    std::string out;
+    if (!strcmp(format, "pprof")) {
+        profiler_export_pprof(ctx, out);
+        return write_tempfile(ctx, L, "luapanda_cpu.pb", out);
+    }
+    profiler_export_folded(ctx, out);
+    return write_tempfile(ctx, L, "luapanda_cpu.folded", out);
+}
+
+//------------函数耗时统计------------
+//开启后在CALL/RETURN事件中记录时间，每个协程维护一个影子栈，按函数统计调用次数、包含子调用的耗时和自身耗时
+//函数以(ar->source的地址, linedefined)区分。source是虚拟机内部化的字符串，函数原型存活期间地址不变；c函数统一记为[C]
+//协程未运行的时间记入其栈顶函数的子调用耗时，即包含耗时为墙钟时间，自身耗时只统计实际运行的时间
+struct trace_function_stat {
+    std::string source;
+    int linedefined;
+    unsigned long long calls;
+    double inclusive_ms;
+    double exclusive_ms;
+    int active;                 //在各影子栈中未返回的次数，递归调用只统计最外层的包含耗时
+};
+struct trace_frame {
+    int stat_id;
+    double start_time;
+    double child_ms;            //子调用(及协程挂起)的耗时
+};
+struct trace_thread_stack {
+    std::vector<trace_frame> frames;
+    double suspend_time;        //切换到其他协程的时间，0表示正在运行
+};
+
+//chunk重新加载(热更新)后，新的source字符串可能复用旧的地址，按地址命中后仍比较内容，不同时按文件名重新查找
+int trace_function_id(debugger_context *ctx, const char *source, int linedefined) {
+    trace_function_key key;
+    key.source = source;
+    key.linedefined = linedefined;
+    const char *name = source != NULL ? source : "?";
+    std::unordered_map<trace_function_key, int, trace_function_key_hash>::iterator iter = ctx->trace_function_ids.find(key);
+    if (iter != ctx->trace_function_ids.end() && ctx->trace_stats[iter->second].source == name) {
+        return iter->second;
+    }
+    int stat_id;
+    std::pair<std::string, int> name_key(name, linedefined);
+    std::map<std::pair<std::string, int>, int>::iterator name_iter = ctx->trace_function_name_ids.find(name_key);
+    if (name_iter != ctx->trace_function_name_ids.end()) {
+        stat_id = name_iter->second;
+    } else {
+        trace_function_stat stat;
+        stat.source = name;
+        stat.linedefined = linedefined;
+        stat.calls = 0;
+        stat.inclusive_ms = 0;
+        stat.exclusive_ms = 0;
+        stat.active = 0;
+        stat_id = static_cast<int>(ctx->trace_stats.size());
+        ctx->trace_stats.push_back(stat);
+        ctx->trace_function_name_ids[name_key] = stat_id;
+    }
+    ctx->trace_function_ids[key] = stat_id;
+    return stat_id;
+}
+
+void trace_push(debugger_context *ctx, trace_thread_stack &stack, int stat_id, double now) {
+    trace_frame frame;
+    frame.stat_id = stat_id;
+    frame.start_time = now;
+    frame.child_ms = 0;
+    stack.frames.push_back(frame);
+    trace_function_stat &stat = ctx->trace_stats[stat_id];
+    stat.calls++;
+    stat.active++;
+}
+
+void trace_pop(debugger_context *ctx, trace_thread_stack &stack, double now) {
+    trace_frame frame = stack.frames.back();
+    stack.frames.pop_back();
+    double inclusive = now - frame.start_time;
+    trace_function_stat &stat = ctx->trace_stats[frame.stat_id];
+    stat.exclusive_ms += inclusive - frame.child_ms;
+    if (--stat.active == 0) {
+        stat.inclusive_ms += inclusive;
+    }
+    if (!stack.frames.empty()) {
+        stack.frames.back().child_ms += inclusive;
+    }
+}
+
+//取当前协程的影子栈。切换协程时，挂起的时间记入栈顶函数的子调用耗时
+trace_thread_stack &trace_thread(debugger_context *ctx, lua_State *L, double now) {
+    if (L != ctx->trace_current_thread) {
+        std::unordered_map<lua_State*, trace_thread_stack>::iterator prev = ctx->trace_stacks.find(ctx->trace_current_thread);
+        if (prev != ctx->trace_stacks.end()) {
+            if (prev->second.frames.empty()) {
+                ctx->trace_stacks.erase(prev);
+            } else {
+                prev->second.suspend_time = now;
+            }
+        }
+        ctx->trace_current_thread = L;
+    }
+    trace_thread_stack &stack = ctx->trace_stacks[L];
+    if (stack.suspend_time > 0) {
+        if (!stack.frames.empty()) {
+            stack.frames.back().child_ms += now - stack.suspend_time;
+        }
+        stack.suspend_time = 0;
+    }
+    return stack;
+}
+
+//在debug_hook_c中处理CALL/RETURN/TAILRET(TAILCALL)事件
+void trace_process_event(debugger_context *ctx, lua_State *L, lua_Debug *ar) {
+    double now = monotonic_ms();
+    trace_thread_stack &stack = trace_thread(ctx, L, now);
+#if LUA_VERSION_NUM == 501
+    //5.1中尾调用返回时，为每个被尾调用替换的函数补发一次TAILRET
+    if (ar->event == TAILRET) {
+        if (!stack.frames.empty()) {
+            trace_pop(ctx, stack, now);
+        }
+        return;
+    }
+#endif
+    if (lua_getinfo(L, "S", ar) == 0) {
+        return;
+    }
+    int stat_id = trace_function_id(ctx, ar->source, ar->linedefined);
+    if (ar->event == CALL) {
+        trace_push(ctx, stack, stat_id, now);
+        return;
+    }
+#if LUA_VERSION_NUM > 501
+    //5.2以后这个事件是TAILCALL，调用者的栈帧已被替换，不会再有它的RETURN事件
+    if (ar->event == TAILRET) {
+        if (!stack.frames.empty()) {
+            trace_pop(ctx, stack, now);
+        }
+        trace_push(ctx, stack, stat_id, now);
+        return;
+    }
+#endif
+    //RETURN。出错时lua不产生RETURN事件，向下找到返回的函数，其上未返回的栈帧一并结束
+    //找不到时是开始统计前进入的函数，忽略
+    for (size_t i = stack.frames.size(); i > 0; i--) {
+        if (stack.frames[i - 1].stat_id == stat_id) {
+            while (stack.frames.size() >= i) {
+                trace_pop(ctx, stack, now);
+            }
+            break;
+        }
+    }
+}
+
+void trace_shutdown(debugger_context *ctx) {
+    if (!ctx->trace_enabled) {
+        return;
+    }
+    //未返回的函数不计入结果
+    for (std::unordered_map<lua_State*, trace_thread_stack>::iterator iter = ctx->trace_stacks.begin(); iter != ctx->trace_stacks.end(); ++iter) {
+        for (size_t i = 0; i < iter->second.frames.size(); i++) {
+            ctx->trace_stats[iter->second.frames[i].stat_id].active = 0;
+        }
+    }
+    ctx->trace_stacks.clear();
+    ctx->trace_current_thread = NULL;
+    ctx->trace_elapsed_ms += monotonic_ms() - ctx->trace_start_time;
+    ctx->trace_enabled = false;
+}
+
+//按函数的自身耗时比较
+struct trace_exclusive_greater {
+    explicit trace_exclusive_greater(const std::vector<trace_function_stat> &s) : stats(s) {}
+    bool operator()(int a, int b) const {
+        return stats[a].exclusive_ms > stats[b].exclusive_ms;
+    }
+    const std::vector<trace_function_stat> &stats;
+};
+
+//按自身耗时从大到小排序
+std::vector<int> trace_sorted_ids(debugger_context *ctx) {
+    std::vector<int> ids(ctx->trace_stats.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+        ids[i] = static_cast<int>(i);
+    }
+    std::sort(ids.begin(), ids.end(), trace_exclusive_greater(ctx->trace_stats));
+    return ids;
+}
+
+std::string trace_function_name(const trace_function_stat &stat) {
+    return stat.linedefined < 0 ? "[C]" : profiler_source_name(stat.source);
+}
+
+void trace_export_csv(debugger_context *ctx, std::string &out) {
+    char buf[128];
+    out += "source,linedefined,calls,inclusive_ms,exclusive_ms\n";
+    std::vector<int> ids = trace_sorted_ids(ctx);
+    for (size_t i = 0; i < ids.size(); i++) {
+        const trace_function_stat &stat = ctx->trace_stats[ids[i]];
+        std::string name = trace_function_name(stat);
+        out += '"';
+        for (size_t j = 0; j < name.size(); j++) {
+            if (name[j] == '"') {
+                out += '"';
+            }
+            out += name[j];
+        }
+        out += '"';
+        snprintf(buf, sizeof(buf), ",%d,%llu,%.3f,%.3f\n", stat.linedefined, stat.calls, stat.inclusive_ms, stat.exclusive_ms);
+        out += buf;
+    }
+}
+
+void trace_export_json(debugger_context *ctx, std::string &out) {
+    char buf[128];
+    double elapsed_ms = ctx->trace_elapsed_ms;
+    if (ctx->trace_enabled) {
+        elapsed_ms += monotonic_ms() - ctx->trace_start_time;
+    }
+    snprintf(buf, sizeof(buf), "{\"elapsed_ms\":%.3f,\"functions\":[", elapsed_ms);
+    out += buf;
+    std::vector<int> ids = trace_sorted_ids(ctx);
+    for (size_t i = 0; i < ids.size(); i++) {
+        const trace_function_stat &stat = ctx->trace_stats[ids[i]];
+        std::string name = trace_function_name(stat);
+        if (i > 0) {
+            out += ',';
+        }
+        out += "{\"source\":";
+        json_append_string(out, name.c_str(), name.size());
+        snprintf(buf, sizeof(buf), ",\"linedefined\":%d,\"calls\":%llu,\"inclusive_ms\":%.3f,\"exclusive_ms\":%.3f}", stat.linedefined, stat.calls, stat.inclusive_ms, stat.exclusive_ms);
+        out += buf;
+    }
+    out += "]}";
+}
+
+//lua调用，开始统计函数耗时，之前的结果保留
+extern "C" int trace_start(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    if (!ctx->trace_enabled) {
+        ctx->trace_enabled = true;
+        ctx->trace_start_time = monotonic_ms();
+        refresh_thread_hooks(ctx, L, ctx->cur_hook_state);
+    }
+    return 0;
+}
+
+//lua调用，停止统计函数耗时
+extern "C" int trace_stop(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    if (ctx->trace_enabled) {
+        trace_shutdown(ctx);
+        refresh_thread_hooks(ctx, L, ctx->cur_hook_state);
+    }
+    return 0;
+}
+
+//lua调用，清空统计结果
+extern "C" int trace_clear(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    ctx->trace_function_ids.clear();
+    ctx->trace_function_name_ids.clear();
+    ctx->trace_stats.clear();
+    ctx->trace_stacks.clear();
+    ctx->trace_current_thread = NULL;
+    ctx->trace_elapsed_ms = 0;
+    ctx->trace_start_time = monotonic_ms();
+    return 0;
+}
+
+//lua调用，获取统计结果。参数: 最多返回的函数个数(<=0不限制)
+//返回: 按自身耗时排序的数组 {source, linedefined, calls, inclusive, exclusive}，耗时单位为毫秒
+extern "C" int get_trace_stats(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    int limit = static_cast<int>(luaL_checkinteger(L, 1));
+    std::vector<int> ids = trace_sorted_ids(ctx);
+    if (limit > 0 && ids.size() > static_cast<size_t>(limit)) {
+        ids.resize(limit);
+    }
+    lua_createtable(L, static_cast<int>(ids.size()), 0);
+    for (size_t i = 0; i < ids.size(); i++) {
+        const trace_function_stat &stat = ctx->trace_stats[ids[i]];
+        lua_createtable(L, 0, 5);
+        set_string_field(L, "source", trace_function_name(stat));
+        lua_pushnumber(L, stat.linedefined);
+        lua_setfield(L, -2, "linedefined");
+        lua_pushnumber(L, static_cast<lua_Number>(stat.calls));
+        lua_setfield(L, -2, "calls");
+        lua_pushnumber(L, stat.inclusive_ms);
+        lua_setfield(L, -2, "inclusive");
+        lua_pushnumber(L, stat.exclusive_ms);
+        lua_setfield(L, -2, "exclusive");
+        lua_rawseti(L, -2, static_cast<int>(i) + 1);
+    }
+    return 1;
+}
+
+//lua调用，把统计结果写入临时文件目录。参数: 格式("csv"|"json")
+//返回: 文件路径 / nil, 错误信息
+extern "C" int trace_dump(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    const char *format = luaL_checkstring(L, 1);
+    std::string out;
+    if (!strcmp(format, "json")) {
+        trace_export_json(ctx, out);
+        return write_tempfile(ctx, L, "luapanda_functions.json", out);
+    }
+    trace_export_csv(ctx, out);
+    return write_tempfile(ctx, L, "luapanda_functions.csv", out);
+}
+
+//------------覆盖率------------
+//开启后所有hook状态都加入LINE事件，在C中把执行过的行记入每个chunk的位图，不调用lua
+//导出为lcov或Cobertura。只统计从文件加载的chunk(source以@开头)，忽略调试器自身的文件
+struct coverage_chunk {
+    std::string source;
+    bool ignored;
+    std::vector<unsigned long long> hit_lines;      //执行过的行
+    std::vector<unsigned long long> active_lines;   //可执行的行(来自activelines)
+    std::vector<unsigned int> hit_counts;           //每行的执行次数，开启计数时使用
+};
+
+void coverage_set_bit(std::vector<unsigned long long> &bits, int line) {
+    size_t word = static_cast<size_t>(line) >> 6;
+    if (word >= bits.size()) {
+        bits.resize(word + 1, 0);
+    }
+    bits[word] |= 1ULL << (line & 63);
+}
+
+bool coverage_test_bit(const std::vector<unsigned long long> &bits, int line) {
+    size_t word = static_cast<size_t>(line) >> 6;
+    return word < bits.size() && (bits[word] & (1ULL << (line & 63))) != 0;
+}
+
+int coverage_chunk_id(debugger_context *ctx, const char *source) {
+    std::unordered_map<const char*, int>::iterator ptr_iter = ctx->coverage_chunk_ptr.find(source);
+    if (ptr_iter != ctx->coverage_chunk_ptr.end() && ctx->coverage_chunks[ptr_iter->second].source == source) {
+        return ptr_iter->second;
+    }
+    int chunk_id;
+    std::unordered_map<std::string, int>::iterator iter = ctx->coverage_chunk_ids.find(source);
+    if (iter != ctx->coverage_chunk_ids.end()) {
+        chunk_id = iter->second;
+    } else {
+        coverage_chunk chunk;
+        chunk.source = source;
+        chunk.ignored = source[0] != '@' || (ctx->debug_file_path != NULL && !strcmp(source, ctx->debug_file_path))
+            || (ctx->tools_file_path != NULL && !strcmp(source, ctx->tools_file_path));
+        chunk_id = static_cast<int>(ctx->coverage_chunks.size());
+        ctx->coverage_chunks.push_back(chunk);
+        ctx->coverage_chunk_ids[ctx->coverage_chunks.back().source] = chunk_id;
+    }
+    if (ctx->coverage_chunk_ptr.size() >= profiler_source_ptr_capacity) {
+        ctx->coverage_chunk_ptr.clear();
+    }
+    ctx->coverage_chunk_ptr[source] = chunk_id;
+    return chunk_id;
+}
+
+//函数首次执行时按lastlinedefined预留位图，并用activelines标记可执行的行
+void coverage_first_call(debugger_context *ctx, lua_State *L, lua_Debug *ar, coverage_chunk &chunk) {
+    int last_line = ar->lastlinedefined > ar->currentline ? ar->lastlinedefined : ar->currentline;
+    size_t words = (static_cast<size_t>(last_line) >> 6) + 1;
+    if (chunk.hit_lines.size() < words) {
+        chunk.hit_lines.resize(words, 0);
+    }
+    if (ctx->coverage_count_hits && chunk.hit_counts.size() < static_cast<size_t>(last_line) + 1) {
+        chunk.hit_counts.resize(last_line + 1, 0);
+    }
+    if (!ctx->coverage_use_activelines || lua_getinfo(L, "L", ar) == 0) {
+        return;
+    }
+    if (lua_type(L, -1) == LUA_TTABLE) {
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+            int line = (int)lua_tointeger(L, -2);
+            if (line > 0) {
+                coverage_set_bit(chunk.active_lines, line);
+            }
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+}
+
+//在debug_hook_c中处理LINE事件
+void coverage_record(debugger_context *ctx, lua_State *L, lua_Debug *ar) {
+    if (lua_getinfo(L, "S", ar) == 0 || ar->source == NULL || ar->currentline <= 0) {
+        return;
+    }
+    //source被回收后地址可能被新加载的chunk复用，和coverage_chunk_id一样比较内容
+    if (ar->source != ctx->coverage_last_source || ctx->coverage_chunks[ctx->coverage_last_chunk].source != ar->source) {
+        ctx->coverage_last_chunk = coverage_chunk_id(ctx, ar->source);
+        ctx->coverage_last_source = ar->source;
+    }
+    coverage_chunk &chunk = ctx->coverage_chunks[ctx->coverage_last_chunk];
+    if (chunk.ignored) {
+        return;
+    }
+    trace_function_key key;
+    key.source = ar->source;
+    key.linedefined = ar->linedefined;
+    if (ctx->coverage_seen_functions.insert(key).second) {
+        coverage_first_call(ctx, L, ar, chunk);
+    }
+    int line = ar->currentline;
+    coverage_set_bit(chunk.hit_lines, line);
+    if (ctx->coverage_count_hits) {
+        if (chunk.hit_counts.size() <= static_cast<size_t>(line)) {
+            chunk.hit_counts.resize(line + 1, 0);
+        }
+        chunk.hit_counts[line]++;
+    }
+}
+
+//执行过或可执行的行，以及执行次数(未开启计数时执行过记为1)
+void coverage_chunk_lines(const coverage_chunk &chunk, std::vector<std::pair<int, unsigned int> > &lines) {
+    lines.clear();
+    size_t words = std::max(chunk.hit_lines.size(), chunk.active_lines.size());
+    for (size_t word = 0; word < words; word++) {
+        unsigned long long bits = (word < chunk.hit_lines.size() ? chunk.hit_lines[word] : 0)
+            | (word < chunk.active_lines.size() ? chunk.active_lines[word] : 0);
+        for (int bit = 0; bits != 0 && bit < 64; bit++, bits >>= 1) {
+            if ((bits & 1) == 0) {
+                continue;
+            }
+            int line = static_cast<int>(word * 64) + bit;
+            unsigned int hits = 0;
+            if (coverage_test_bit(chunk.hit_lines, line)) {
+                hits = static_cast<size_t>(line) < chunk.hit_counts.size() && chunk.hit_counts[line] > 0 ? chunk.hit_counts[line] : 1;
+            }
+            lines.push_back(std::make_pair(line, hits));
+        }
+    }
+}
+
+void coverage_export_lcov(debugger_context *ctx, std::string &out) {
+    char buf[64];
+    std::vector<std::pair<int, unsigned int> > lines;
+    out += "TN:\n";
+    for (size_t i = 0; i < ctx->coverage_chunks.size(); i++) {
+        const coverage_chunk &chunk = ctx->coverage_chunks[i];
+        if (chunk.ignored) {
+            continue;
+        }
+        coverage_chunk_lines(chunk, lines);
+        int hit = 0;
+        out += "SF:";
+        out += chunk.source.substr(1);
+        out += '\n';
+        for (size_t j = 0; j < lines.size(); j++) {
+            snprintf(buf, sizeof(buf), "DA:%d,%u\n", lines[j].first, lines[j].second);
+            out += buf;
+            if (lines[j].second > 0) {
+                hit++;
+            }
+        }
+        snprintf(buf, sizeof(buf), "LF:%d\nLH:%d\n", static_cast<int>(lines.size()), hit);
+        out += buf;
+        out += "end_of_record\n";
+    }
+}
+
+void coverage_append_xml(std::string &out, const std::string &str) {
+    for (size_t i = 0; i < str.size(); i++) {
+        switch (str[i]) {
+            case '&': out += "&amp;"; break;
+            case '<': out += "&lt;"; break;
+            case '>': out += "&gt;"; break;
+            case '"': out += "&quot;"; break;
+            default: out += str[i]; break;
+        }
+    }
+}
+
+void coverage_export_cobertura(debugger_context *ctx, std::string &out) {
+    char buf[256];
+    std::vector<std::pair<int, unsigned int> > lines;
+    std::string classes;
+    int total_valid = 0;
+    int total_covered = 0;
+    for (size_t i = 0; i < ctx->coverage_chunks.size(); i++) {
+        const coverage_chunk &chunk = ctx->coverage_chunks[i];
+        if (chunk.ignored) {
+            continue;
+        }
+        coverage_chunk_lines(chunk, lines);
+        std::string line_items;
+        int covered = 0;
+        for (size_t j = 0; j < lines.size(); j++) {
+            snprintf(buf, sizeof(buf), "<line number=\"%d\" hits=\"%u\"/>\n", lines[j].first, lines[j].second);
+            line_items += buf;
+            if (lines[j].second > 0) {
+                covered++;
+            }
+        }
+        total_valid += static_cast<int>(lines.size());
+        total_covered += covered;
+        std::string filename = chunk.source.substr(1);
+        classes += "<class name=\"";
+        coverage_append_xml(classes, filename);
+        classes += "\" filename=\"";
+        coverage_append_xml(classes, filename);
+        snprintf(buf, sizeof(buf), "\" line-rate=\"%.4f\" branch-rate=\"0\" complexity=\"0\">\n<methods/>\n<lines>\n", lines.empty() ? 0.0 : static_cast<double>(covered) / lines.size());
+        classes += buf;
+        classes += line_items;
+        classes += "</lines>\n</class>\n";
+    }
+    double rate = total_valid == 0 ? 0.0 : static_cast<double>(total_covered) / total_valid;
+    out += "<?xml version=\"1.0\" ?>\n<!DOCTYPE coverage SYSTEM \"http://cobertura.sourceforge.net/xml/coverage-04.dtd\">\n";
+    snprintf(buf, sizeof(buf), "<coverage line-rate=\"%.4f\" branch-rate=\"0\" lines-covered=\"%d\" lines-valid=\"%d\" branches-covered=\"0\" branches-valid=\"0\" complexity=\"0\" version=\"LuaPanda\" timestamp=\"%lld\">\n",
+        rate, total_covered, total_valid, static_cast<long long>(time(NULL)) * 1000);
+    out += buf;
+    out += "<sources>\n<source>";
+    coverage_append_xml(out, ctx->config_cwd);
+    out += "</source>\n</sources>\n<packages>\n";
+    snprintf(buf, sizeof(buf), "<package name=\"lua\" line-rate=\"%.4f\" branch-rate=\"0\" complexity=\"0\">\n<classes>\n", rate);
+    out += buf;
+    out += classes;
+    out += "</classes>\n</package>\n</packages>\n</coverage>\n";
+}
+
+//lua调用，开始收集覆盖率，之前的结果保留。参数: 是否记录每行执行次数, 是否用activelines标记可执行的行
+extern "C" int coverage_start(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    ctx->coverage_count_hits = lua_toboolean(L, 1) != 0;
+    ctx->coverage_use_activelines = lua_toboolean(L, 2) != 0;
+    if (!ctx->coverage_enabled) {
+        ctx->coverage_enabled = true;
+        refresh_thread_hooks(ctx, L, ctx->cur_hook_state);
+    }
+    return 0;
+}
+
+//lua调用，停止收集覆盖率
+extern "C" int coverage_stop(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    if (ctx->coverage_enabled) {
+        ctx->coverage_enabled = false;
+        refresh_thread_hooks(ctx, L, ctx->cur_hook_state);
+    }
+    return 0;
+}
+
+//lua调用，清空覆盖率结果
+extern "C" int coverage_clear(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    ctx->coverage_chunks.clear();
+    ctx->coverage_chunk_ptr.clear();
+    ctx->coverage_chunk_ids.clear();
+    ctx->coverage_seen_functions.clear();
+    ctx->coverage_last_source = NULL;
+    ctx->coverage_last_chunk = -1;
+    return 0;
+}
+
+//lua调用，把覆盖率写入临时文件目录。参数: 格式("lcov"|"cobertura")
+//返回: 文件路径 / nil, 错误信息
+extern "C" int coverage_dump(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    const char *format = luaL_checkstring(L, 1);
+    std::string out;
+    if (!strcmp(format, "cobertura")) {
+        coverage_export_cobertura(ctx, out);
+        return write_tempfile(ctx, L, "luapanda_coverage.xml", out);
+    }
+    coverage_export_lcov(ctx, out);
+    return write_tempfile(ctx, L, "luapanda_coverage.info", out);
+}
+
+//------------内存分配统计------------
+//替换虚拟机的分配函数，每分配N字节采样一次，按分配位置统计存活字节数和累计分配字节数
+//分配函数中拿不到当前运行的协程，采样的内存块先放入待定列表，在下一个hook事件中用当时的调用栈确定分配位置
+struct alloc_site {
+    std::string name;               //source:line
+    long long live_bytes;
+    long long total_bytes;
+    unsigned long long samples;
+};
+struct alloc_block {
+    int site_id;                    //-1表示还未确定分配位置
+    long long weight;               //这次采样代表的字节数
+    size_t pending_index;           //在alloc_pending中的位置，site_id为-1时有效
+};
+struct alloc_pending_block {
+    void *ptr;
+    long long weight;
+    bool freed;
+};
+const size_t alloc_snapshot_capacity = 16;
+
+int native_alloc_available() {
+#if !defined(USE_SOURCE_CODE) && defined(_WIN32)
+    return lua_getallocf != NULL && lua_setallocf != NULL;
+#else
+    return 1;
+#endif
+}
+
+void alloc_add_pending(debugger_context *ctx, void *ptr, long long weight) {
+    alloc_block block;
+    block.site_id = -1;
+    block.weight = weight;
+    block.pending_index = ctx->alloc_pending.size();
+    ctx->alloc_blocks[ptr] = block;
+    alloc_pending_block pending;
+    pending.ptr = ptr;
+    pending.weight = weight;
+    pending.freed = false;
+    ctx->alloc_pending.push_back(pending);
+}
+
+//替换后的分配函数，ud为虚拟机的上下文
+void *alloc_profiler_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    debugger_context *ctx = static_cast<debugger_context*>(ud);
+    void *result = ctx->alloc_original_f(ctx->alloc_original_ud, ptr, osize, nsize);
+    if (!ctx->alloc_enabled || (nsize != 0 && result == NULL)) {
+        return result;
+    }
+    if (ptr != NULL && !ctx->alloc_blocks.empty()) {
+        std::unordered_map<void*, alloc_block>::iterator iter = ctx->alloc_blocks.find(ptr);
+        if (iter != ctx->alloc_blocks.end()) {
+            alloc_block block = iter->second;
+            ctx->alloc_blocks.erase(iter);
+            if (nsize == 0) {
+                if (block.site_id >= 0) {
+                    ctx->alloc_sites[block.site_id].live_bytes -= block.weight;
+                } else {
+                    ctx->alloc_pending[block.pending_index].freed = true;
+                }
+            } else {
+                //realloc后内存块仍代表原来的采样
+                ctx->alloc_blocks[result] = block;
+                if (block.site_id < 0) {
+                    ctx->alloc_pending[block.pending_index].ptr = result;
+                }
+            }
+            return result;
+        }
+    }
+    if (ctx->alloc_suspend_depth > 0) {
+        return result;
+    }
+    //5.2以后ptr为NULL时osize表示对象类型，不是原大小
+    size_t old_size = ptr != NULL ? osize : 0;
+    if (nsize <= old_size) {
+        return result;
+    }
+    long long grown = static_cast<long long>(nsize - old_size);
+    if (ctx->alloc_sample_bytes <= 0) {
+        alloc_add_pending(ctx, result, grown);
+        return result;
+    }
+    ctx->alloc_countdown -= grown;
+    if (ctx->alloc_countdown <= 0) {
+        long long crossings = 1 + (-ctx->alloc_countdown) / ctx->alloc_sample_bytes;
+        ctx->alloc_countdown += crossings * ctx->alloc_sample_bytes;
+        alloc_add_pending(ctx, result, crossings * ctx->alloc_sample_bytes);
+    }
+    return result;
+}
+
+//分配位置为调用栈上第一个lua函数的当前行
+int alloc_site_id(debugger_context *ctx, lua_State *L) {
+    lua_Debug frame;
+    std::string name = "[C]";
+    for (int level = 0; lua_getstack(L, level, &frame); level++) {
+        if (lua_getinfo(L, "Sl", &frame) == 0) {
+            break;
+        }
+        if (frame.currentline > 0) {
+            name = profiler_source_name(frame.source != NULL ? frame.source : "?") + ":" + std::to_string(frame.currentline);
+            break;
+        }
+    }
+    std::unordered_map<std::string, int>::iterator iter = ctx->alloc_site_ids.find(name);
+    if (iter != ctx->alloc_site_ids.end()) {
+        return iter->second;
+    }
+    alloc_site site;
+    site.name = name;
+    site.live_bytes = 0;
+    site.total_bytes = 0;
+    site.samples = 0;
+    int site_id = static_cast<int>(ctx->alloc_sites.size());
+    ctx->alloc_sites.push_back(site);
+    ctx->alloc_site_ids[name] = site_id;
+    return site_id;
+}
+
+//在debug_hook_c中调用，用当前调用栈确定待定内存块的分配位置
+void alloc_resolve_pending(debugger_context *ctx, lua_State *L) {
+    int site_id = alloc_site_id(ctx, L);
+    alloc_site &site = ctx->alloc_sites[site_id];
+    for (size_t i = 0; i < ctx->alloc_pending.size(); i++) {
+        const alloc_pending_block &pending = ctx->alloc_pending[i];
+        site.total_bytes += pending.weight;
+        site.samples++;
+        if (pending.freed) {
+            continue;
+        }
+        site.live_bytes += pending.weight;
+        std::unordered_map<void*, alloc_block>::iterator iter = ctx->alloc_blocks.find(pending.ptr);
+        if (iter != ctx->alloc_blocks.end()) {
+            iter->second.site_id = site_id;
+        }
+    }
+    ctx->alloc_pending.clear();
+}
+
+//在debug_hook_c中确定待定内存块的分配位置后创建，hook中调试器自身(处理消息、记录点、条件表达式等)的分配不采样
+struct alloc_suspend_scope {
+    explicit alloc_suspend_scope(debugger_context *c) : ctx(c) {
+        ctx->alloc_suspend_depth++;
+    }
+    ~alloc_suspend_scope() {
+        ctx->alloc_suspend_depth--;
+    }
+    debugger_context *ctx;
+};
+
+//停止统计并尽量还原分配函数。分配函数又被其他代码替换过时无法还原，保留为直接转发
+void alloc_profiler_shutdown(debugger_context *ctx, lua_State *L) {
+    if (!ctx->alloc_enabled) {
+        return;
+    }
+    ctx->alloc_enabled = false;
+    void *ud = NULL;
+    if (lua_getallocf(L, &ud) == alloc_profiler_alloc) {
+        lua_setallocf(L, ctx->alloc_original_f, ctx->alloc_original_ud);
+    }
+    ctx->alloc_blocks.clear();
+    ctx->alloc_pending.clear();
+    for (size_t i = 0; i < ctx->alloc_sites.size(); i++) {
+        ctx->alloc_sites[i].live_bytes = 0;
+    }
+}
+
+void alloc_push_site(lua_State *L, const alloc_site &site) {
+    lua_createtable(L, 0, 4);
+    set_string_field(L, "site", site.name);
+    lua_pushnumber(L, static_cast<lua_Number>(site.live_bytes));
+    lua_setfield(L, -2, "live");
+    lua_pushnumber(L, static_cast<lua_Number>(site.total_bytes));
+    lua_setfield(L, -2, "total");
+    lua_pushnumber(L, static_cast<lua_Number>(site.samples));
+    lua_setfield(L, -2, "samples");
+}
+
+//按分配位置的存活字节数比较
+struct alloc_live_greater {
+    explicit alloc_live_greater(const std::vector<alloc_site> &s) : sites(s) {}
+    bool operator()(int a, int b) const {
+        return sites[a].live_bytes > sites[b].live_bytes;
+    }
+    const std::vector<alloc_site> &sites;
+};
+
+//lua调用，开始统计内存分配。参数: 每分配多少字节采样一次(<=0表示每次分配都记录)
+//返回: 1成功 / 0当前环境不支持
+extern "C" int alloc_profiler_start(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    long long sample_bytes = static_cast<long long>(luaL_checknumber(L, 1));
+    if (!native_alloc_available()) {
+        lua_pushnumber(L, 0);
+        return 1;
+    }
+    ctx->alloc_sample_bytes = sample_bytes;
+    ctx->alloc_countdown = sample_bytes;
+    if (!ctx->alloc_enabled) {
+        void *ud = NULL;
+        lua_Alloc allocf = lua_getallocf(L, &ud);
+        //停止后无法还原时分配函数仍是alloc_profiler_alloc，此时不再嵌套
+        if (allocf != alloc_profiler_alloc) {
+            ctx->alloc_original_f = allocf;
+            ctx->alloc_original_ud = ud;
+            lua_setallocf(L, alloc_profiler_alloc, ctx);
+        }
+        ctx->alloc_enabled = true;
+        refresh_thread_hooks(ctx, L, ctx->cur_hook_state);
+    }
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+//lua调用，停止统计内存分配，保留累计分配字节数
+extern "C" int alloc_profiler_stop(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    if (ctx->alloc_enabled) {
+        alloc_profiler_shutdown(ctx, L);
+        refresh_thread_hooks(ctx, L, ctx->cur_hook_state);
+    }
+    return 0;
+}
+
+//lua调用，清空统计结果和快照
+extern "C" int alloc_profiler_clear(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    ctx->alloc_blocks.clear();
+    ctx->alloc_pending.clear();
+    ctx->alloc_sites.clear();
+    ctx->alloc_site_ids.clear();
+    ctx->alloc_snapshots.clear();
+    return 0;
+}
+
+//lua调用，获取分配位置的统计。参数: 最多返回的个数(<=0不限制)
+//返回: 按存活字节数排序的数组 {site, live, total, samples}
+extern "C" int get_alloc_stats(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    int limit = static_cast<int>(luaL_checkinteger(L, 1));
+    std::vector<int> ids(ctx->alloc_sites.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+        ids[i] = static_cast<int>(i);
+    }
+    std::sort(ids.begin(), ids.end(), alloc_live_greater(ctx->alloc_sites));
+    if (limit > 0 && ids.size() > static_cast<size_t>(limit)) {
+        ids.resize(limit);
+    }
+    lua_createtable(L, static_cast<int>(ids.size()), 0);
+    for (size_t i = 0; i < ids.size(); i++) {
+        alloc_push_site(L, ctx->alloc_sites[ids[i]]);
+        lua_rawseti(L, -2, static_cast<int>(i) + 1);
+    }
+    return 1;
+}
+
+//lua调用，记录各分配位置当前的存活字节数。返回快照id，最多保留alloc_snapshot_capacity个
+extern "C" int alloc_snapshot(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    std::vector<long long> live(ctx->alloc_sites.size());
+    for (size_t i = 0; i < ctx->alloc_sites.size(); i++) {
+        live[i] = ctx->alloc_sites[i].live_bytes;
+    }
+    if (ctx->alloc_snapshots.size() >= alloc_snapshot_capacity) {
+        ctx->alloc_snapshots.erase(ctx->alloc_snapshots.begin());
+    }
+    ctx->alloc_snapshots[++ctx->alloc_snapshot_seq] = live;
+    lua_pushnumber(L, ctx->alloc_snapshot_seq);
+    return 1;
+}
+
+//lua调用，比较两个快照。参数: 快照id, 快照id(<=0表示和当前比较), 最多返回的个数(<=0不限制)
+//返回: 按增长字节数排序的数组 {site, growth, before, after}，只包含增长的分配位置 / nil 快照不存在
+extern "C" int alloc_snapshot_diff(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    int from_id = static_cast<int>(luaL_checkinteger(L, 1));
+    int to_id = static_cast<int>(luaL_checkinteger(L, 2));
+    int limit = static_cast<int>(luaL_checkinteger(L, 3));
+    std::map<int, std::vector<long long> >::iterator from = ctx->alloc_snapshots.find(from_id);
+    std::map<int, std::vector<long long> >::iterator to = ctx->alloc_snapshots.find(to_id);
+    if (from == ctx->alloc_snapshots.end() || (to_id > 0 && to == ctx->alloc_snapshots.end())) {
+        lua_pushnil(L);
+        return 1;
+    }
+    std::vector<std::pair<long long, int> > growth;
+    for (size_t i = 0; i < ctx->alloc_sites.size(); i++) {
+        long long before = i < from->second.size() ? from->second[i] : 0;
+        long long after = to_id > 0 ? (i < to->second.size() ? to->second[i] : 0) : ctx->alloc_sites[i].live_bytes;
+        if (after > before) {
+            growth.push_back(std::make_pair(after - before, static_cast<int>(i)));
+        }
+    }
+    std::sort(growth.begin(), growth.end(), std::greater<std::pair<long long, int> >());
+    if (limit > 0 && growth.size() > static_cast<size_t>(limit)) {
+        growth.resize(limit);
+    }
+    lua_createtable(L, static_cast<int>(growth.size()), 0);
+    for (size_t i = 0; i < growth.size(); i++) {
+        int site_id = growth[i].second;
+        long long before = static_cast<size_t>(site_id) < from->second.size() ? from->second[site_id] : 0;
+        lua_createtable(L, 0, 4);
+        set_string_field(L, "site", ctx->alloc_sites[site_id].name);
+        lua_pushnumber(L, static_cast<lua_Number>(growth[i].first));
+        lua_setfield(L, -2, "growth");
+        lua_pushnumber(L, static_cast<lua_Number>(before));
+        lua_setfield(L, -2, "before");
+        lua_pushnumber(L, static_cast<lua_Number>(before + growth[i].first));
+        lua_setfield(L, -2, "after");
+        lua_rawseti(L, -2, static_cast<int>(i) + 1);
+    }
+    return 1;
+}
+
+//------------内存快照------------
+//从_G、package.loaded、当前协程的栈和registry出发，遍历所有可达的table、函数、userdata、协程和字符串
+//每个对象记录类型、估算的大小和一条引用路径(父对象和引用名)，边遍历边写入文件。遍历在C中完成，不在lua堆上分配
+//文件每行一个对象: id\ttype\tsize\tparent\tedge，id为对象地址(十六进制)，parent为0表示根
+//大小按64位lua的对象布局估算，不包含table中未使用的槽位和函数原型
+enum heap_object_kind
+{
+    HEAP_TABLE = 0,
+    HEAP_FUNCTION,
+    HEAP_USERDATA,
+    HEAP_THREAD
+};
+struct heap_frame {
+    int kind;
+    int obj_idx;                //对象在lua栈上的位置
+    const void *id;
+    const void *parent;
+    std::string edge;
+    int stage;
+    int index;                  //upvalue/局部变量/栈位置的序号
+    int level;                  //协程的栈层级
+    int pending;                //table: 2表示栈上的key和value待处理，1表示value待处理
+    size_t entries;             //table成员数/upvalue数
+    lua_State *thread;
+};
+const size_t heap_max_depth = 1000;         //最大遍历深度，超过时只记录对象本身
+const size_t heap_edge_max_len = 64;
+
+int native_heap_available() {
+#if !defined(USE_SOURCE_CODE) && defined(_WIN32)
+    return lua_xmove != NULL && lua_tothread != NULL && lua_pushthread != NULL && lua_getmetatable != NULL && lua_checkstack != NULL &&
+#if LUA_VERSION_NUM == 501
+           lua_objlen != NULL && lua_getfenv != NULL;
+#else
+           lua_rawlen != NULL;
+#endif
+#else
+    return 1;
+#endif
+}
+
+unsigned long long heap_id(const void *ptr) {
+    return static_cast<unsigned long long>(reinterpret_cast<size_t>(ptr));
+}
+
+void heap_write(debugger_context *ctx, const void *id, const char *type, size_t size, const void *parent, const std::string &edge) {
+    fprintf(ctx->heap_file, "%llx\t%s\t%llu\t%llx\t%s\n", heap_id(id), type, static_cast<unsigned long long>(size), heap_id(parent), edge.c_str());
+    ctx->heap_object_count++;
+    ctx->heap_total_bytes += size;
+}
+
+//引用名中不能有分隔符
+std::string heap_edge_text(const char *str, size_t len) {
+    std::string text(str, len < heap_edge_max_len ? len : heap_edge_max_len);
+    for (size_t i = 0; i < text.size(); i++) {
+        if (text[i] == '\t' || text[i] == '\n' || text[i] == '\r') {
+            text[i] = ' ';
+        }
+    }
+    return text;
+}
+
+//table中value的引用名。字符串key直接使用，其他key加[]
+std::string heap_key_name(lua_State *L, int key_idx) {
+    char buf[64];
+    switch (lua_type(L, key_idx)) {
+        case LUA_TSTRING: {
+            size_t len = 0;
+            const char *str = lua_tolstring(L, key_idx, &len);
+            return heap_edge_text(str, len);
+        }
+        case LUA_TNUMBER:
+            snprintf(buf, sizeof(buf), "[%.14g]", static_cast<double>(lua_tonumber(L, key_idx)));
+            return buf;
+        case LUA_TBOOLEAN:
+            return lua_toboolean(L, key_idx) ? "[true]" : "[false]";
+        default:
+            return std::string("[") + variable_type_name(lua_type(L, key_idx)) + "]";
+    }
+}
+
+//处理栈顶的值。字符串直接记录；table等对象压入遍历栈，对象留在lua栈上，遍历完成后弹出
+void heap_visit(debugger_context *ctx, lua_State *L, const void *parent, const std::string &edge) {
+    int type = lua_type(L, -1);
+    if (type == LUA_TSTRING) {
+        size_t len = 0;
+        const char *str = lua_tolstring(L, -1, &len);
+        if (ctx->heap_visited.insert(str).second) {
+            heap_write(ctx, str, "string", 25 + len, parent, edge);
+        }
+        lua_pop(L, 1);
+        return;
+    }
+    int kind;
+    switch (type) {
+        case LUA_TTABLE: kind = HEAP_TABLE; break;
+        case LUA_TFUNCTION: kind = HEAP_FUNCTION; break;
+        case LUA_TUSERDATA: kind = HEAP_USERDATA; break;
+        case LUA_TTHREAD: kind = HEAP_THREAD; break;
+        default:
+            lua_pop(L, 1);
+            return;
+    }
+    const void *id = lua_topointer(L, -1);
+    if (!ctx->heap_visited.insert(id).second) {
+        lua_pop(L, 1);
+        return;
+    }
+    if (ctx->heap_frames.size() >= heap_max_depth || !lua_checkstack(L, 8)) {
+        ctx->heap_truncated_count++;
+        heap_write(ctx, id, variable_type_name(type), 56, parent, edge);
+        lua_pop(L, 1);
+        return;
+    }
+    heap_frame frame;
+    frame.kind = kind;
+    frame.obj_idx = lua_gettop(L);
+    frame.id = id;
+    frame.parent = parent;
+    frame.edge = edge;
+    frame.stage = 0;
+    frame.index = 0;
+    frame.level = 0;
+    frame.pending = 0;
+    frame.entries = 0;
+    frame.thread = kind == HEAP_THREAD ? lua_tothread(L, -1) : NULL;
+    ctx->heap_frames.push_back(frame);
+}
+
+//对象遍历完成，写入文件并弹出
+void heap_finish(debugger_context *ctx, lua_State *L, const char *type, size_t size) {
+    const heap_frame &frame = ctx->heap_frames.back();
+    heap_write(ctx, frame.id, type, size, frame.parent, frame.edge);
+    lua_pop(L, 1);
+    ctx->heap_frames.pop_back();
+}
+
+//table: 元表，然后逐个处理key和value
+void heap_step_table(debugger_context *ctx, lua_State *L, heap_frame &frame) {
+    int idx = frame.obj_idx;
+    const void *id = frame.id;
+    if (frame.stage == 0) {
+        frame.stage = 1;
+        if (lua_getmetatable(L, idx)) {
+            heap_visit(ctx, L, id, "(metatable)");
+        }
+        return;
+    }
+    if (frame.stage == 1) {
+        frame.stage = 2;
+        lua_pushnil(L);
+        return;
+    }
+    if (frame.pending == 2) {
+        frame.pending = 1;
+        int key_type = lua_type(L, -2);
+        if (key_type == LUA_TSTRING || key_type == LUA_TTABLE || key_type == LUA_TFUNCTION || key_type == LUA_TUSERDATA || key_type == LUA_TTHREAD) {
+            lua_pushvalue(L, -2);
+            heap_visit(ctx, L, id, "(key)");
+        }
+        return;
+    }
+    if (frame.pending == 1) {
+        frame.pending = 0;
+        heap_visit(ctx, L, id, heap_key_name(L, -2));
+        return;
+    }
+    if (lua_next(L, idx)) {
+        frame.entries++;
+        frame.pending = 2;
+        return;
+    }
+    heap_finish(ctx, L, "table", 56 + frame.entries * 32);
+}
+
+//函数: upvalue，5.1中还有环境表
+void heap_step_function(debugger_context *ctx, lua_State *L, heap_frame &frame) {
+    int idx = frame.obj_idx;
+    const void *id = frame.id;
+    if (frame.stage == 0) {
+        const char *name = lua_getupvalue(L, idx, ++frame.index);
+        if (name != NULL) {
+            frame.entries++;
+            heap_visit(ctx, L, id, std::string("(upvalue ") + name + ")");
+            return;
+        }
+        frame.stage = 1;
+#if LUA_VERSION_NUM == 501
+        lua_getfenv(L, idx);
+        heap_visit(ctx, L, id, "(env)");
+        return;
+#endif
+    }
+    heap_finish(ctx, L, "function", 40 + frame.entries * 8);
+}
+
+//userdata: 元表，5.1中还有环境表
+void heap_step_userdata(debugger_context *ctx, lua_State *L, heap_frame &frame) {
+    int idx = frame.obj_idx;
+    const void *id = frame.id;
+    if (frame.stage == 0) {
+        frame.stage = 1;
+        if (lua_getmetatable(L, idx)) {
+            heap_visit(ctx, L, id, "(metatable)");
+        }
+        return;
+    }
+#if LUA_VERSION_NUM == 501
+    if (frame.stage == 1) {
+        frame.stage = 2;
+        lua_getfenv(L, idx);
+        heap_visit(ctx, L, id, "(env)");
+        return;
+    }
+    size_t len = lua_objlen(L, idx);
+#else
+    size_t len = lua_rawlen(L, idx);
+#endif
+    heap_finish(ctx, L, "userdata", 40 + len);
+}
+
+//协程: 每层栈帧的函数和局部变量。未启动的协程没有栈帧，遍历栈上的值
+//当前协程跳过第0层(本函数)
+void heap_step_thread(debugger_context *ctx, lua_State *L, heap_frame &frame) {
+    lua_State *co = frame.thread;
+    const void *id = frame.id;
+    char buf[64];
+    if (co == NULL || !lua_checkstack(co, 2)) {
+        heap_finish(ctx, L, "thread", 200);
+        return;
+    }
+    if (co == L && frame.level == 0) {
+        frame.level = 1;
+    }
+    if (frame.stage == 1) {
+        if (co != L && frame.index < lua_gettop(co)) {
+            frame.index++;
+            lua_pushvalue(co, frame.index);
+            lua_xmove(co, L, 1);
+            snprintf(buf, sizeof(buf), "(stack %d)", frame.index);
+            heap_visit(ctx, L, id, buf);
+            return;
+        }
+        heap_finish(ctx, L, "thread", 200);
+        return;
+    }
+    lua_Debug ar;
+    if (!lua_getstack(co, frame.level, &ar)) {
+        if (frame.level == 0) {
+            frame.stage = 1;
+            return;
+        }
+        heap_finish(ctx, L, "thread", 200);
+        return;
+    }
+    if (frame.index == 0) {
+        frame.index = 1;
+        if (lua_getinfo(co, "f", &ar) != 0) {
+            if (co != L) {
+                lua_xmove(co, L, 1);
+            }
+            snprintf(buf, sizeof(buf), "(function level %d)", frame.level);
+            heap_visit(ctx, L, id, buf);
+        }
+        return;
+    }
+    const char *name = lua_getlocal(co, &ar, frame.index);
+    if (name != NULL) {
+        frame.index++;
+        if (co != L) {
+            lua_xmove(co, L, 1);
+        }
+        heap_visit(ctx, L, id, "(local " + heap_edge_text(name, strlen(name)) + ")");
+        return;
+    }
+    frame.level++;
+    frame.index = 0;
+}
+
+//从栈顶的根对象开始深度优先遍历，遍历栈保存在heap_frames中
+void heap_walk(debugger_context *ctx, lua_State *L, const std::string &root_name) {
+    heap_visit(ctx, L, NULL, root_name);
+    while (!ctx->heap_frames.empty()) {
+        heap_frame &frame = ctx->heap_frames.back();
+        switch (frame.kind) {
+            case HEAP_TABLE: heap_step_table(ctx, L, frame); break;
+            case HEAP_FUNCTION: heap_step_function(ctx, L, frame); break;
+            case HEAP_USERDATA: heap_step_userdata(ctx, L, frame); break;
+            default: heap_step_thread(ctx, L, frame); break;
+        }
+    }
+}
+
+//lua调用，生成内存快照并写入临时文件目录。参数: 快照名(文件名为luapanda_heap_<名字>.txt)
+//返回: 文件路径, 对象数, 估算的总字节数 / nil, 错误信息
+extern "C" int heap_snapshot(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    std::string path = tempfile_path(ctx, std::string("luapanda_heap_") + luaL_checkstring(L, 1) + ".txt");
+    if (!native_heap_available()) {
+        lua_pushnil(L);
+        lua_pushstring(L, "heap snapshot not supported");
+        return 2;
+    }
+    ctx->heap_file = fopen(path.c_str(), "wb");
+    if (ctx->heap_file == NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L, ("open file failed: " + path).c_str());
+        return 2;
+    }
+    fprintf(ctx->heap_file, "# luapanda heap snapshot 1\n# id\ttype\tsize\tparent\tedge\n");
+    ctx->heap_visited.clear();
+    ctx->heap_frames.clear();
+    ctx->heap_object_count = 0;
+    ctx->heap_total_bytes = 0;
+    ctx->heap_truncated_count = 0;
+    int top = lua_gettop(L);
+#if LUA_VERSION_NUM == 501
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+#else
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+#endif
+    heap_walk(ctx, L, "_G");
+    lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+    heap_walk(ctx, L, "_LOADED");
+    lua_pushthread(L);
+    heap_walk(ctx, L, "(current thread)");
+    lua_pushvalue(L, LUA_REGISTRYINDEX);
+    heap_walk(ctx, L, "registry");
+    lua_settop(L, top);
+    if (ctx->heap_truncated_count > 0) {
+        fprintf(ctx->heap_file, "# truncated %llu\n", static_cast<unsigned long long>(ctx->heap_truncated_count));
+    }
+    bool failed = ferror(ctx->heap_file) != 0;
+    fclose(ctx->heap_file);
+    ctx->heap_file = NULL;
+    //快照之间不保留访问记录
+    std::unordered_set<const void*>().swap(ctx->heap_visited);
+    if (failed) {
+        lua_pushnil(L);
+        lua_pushstring(L, ("write file failed: " + path).c_str());
+        return 2;
+    }
+    lua_pushstring(L, path.c_str());
+    lua_pushnumber(L, static_cast<lua_Number>(ctx->heap_object_count));
+    lua_pushnumber(L, static_cast<lua_Number>(ctx->heap_total_bytes));
+    return 3;
+}
+
+struct heap_record {
+    std::string type;
+    unsigned long long size;
+    unsigned long long parent;
+    std::string edge;
+};
+
+bool heap_read_snapshot(const char *path, std::unordered_map<unsigned long long, heap_record> &records) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    char line[512];
+    char type[16];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (line[0] == '#') {
+            continue;
+        }
+        unsigned long long id = 0;
+        heap_record record;
+        int edge_start = 0;
+        if (sscanf(line, "%llx\t%15[^\t]\t%llu\t%llx\t%n", &id, type, &record.size, &record.parent, &edge_start) < 4 || edge_start == 0) {
+            continue;
+        }
+        record.type = type;
+        record.edge = line + edge_start;
+        while (!record.edge.empty() && (record.edge[record.edge.size() - 1] == '\n' || record.edge[record.edge.size() - 1] == '\r')) {
+            record.edge.erase(record.edge.size() - 1);
+        }
+        records[id] = record;
+    }
+    fclose(file);
+    return true;
+}
+
+//沿parent拼出引用路径，如 _G.mymod.cache
+std::string heap_record_path(const std::unordered_map<unsigned long long, heap_record> &records, unsigned long long id) {
+    std::vector<const std::string*> edges;
+    for (int hop = 0; hop < 32 && id != 0; hop++) {
+        std::unordered_map<unsigned long long, heap_record>::const_iterator iter = records.find(id);
+        if (iter == records.end()) {
+            break;
+        }
+        edges.push_back(&iter->second.edge);
+        id = iter->second.parent;
+    }
+    std::string path;
+    for (size_t i = edges.size(); i > 0; i--) {
+        if (!path.empty()) {
+            path += '.';
+        }
+        path += *edges[i - 1];
+    }
+    if (id != 0) {
+        path = "..." + path;
+    }
+    return path;
+}
+
+struct heap_growth {
+    unsigned long long id;
+    long long growth;
+    unsigned long long before;
+    unsigned long long after;
+    unsigned long long new_children;
+    unsigned long long new_child_bytes;
+};
+
+bool heap_growth_greater(const heap_growth &a, const heap_growth &b) {
+    return a.growth > b.growth;
+}
+
+//lua调用，比较两个快照文件。参数: 旧快照路径, 新快照路径, 最多返回的个数(<=0不限制)
+//两个快照中都存在的对象，增长 = 自身大小的增长 + 新增的直接子对象的大小
+//返回: {grown = 按增长排序的数组 {path, type, before, after, newChildren, newChildBytes, growth},
+//       newObjects, newBytes, freedObjects, freedBytes} / nil, 错误信息
+extern "C" int heap_snapshot_diff(lua_State *L) {
+    const char *old_path = luaL_checkstring(L, 1);
+    const char *new_path = luaL_checkstring(L, 2);
+    int limit = static_cast<int>(luaL_checkinteger(L, 3));
+    std::unordered_map<unsigned long long, heap_record> old_records;
+    std::unordered_map<unsigned long long, heap_record> new_records;
+    if (!heap_read_snapshot(old_path, old_records) || !heap_read_snapshot(new_path, new_records)) {
+        lua_pushnil(L);
+        lua_pushstring(L, "open snapshot failed");
+        return 2;
+    }
+    //地址相同但类型不同的视为旧对象被回收后地址被复用
+    std::unordered_map<unsigned long long, heap_growth> growth;
+    unsigned long long new_objects = 0, new_bytes = 0, freed_objects = 0, freed_bytes = 0;
+    for (std::unordered_map<unsigned long long, heap_record>::iterator iter = new_records.begin(); iter != new_records.end(); ++iter) {
+        std::unordered_map<unsigned long long, heap_record>::iterator old_iter = old_records.find(iter->first);
+        if (old_iter != old_records.end() && old_iter->second.type == iter->second.type) {
+            if (iter->second.size > old_iter->second.size) {
+                heap_growth &item = growth[iter->first];
+                item.before = old_iter->second.size;
+                item.after = iter->second.size;
+            }
+            continue;
+        }
+        new_objects++;
+        new_bytes += iter->second.size;
+        unsigned long long parent = iter->second.parent;
+        std::unordered_map<unsigned long long, heap_record>::iterator parent_old = old_records.find(parent);
+        std::unordered_map<unsigned long long, heap_record>::iterator parent_new = new_records.find(parent);
+        if (parent_old != old_records.end() && parent_new != new_records.end() && parent_old->second.type == parent_new->second.type) {
+            heap_growth &item = growth[parent];
+            item.before = parent_old->second.size;
+            item.after = parent_new->second.size;
+            item.new_children++;
+            item.new_child_bytes += iter->second.size;
+        }
+    }
+    for (std::unordered_map<unsigned long long, heap_record>::iterator iter = old_records.begin(); iter != old_records.end(); ++iter) {
+        std::unordered_map<unsigned long long, heap_record>::iterator new_iter = new_records.find(iter->first);
+        if (new_iter == new_records.end() || new_iter->second.type != iter->second.type) {
+            freed_objects++;
+            freed_bytes += iter->second.size;
+        }
+    }
+    std::vector<heap_growth> items;
+    items.reserve(growth.size());
+    for (std::unordered_map<unsigned long long, heap_growth>::iterator iter = growth.begin(); iter != growth.end(); ++iter) {
+        iter->second.id = iter->first;
+        iter->second.growth = static_cast<long long>(iter->second.after) - static_cast<long long>(iter->second.before) + static_cast<long long>(iter->second.new_child_bytes);
+        if (iter->second.growth > 0) {
+            items.push_back(iter->second);
+        }
+    }
+    std::sort(items.begin(), items.end(), heap_growth_greater);
+    if (limit > 0 && items.size() > static_cast<size_t>(limit)) {
+        items.resize(limit);
+    }
+    lua_createtable(L, 0, 5);
+    lua_createtable(L, static_cast<int>(items.size()), 0);
+    for (size_t i = 0; i < items.size(); i++) {
+        const heap_growth &item = items[i];
+        lua_createtable(L, 0, 7);
+        set_string_field(L, "path", heap_record_path(new_records, item.id));
+        set_string_field(L, "type", new_records[item.id].type);
+        lua_pushnumber(L, static_cast<lua_Number>(item.before));
+        lua_setfield(L, -2, "before");
+        lua_pushnumber(L, static_cast<lua_Number>(item.after));
+        lua_setfield(L, -2, "after");
+        lua_pushnumber(L, static_cast<lua_Number>(item.new_children));
+        lua_setfield(L, -2, "newChildren");
+        lua_pushnumber(L, static_cast<lua_Number>(item.new_child_bytes));
+        lua_setfield(L, -2, "newChildBytes");
+        lua_pushnumber(L, static_cast<lua_Number>(item.growth));
+        lua_setfield(L, -2, "growth");
+        lua_rawseti(L, -2, static_cast<int>(i) + 1);
+    }
+    lua_setfield(L, -2, "grown");
+    lua_pushnumber(L, static_cast<lua_Number>(new_objects));
+    lua_setfield(L, -2, "newObjects");
+    lua_pushnumber(L, static_cast<lua_Number>(new_bytes));
+    lua_setfield(L, -2, "newBytes");
+    lua_pushnumber(L, static_cast<lua_Number>(freed_objects));
+    lua_setfield(L, -2, "freedObjects");
+    lua_pushnumber(L, static_cast<lua_Number>(freed_bytes));
+    lua_setfield(L, -2, "freedBytes");
+    return 1;
+}
+
+//------------hook开销统计------------
+//开启后记录每类hook事件的次数和在debug_hook_c中花费的时间，用来比较不同hook状态、断点数量下hook的开销
+//时间包括lua回调的耗时(如停在断点处等待)，测量时应保持未连接或运行状态
+//每个事件额外读取两次时钟，比较整体耗时时应在关闭统计的情况下单独计时(见LuaPanda.benchmarkHook)
+const char *hook_stats_event_names[hook_stats_event_types] = { "call", "return", "line", "count", "tail" };
+
+//在debug_hook_c开始时创建，离开hook时记录本次事件的耗时
+struct hook_stats_scope {
+    hook_stats_scope(debugger_context *c, int e) : ctx(c), event(e), active(c->hook_stats_enabled && e >= 0 && e < hook_stats_event_types) {
+        if (active) {
+            start = std::chrono::steady_clock::now();
+        }
     }
-    lua_pop(L, 1);//外部每次循环
+    ~hook_stats_scope() {
+        if (active) {
+            ctx->hook_stats[event].count++;
+            ctx->hook_stats[event].time_ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        }
+    }
+    debugger_context *ctx;
+    int event;
+    bool active;
+    std::chrono::steady_clock::time_point start;
+};
 
-    print_all_breakpoint_map(L);
-    check_hook_state(L, last_source, ar_current_line ,ar_def_line, ar_lastdef_line);
+//lua调用，清空并开始统计hook开销
+extern "C" int hook_stats_start(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    memset(ctx->hook_stats, 0, sizeof(ctx->hook_stats));
+    ctx->hook_stats_enabled = true;
     return 0;
 }
 
-//断点命中判断
-int debug_ishit_bk(lua_State *L, const char * curPath, int current_line) {
-    debug_auto_stack _tt(L);
-    // 获取标准路径[文件名.后缀]
-    const char *standardPath = getPath(L, curPath);
-    // 判断是否存在同名文件
-    std::map<std::string, std::map<int, struct breakpoint> >::const_iterator const_iter1 = all_breakpoint_map.find(std::string(standardPath));
-    if (const_iter1 == all_breakpoint_map.end()) {
-        return 0;
+//lua调用，停止统计hook开销，保留结果
+extern "C" int hook_stats_stop(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    ctx->hook_stats_enabled = false;
+    return 0;
+}
+
+//lua调用，获取hook开销统计
+//返回: { call = { count, time }, return, line, count, tail, events = 总事件数, time = 总耗时(ms), nsPerEvent = 每个事件的平均耗时(ns) }
+extern "C" int get_hook_stats(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    double events = 0;
+    double time_ns = 0;
+    lua_createtable(L, 0, hook_stats_event_types + 3);
+    for (int i = 0; i < hook_stats_event_types; i++) {
+        lua_createtable(L, 0, 2);
+        lua_pushnumber(L, ctx->hook_stats[i].count);
+        lua_setfield(L, -2, "count");
+        lua_pushnumber(L, ctx->hook_stats[i].time_ns / 1000000.0);
+        lua_setfield(L, -2, "time");
+        lua_setfield(L, -2, hook_stats_event_names[i]);
+        events += ctx->hook_stats[i].count;
+        time_ns += ctx->hook_stats[i].time_ns;
     }
+    lua_pushnumber(L, events);
+    lua_setfield(L, -2, "events");
+    lua_pushnumber(L, time_ns / 1000000.0);
+    lua_setfield(L, -2, "time");
+    lua_pushnumber(L, events > 0 ? time_ns / events : 0);
+    lua_setfield(L, -2, "nsPerEvent");
+    return 1;
+}
 
-    // c++ all_breakpoint_map 的数据结构保持不变，和lua不一样
-    // 根据是否存在相同行号
-    std::map<int, struct breakpoint>::const_iterator const_iter2 = const_iter1->second.find(current_line);
-    if (const_iter2 == const_iter1->second.end()) {
-        return 0;
+//------------原生消息通道------------
+//后台线程从luasocket连接的fd上接收消息，按行切分后放入单生产者单消费者队列。hook中只检查队列是否为空
+//发送仍在虚拟机线程中通过luasocket完成
+#ifdef _WIN32
+typedef SOCKET transport_socket_t;
+#define TRANSPORT_WOULD_BLOCK()     (WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAEINTR)
+#else
+typedef int transport_socket_t;
+#define TRANSPORT_WOULD_BLOCK()     (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+#endif
+
+//无锁环形队列，只允许一个生产者(接收线程)和一个消费者(虚拟机线程)
+struct transport_frame_queue {
+    static const size_t capacity = 1024;
+    std::string* slots[capacity];
+    std::atomic<size_t> head;   //消费者位置
+    std::atomic<size_t> tail;   //生产者位置
+
+    transport_frame_queue() : head(0), tail(0) {}
+
+    bool push(std::string* frame) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t next = (t + 1) % capacity;
+        if (next == head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        slots[t] = frame;
+        tail.store(next, std::memory_order_release);
+        return true;
     }
 
-    if(lua_debugger_ver >= 30160){
-        // luapanda.lua >= 3.1.6 才会调用
-        // 初步命中，到lua层中检测是否真正命中，以及断点类型
-        int lua_ret = call_lua_function(L, "isHitBreakpoint", 1, standardPath, curPath, current_line);
-        if (lua_ret != 0) {
-            // 调用出错时，按命中处理
-            return 1;
+    std::string* pop() {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return nullptr;
         }
-        
-        int realHit = lua_toboolean(L, -1);
-        return realHit;
-    }else{
-        // 兼容旧版本
-        // 条件断点
-        if (const_iter2->second.type == CONDITION_BREAKPOINT) {
-            std::string condition = const_iter2->second.info;
-            int lua_ret = call_lua_function(L, "IsMeetCondition", 1, condition.c_str());
-            if (lua_ret != 0) {
-                return 0;
-            }
-            // if (!lua_isboolean(L, -1)) {
-            //     print_to_vscode(L, "[Debug Lib Error] debug_ishit_bk process condition expression result error!", 2);
-            //     return 0;
-            // }
-            int is_meet_condition = lua_toboolean(L, -1);
-            lua_pop(L, 1);
-            return is_meet_condition;
+        std::string* frame = slots[h];
+        head.store((h + 1) % capacity, std::memory_order_release);
+        return frame;
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+};
+
+//一个虚拟机的接收通道，保存在上下文中。接收线程只访问自己的通道，不同虚拟机的消息互不影响
+struct transport_channel {
+    transport_frame_queue queue;
+    std::thread thread;
+    std::atomic<bool> stop;             //通知接收线程退出
+    std::atomic<bool> closed;           //连接已断开(接收线程已退出)
+    std::mutex wait_mutex;              //只用于消费者阻塞等待，不保护队列
+    std::condition_variable wait_cv;
+
+    transport_channel() : stop(false), closed(false) {}
+
+    //唤醒阻塞在transport_receive中的消费者
+    void notify() {
+        std::lock_guard<std::mutex> lock(wait_mutex);
+        wait_cv.notify_one();
+    }
+
+    bool ready() const {
+        return !queue.empty() || closed.load();
+    }
+
+    //停止接收线程并丢弃未处理的消息。不关闭fd，fd由luasocket关闭
+    ~transport_channel() {
+        stop.store(true);
+        if (thread.joinable()) {
+            thread.join();
         }
-        
-        // 记录点
-        if (const_iter2->second.type == LOG_POINT) {
-            std::string log_message = "[log point output]: ";
-            log_message.append(const_iter2->second.info);
-            print_to_vscode(L, log_message.c_str() , 1);
-            return 0;
+        std::string* frame;
+        while ((frame = queue.pop()) != nullptr) {
+            delete frame;
         }
-        return 1;
     }
-}
+};
 
-//判断字符串是否匹配[string "
-int isCodeSection(char *str) {
-    if (strlen(str) > 9) {
-        if (str[0] == '[' && str[7] == ' ' && str[8] == '"') {
-            return 1;
+//接收线程。按\n切分(去掉\r)，和luasocket的receive("*l")一致
+void transport_thread_main(transport_channel *channel, transport_socket_t fd) {
+    std::string partial;
+    char buf[8192];
+    while (!channel->stop.load()) {
+        fd_set read_set;
+        FD_ZERO(&read_set);
+        FD_SET(fd, &read_set);
+        struct timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = 50000;
+        int ret = select(static_cast<int>(fd + 1), &read_set, NULL, NULL, &tv);
+        if (ret == 0) {
+            continue;
+        }
+        if (ret < 0) {
+            if (TRANSPORT_WOULD_BLOCK()) {
+                continue;
+            }
+            break;
         }
-    }
-    return 0;
-}
 
-//断点命中判断 retuen : is_hit
-int breakpoint_process(lua_State *L, lua_Debug *ar){
-    int is_hit = 0;
-    if (ar->event == LINE) {
-        is_hit = debug_ishit_bk(L, ar->source, ar->currentline);
-        // 同名文件可能会命中假断点 folder1/a.lua 和 folder2/a.lua 截取文件名都是 a.lua, 可能导致命中混淆
-        if(is_hit && lua_debugger_ver >= 30160){
-            // luapanda.lua >= 3.1.6 版本才会调用
-            is_hit = checkRealHitBreakpoint(L, ar->source, ar->currentline);
+        int len = static_cast<int>(recv(fd, buf, sizeof(buf), 0));
+        if (len < 0 && TRANSPORT_WOULD_BLOCK()) {
+            continue;
+        }
+        if (len <= 0) {
+            break;
         }
 
-        if (is_hit == 1 || BPhit) {
-            print_to_vscode(L, "[C Module] Breakpoint hit!");
-            int record_stackdeep_counter = stackdeep_counter;
-            int record_cur_run_state = cur_run_state;
-            stackdeep_counter = 0;
-            sync_runstate_toLua(L, HIT_BREAKPOINT);
-            bp_twice_check_res = 1;
-            //c层掌握 STEPOVER 计数器，状态机放在lua层，c主要去读（毕竟C作为lua的扩展）
-            //通知lua层,lua层阻塞，发消息
-            if(BPhit){
-                BPhit = 0;
-                call_lua_function(L, "SendMsgWithStack", 0, "stopOnCodeBreakpoint");
-            }else{
-                call_lua_function(L, "SendMsgWithStack", 0, "stopOnBreakpoint");
-                if( bp_twice_check_res == 0 ){
-                    is_hit = 0;
-                    stackdeep_counter = record_stackdeep_counter;
-                    sync_runstate_toLua(L, record_cur_run_state);
+        partial.append(buf, len);
+        size_t start = 0;
+        size_t pos;
+        while ((pos = partial.find('\n', start)) != std::string::npos) {
+            size_t end = (pos > start && partial[pos - 1] == '\r') ? pos - 1 : pos;
+            std::string* frame = new std::string(partial, start, end - start);
+            //队列满时等待消费者
+            while (!channel->queue.push(frame)) {
+                if (channel->stop.load()) {
+                    delete frame;
+                    return;
                 }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
             }
+            channel->notify();
+            start = pos + 1;
         }
+        partial.erase(0, start);
     }
-    return is_hit;
+    channel->closed.store(true);
+    channel->notify();
 }
 
-//单步处理
-void step_process(lua_State *L, lua_Debug *ar){
-    //目前没有判断jump flag
-    if (cur_run_state == STEPOVER) {
-        if (ar->event == LINE && stackdeep_counter <= 0) {
-            sync_runstate_toLua(L, STEPOVER_STOP);
-            call_lua_function(L, "SendMsgWithStack", 0,"stopOnStep");
-        }
-        else if (ar->event == CALL) {
-            stackdeep_counter++;
-        }
-        //5.3 的tailcall暂时不需要处理。
-        else if (ar->event == RETURN) {
-            if (stackdeep_counter != 0) {
-                stackdeep_counter--;
-            }
-        }
+//是否有待处理的消息(包括连接断开)
+inline bool transport_pending(debugger_context *ctx) {
+    transport_channel *channel = ctx->transport.get();
+    return channel != nullptr && (!channel->queue.empty() || channel->closed.load(std::memory_order_relaxed));
+}
+
+//停止接收线程并丢弃未处理的消息
+void transport_shutdown(debugger_context *ctx) {
+    ctx->transport.reset();
+}
+
+//lua调用，把luasocket连接的fd(sock:getfd())交给接收线程。返回1表示成功
+extern "C" int transport_attach(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    transport_socket_t fd = static_cast<transport_socket_t>(luaL_checknumber(L, 1));
+    transport_shutdown(ctx);
+    ctx->transport.reset(new transport_channel());
+    ctx->transport->thread = std::thread(transport_thread_main, ctx->transport.get(), fd);
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+//lua调用，停止接收线程
+extern "C" int transport_detach(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    transport_shutdown(ctx);
+    return 0;
+}
+
+//lua调用，取一条消息，最多等待timeout秒。返回: 消息 / nil, "timeout" / nil, "closed"
+extern "C" int transport_receive(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    double timeout_sec = luaL_checknumber(L, 1);
+    transport_channel *channel = ctx->transport.get();
+    std::string* frame = channel != nullptr ? channel->queue.pop() : nullptr;
+    if (frame == nullptr && timeout_sec > 0 && channel != nullptr && !channel->closed.load()) {
+        std::unique_lock<std::mutex> lock(channel->wait_mutex);
+        channel->wait_cv.wait_for(lock, std::chrono::duration<double>(timeout_sec), [channel] {
+            return channel->ready();
+        });
+        lock.unlock();
+        frame = channel->queue.pop();
     }
-    else if (cur_run_state == STEPIN) {
-        if (ar->event == LINE) {
-            sync_runstate_toLua(L, STEPIN_STOP);
-            call_lua_function(L, "SendMsgWithStack", 0,"stopOnStepIn");
-        }
+    if (frame != nullptr) {
+        lua_pushlstring(L, frame->data(), frame->size());
+        delete frame;
+        return 1;
+    }
+    lua_pushnil(L);
+    lua_pushstring(L, (channel == nullptr || channel->closed.load()) ? "closed" : "timeout");
+    return 2;
+}
 
+//是否到了下一次轮询的时间。非count事件每poll_check_events次才读一次时钟
+int poll_due(debugger_context *ctx, double &next_time, double interval, int is_count_event) {
+    if (!is_count_event && ++ctx->poll_event_counter < poll_check_events) {
+        return 0;
     }
-    else if (cur_run_state == STEPOUT) {
-        if (ar->event == LINE) {
-            if (stackdeep_counter <= -1) {
-                stackdeep_counter = 0;
-                sync_runstate_toLua(L, STEPOUT_STOP);
-                call_lua_function(L, "SendMsgWithStack", 0,"stopOnStepOut");
-            }
-        }
-        else if (ar->event == CALL) {
-            stackdeep_counter++;
-        }
-        //5.3 的tailcall暂时不需要处理。
-        else if (ar->event == RETURN) {
-            stackdeep_counter--;
-        }
+    ctx->poll_event_counter = 0;
+    double now = coarse_monotonic_ms();
+    if (now < next_time) {
+        return 0;
     }
+    next_time = now + interval;
+    return 1;
 }
 
 // 无需reconnect返回1 ，需要重连时返回0
-int hook_process_reconnect(lua_State *L){
-    time_t currentSecs = time(static_cast<time_t*>(NULL));
-    if(cur_hook_state == DISCONNECT_HOOK){
-        if (currentSecs - recvMsgSeconds > 1) {
-            call_lua_function(L, "reConnect", 0);
-            recvMsgSeconds = currentSecs;
+int hook_process_reconnect(debugger_context *ctx, lua_State *L, int is_count_event){
+    if(ctx->cur_hook_state == DISCONNECT_HOOK){
+        if (poll_due(ctx, ctx->next_reconnect_time, ctx->reconnect_interval_ms, is_count_event)) {
+            call_lua_function(ctx, L, "reConnect", 0);
         }
         return 0;
     }
     return 1;
 }
 
-void litehook_recv_message(lua_State *L){
-    time_t currentSecs = time(static_cast<time_t*>(NULL));
+//使用原生消息通道时，一次处理完队列中的所有消息
+void drain_transport_messages(debugger_context *ctx, lua_State *L) {
+    size_t limit = transport_frame_queue::capacity;
+    while (limit-- > 0 && transport_pending(ctx) && (ctx->cur_run_state == RUN ||
+                                   ctx->cur_run_state == STEPOVER ||
+                                   ctx->cur_run_state == STEPIN ||
+                                   ctx->cur_run_state == STEPOUT)) {
+        call_lua_function(ctx, L, "debugger_wait_msg", 0);
+    }
+}
+
+void litehook_recv_message(debugger_context *ctx, lua_State *L, int is_count_event){
     //2.定时接收消息 -- 这里的状态不只是run
-    if (cur_hook_state == LITE_HOOK && currentSecs - recvMsgSeconds > 1) {
-        call_lua_function(L, "debugger_wait_msg", 0);
-        recvMsgSeconds = currentSecs;
+    if (ctx->cur_hook_state == LITE_HOOK && (transport_pending(ctx) || poll_due(ctx, ctx->next_poll_time, ctx->poll_interval_ms, is_count_event))) {
+        flush_logpoint_buffer(ctx, L);
+        call_lua_function(ctx, L, "debugger_wait_msg", 0);
+        drain_transport_messages(ctx, L);
     }
 }
 
-void hook_process_recv_message(lua_State *L){
-    time_t currentSecs = time(static_cast<time_t*>(NULL));
-    if ((cur_run_state == RUN ||
-         cur_run_state == STEPOVER ||
-         cur_run_state == STEPIN ||
-         cur_run_state == STEPOUT)
-        && currentSecs - recvMsgSeconds > 1) {
-        call_lua_function(L, "debugger_wait_msg", 0);
-        recvMsgSeconds = currentSecs;
+void hook_process_recv_message(debugger_context *ctx, lua_State *L, int is_count_event){
+    if ((ctx->cur_run_state == RUN ||
+         ctx->cur_run_state == STEPOVER ||
+         ctx->cur_run_state == STEPIN ||
+         ctx->cur_run_state == STEPOUT)
+        && (transport_pending(ctx) || poll_due(ctx, ctx->next_poll_time, ctx->poll_interval_ms, is_count_event))) {
+        flush_logpoint_buffer(ctx, L);
+        call_lua_function(ctx, L, "debugger_wait_msg", 0);
+        drain_transport_messages(ctx, L);
     }
 }
 
-int hook_process_cfunction(lua_State *L, lua_Debug *ar){
+int hook_process_cfunction(debugger_context *ctx, lua_State *L, lua_Debug *ar){
     if (!(strcmp(ar->what, "C")) || ar->currentline < 0) {
         //Lua5.1 tail return会走到这里
-        if(!(strcmp(ar->source, "=(tail call)")) && ar -> event == TAILRET && (cur_run_state == STEPOVER || cur_run_state == STEPOUT )){
-            stackdeep_counter --;
+        if(!(strcmp(ar->source, "=(tail call)")) && ar -> event == TAILRET && (ctx->cur_run_state == STEPOVER || ctx->cur_run_state == STEPOUT ) && L == ctx->step_thread){
+            ctx->cur_thread_state->stackdeep_counter --;
         }
         //5.1
         return 0;
@@ -743,87 +5599,119 @@ int hook_process_cfunction(lua_State *L, lua_Debug *ar){
     return 1;
 }
 
-int hook_process_code_section(lua_State *L, lua_Debug *ar){
+int hook_process_code_section(debugger_context *ctx, lua_State *L, lua_Debug *ar){
     //测试[string ...]形式的路径
     int isCodeSec = isCodeSection(ar->short_src);
     if (isCodeSec == 1) {
         //short_src是[string ]开头
         if(strchr(ar->source, '\n') || strchr(ar->source, ';') || strchr(ar->source, '=')){
-            print_to_vscode(L, "hook jump Code String");
+            print_to_vscode(ctx, L, "hook jump Code String");
             return 0;
         }
     }
     return 1;
 }
 
-//检查函数中是否有断点。int check_has_breakpoint  0:全局无断点  , 1:全局有断点但本文件中无断点 , 2:本文件中有断点 , 3:函数中有断点
-int checkHasBreakpoint(lua_State *L, const char * src1, int current_line, int sline , int eline){
+//检查函数中是否有断点。返回 LITE_HOOK:全局无断点 , MID_HOOK:全局有断点但本函数[sline, eline]中无断点 , ALL_HOOK:本函数中有断点
+int checkHasBreakpoint(debugger_context *ctx, lua_State *L, const char * src1, int current_line, int sline , int eline){
     debug_auto_stack tt(L);
 
-	const char *src = getPath(L, src1);
-    if(!strcmp(src,"")){
+    path_transfer_node *path_node = getPathNode(ctx, L, src1);
+    if(path_node == nullptr || path_node->dst.empty()){
 		// 路径完全一致
         return ALL_HOOK;
     }
 
-    if(all_breakpoint_map.empty() == true) {
+    if(ctx->all_breakpoint_map.empty() == true) {
         // 全局没有断点
         return LITE_HOOK;
     }
 
-    std::map<std::string, std::map<int, breakpoint> >::iterator iter1;
-    for (iter1 = all_breakpoint_map.begin(); iter1 != all_breakpoint_map.end(); ++iter1) {
-        if (iter1->first == std::string(src)) {
-            // compare()
-            return ALL_HOOK;
-        }
+    const file_breakpoint_index *file_index = get_file_breakpoint_index(ctx, path_node);
+    if (file_index != nullptr && file_index->has_line_in_range(sline, eline)) {
+        return ALL_HOOK;
     }
-    
-    //文件没有断点,MIDHOOK
+
+    //文件或函数中没有断点,MIDHOOK
     return MID_HOOK;
 }
 
-void check_hook_state(lua_State *L, const char* source ,  int current_line, int def_line, int last_line ,int event){
+void check_hook_state(debugger_context *ctx, lua_State *L, const char* source ,  int current_line, int def_line, int last_line ,int event){
     if (source == NULL) {
         return;
     }
-    if(cur_run_state == RUN && cur_hook_state != DISCONNECT_HOOK){
-        int stats = checkHasBreakpoint(L, source, current_line, def_line, last_line);
+    if(ctx->cur_run_state == RUN && ctx->cur_hook_state != DISCONNECT_HOOK){
+        int stats = checkHasBreakpoint(ctx, L, source, current_line, def_line, last_line);
         if(stats == LITE_HOOK){
-            sethookstate(L, LITE_HOOK);
+            sethookstate(ctx, L, LITE_HOOK);
         }else if(stats == MID_HOOK){
-            sethookstate(L, MID_HOOK);
+            sethookstate(ctx, L, MID_HOOK);
         }else if (stats == ALL_HOOK){
-            sethookstate(L, ALL_HOOK);
+            sethookstate(ctx, L, ALL_HOOK);
         }
 
-        if( (event == RETURN || event == TAILRET) && cur_hook_state == MID_HOOK){
-            sethookstate(L, ALL_HOOK);
+        if( (event == RETURN || event == TAILRET) && ctx->cur_hook_state == MID_HOOK){
+            sethookstate(ctx, L, ALL_HOOK);
         }
     }
 }
 
 //这个函数要获取的消息  当前状态，断点列表
+//每个事件开始时取一次上下文，之后作为参数传递
 void debug_hook_c(lua_State *L, lua_Debug *ar) {
+    debugger_context *ctx = find_context(L);
+    if (ctx == NULL) {
+        //虚拟机正在关闭，上下文已释放
+        lua_sethook(L, NULL, 0, 0);
+        return;
+    }
     debug_auto_stack _tt(L);
-    if(!hook_process_reconnect(L)) return;
-    if(cur_hook_state == LITE_HOOK) {
-        litehook_recv_message(L);
+    hook_stats_scope _hs(ctx, ar->event);
+    if (!enter_thread_state(ctx, L)) return;
+    int is_count_event = (ar->event == COUNT);
+    //采样、函数耗时、覆盖率和内存分配统计不依赖连接状态，未连接时也记录
+    if (!ctx->alloc_pending.empty()) {
+        alloc_resolve_pending(ctx, L);
+    }
+    alloc_suspend_scope _as(ctx);
+    if (is_count_event) {
+        if (ctx->profiler_mode != PROFILER_OFF) {
+            profiler_sample(ctx, L);
+        }
+    } else if (ar->event == LINE) {
+        if (ctx->coverage_enabled) {
+            coverage_record(ctx, L, ar);
+            //其他hook状态下的LINE事件只用于收集覆盖率
+            if (ctx->cur_hook_state != ALL_HOOK) return;
+        }
+    } else if (ctx->trace_enabled) {
+        trace_process_event(ctx, L, ar);
+    }
+    //调试已结束，除统计外只检查attach请求
+    if (ctx->hook_detached) {
+        attach_poll(ctx, L);
+        return;
+    }
+    if(!hook_process_reconnect(ctx, L, is_count_event)) return;
+    if(ctx->cur_hook_state == LITE_HOOK) {
+        litehook_recv_message(ctx, L, is_count_event);
         return;
     }
 
-    hook_process_recv_message(L);
+    hook_process_recv_message(ctx, L, is_count_event);
+    //count事件只用于定时接收消息
+    if (is_count_event) return;
 
     if (lua_getinfo(L, "Slf", ar) != 0) {
         //if in c function , return
-        if(!hook_process_cfunction(L, ar)) return;
+        if(!hook_process_cfunction(ctx, L, ar)) return;
         //if in debugger , return	
 		int source_len = strlen(ar->source);
-		if (debug_file_path_len == source_len) {
-			if (!strcmp(debug_file_path, ar->source))	return;
+		if (ctx->debug_file_path_len == source_len) {
+			if (!strcmp(ctx->debug_file_path, ar->source))	return;
 		}
-		if (tools_file_path_len == source_len) {
-			if (!strcmp(tools_file_path, ar->source))	return;
+		if (ctx->tools_file_path_len == source_len) {
+			if (!strcmp(ctx->tools_file_path, ar->source))	return;
 		}
 		//slua "temp buffer"
 		if (11 == source_len) {
@@ -835,50 +5723,426 @@ void debug_hook_c(lua_State *L, lua_Debug *ar) {
 		}
 
         //code section
-        if(!hook_process_code_section(L, ar)) return;
+        if(!hook_process_code_section(ctx, L, ar)) return;
 
         //output debug info
-        if (logLevel == 0) {
-            snprintf(hookLog, sizeof(hookLog), "[hook state] event:%d | source: %s | short_src: %s | line:%d | defined:%d | laseDefined:%d | currentState:%d | currentHookState:%d \n", ar->event, ar->source, ar->short_src, ar->currentline, ar->linedefined, ar->lastlinedefined, cur_run_state, cur_hook_state);
-            print_to_vscode(L, hookLog);
+        if (ctx->logLevel == 0) {
+            snprintf(ctx->hookLog, sizeof(ctx->hookLog), "[hook state] event:%d | source: %s | short_src: %s | line:%d | defined:%d | laseDefined:%d | currentState:%d | currentHookState:%d \n", ar->event, ar->source, ar->short_src, ar->currentline, ar->linedefined, ar->lastlinedefined, ctx->cur_run_state, ctx->cur_hook_state);
+            print_to_vscode(ctx, L, ctx->hookLog);
         }
 
         //hook_state
-        last_source = ar->source;
-        ar_def_line = ar->linedefined;
-        ar_lastdef_line = ar->lastlinedefined;
-        ar_current_line = ar->currentline;
+        ctx->last_source = ar->source;
+        ctx->ar_def_line = ar->linedefined;
+        ctx->ar_lastdef_line = ar->lastlinedefined;
+        ctx->ar_current_line = ar->currentline;
+        ctx->cur_thread_state->last_source = ar->source;
+        ctx->cur_thread_state->def_line = ar->linedefined;
+        ctx->cur_thread_state->lastdef_line = ar->lastlinedefined;
+        ctx->cur_thread_state->current_line = ar->currentline;
 
-        int is_hit = breakpoint_process(L, ar);  //断点命中标记位 //line + 预判
+        int is_hit = breakpoint_process(ctx, L, ar);  //断点命中标记位 //line + 预判
 
         //STOP_ON_ENTRY
         int stop_on_entry = 0;
-        if (cur_run_state == STOP_ON_ENTRY && is_hit != 1) {
+        if (ctx->cur_run_state == STOP_ON_ENTRY && is_hit != 1) {
             //STOP_ON_ENTRY
             if (ar->event == LINE) {
                 //命中
                 stop_on_entry = 1;
-                stackdeep_counter = 0;
-                call_lua_function(L, "SendMsgWithStack", 0,"stopOnEntry");
+                ctx->cur_thread_state->stackdeep_counter = 0;
+                call_lua_function(ctx, L, "SendMsgWithStack", 0,"stopOnEntry");
             }
         }
         if (is_hit == 1 || stop_on_entry == 1) {
             return;
         }
-        step_process(L, ar);
-        check_hook_state(L, last_source, ar_current_line,  ar_def_line, ar_lastdef_line, ar->event);
+        step_process(ctx, L, ar);
+        check_hook_state(ctx, L, ctx->last_source, ctx->ar_current_line,  ctx->ar_def_line, ctx->ar_lastdef_line, ar->event);
     }
 }
 
-//结束hook
+//结束调试会话，释放断点、回调、消息通道等调试用的数据
+//采样分析、函数耗时、覆盖率和内存分配统计不依赖连接，继续进行，由各自的stop接口或虚拟机关闭时结束
+void end_debug_session(debugger_context *ctx, lua_State *L) {
+    ctx->cur_hook_state = DISCONNECT_HOOK;
+    ctx->global_hook_state = DISCONNECT_HOOK;
+    clear_thread_states(ctx);
+    ctx->hook_detached = true;
+    ctx->global_hook_version++;
+    ctx->all_breakpoint_map.clear();
+    build_breakpoint_index(ctx);
+    release_condition_chunks(ctx, L);
+    clear_logpoint_buffer(ctx);
+    release_lua_callbacks(ctx, L);
+    transport_shutdown(ctx);
+    release_variable_cursors(ctx, L);
+    ctx->variable_ref_depth.clear();
+    pathcache_clear(ctx);
+}
+
+//结束hook。没有统计需要hook事件时移除hook，否则只保留统计需要的事件
 extern "C" int endHook(lua_State *L)
 {
-    cur_hook_state = DISCONNECT_HOOK;
-    lua_sethook(L, NULL, 0, 0);
-    all_breakpoint_map.clear();
+    debugger_context *ctx = get_context(L);
+    end_debug_session(ctx, L);
+    set_detached_hook(ctx, L);
+    return 0;
+}
+
+//------------后台attach------------
+//未连接调试器时不安装调试用的hook，由后台线程监听127.0.0.1上的端口。后台线程不访问lua_State，收到连接后只置位请求标记，
+//由虚拟机线程检查标记并发起attach:
+//  - 等待期间每个协程保留一个指令数较大的count hook，在debug_hook_c中检查标记。hook只能设置在单个协程上，
+//    请求到达时虚拟机可能正在任意协程中运行；新协程继承创建者的hook，因此主线程也需要保留
+//  - posix下另外向虚拟机线程发送信号，在信号处理函数中给主线程设置一次性count hook(lua.c处理SIGINT的方式)，主线程中可以立即响应
+//监听保存在上下文中，虚拟机关闭时随上下文释放
+const int attach_check_instructions = 100000;       //等待attach时在hook中检查请求的指令间隔
+#ifndef _WIN32
+const int attach_signal = SIGURG;                   //默认忽略的信号，未处理时不会终止进程
+const int attach_signal_slot_count = 16;            //可同时等待attach的虚拟机数量
+
+//信号处理函数中只访问这里的无锁原子变量
+struct attach_signal_slot {
+    std::atomic<bool> used;
+    std::atomic<lua_State*> pending;    //收到请求后等待设置hook的主线程
+    pthread_t thread;                   //调用attach_wait的虚拟机线程，设置pending之前写入
+};
+attach_signal_slot attach_signal_slots[attach_signal_slot_count];
+std::once_flag attach_signal_once;
+struct sigaction attach_signal_previous;
+#endif
+
+struct attach_listener {
+    std::thread thread;
+    std::atomic<bool> stop;
+    std::atomic<bool> armed;            //处于等待状态，收到请求时置位requested
+    std::atomic<bool> requested;        //收到attach请求，由虚拟机线程处理
+    lua_State *main_state;              //主线程，生命周期和虚拟机相同
+#ifndef _WIN32
+    int signal_slot;                    //attach_signal_slots中的位置，-1表示没有空位，只在hook中检查请求
+#endif
+
+    attach_listener() : stop(false), armed(false), requested(false), main_state(NULL) {
+#ifndef _WIN32
+        signal_slot = -1;
+#endif
+    }
+
+    ~attach_listener() {
+        stop.store(true);
+        if (thread.joinable()) {
+            thread.join();
+        }
+#ifndef _WIN32
+        if (signal_slot >= 0) {
+            attach_signal_slots[signal_slot].pending.store(NULL);
+            attach_signal_slots[signal_slot].used.store(false);
+        }
+#endif
+    }
+};
+
+void close_socket(transport_socket_t fd) {
+#ifdef _WIN32
+    closesocket(fd);
+#else
+    close(fd);
+#endif
+}
+
+//虚拟机线程中处理attach请求，恢复等待前的hook后回到lua中连接
+void attach_poll(debugger_context *ctx, lua_State *L) {
+    if (!ctx->attach_state || !ctx->attach_state->requested.load(std::memory_order_relaxed) || !ctx->attach_state->requested.exchange(false)) {
+        return;
+    }
+    call_lua_function(ctx, L, "attachNow", 0);
+}
+
+//等待attach或有未处理的请求时，hook中检查请求的指令间隔，0表示不需要
+int attach_check_count(debugger_context *ctx) {
+    if (!ctx->attach_state || (!ctx->attach_state->armed.load() && !ctx->attach_state->requested.load())) {
+        return 0;
+    }
+    return attach_check_instructions;
+}
+
+//一次性count hook，由信号处理函数在虚拟机线程中设置，替换了主线程原有的hook，先恢复再处理请求
+void attach_hook(lua_State *L, lua_Debug *ar) {
+    debugger_context *ctx = find_context(L);
+    if (ctx == NULL) {
+        lua_sethook(L, NULL, 0, 0);
+        return;
+    }
+    if (!ctx->hook_detached) {
+        sethookstate(ctx, L, ctx->global_hook_state);
+        return;
+    }
+    set_detached_hook(ctx, L);
+    attach_poll(ctx, L);
+}
+
+#ifndef _WIN32
+//在收到信号的线程中执行，只为该线程上等待的虚拟机设置hook。lua_sethook可以在信号处理函数中调用
+void attach_signal_handler(int sig, siginfo_t *info, void *uctx) {
+    int saved_errno = errno;
+    for (int i = 0; i < attach_signal_slot_count; i++) {
+        attach_signal_slot &slot = attach_signal_slots[i];
+        if (slot.pending.load() != NULL && pthread_equal(slot.thread, pthread_self())) {
+            lua_State *L = slot.pending.exchange(NULL);
+            if (L != NULL) {
+                lua_sethook(L, attach_hook, LUA_MASKCOUNT, 1);
+            }
+        }
+    }
+    //宿主程序原有的处理函数
+    if (attach_signal_previous.sa_flags & SA_SIGINFO) {
+        if (attach_signal_previous.sa_sigaction != NULL) {
+            attach_signal_previous.sa_sigaction(sig, info, uctx);
+        }
+    } else if (attach_signal_previous.sa_handler != SIG_DFL && attach_signal_previous.sa_handler != SIG_IGN) {
+        attach_signal_previous.sa_handler(sig);
+    }
+    errno = saved_errno;
+}
+
+void attach_install_signal_handler() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = attach_signal_handler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(attach_signal, &action, &attach_signal_previous);
+}
+
+int attach_alloc_signal_slot() {
+    std::call_once(attach_signal_once, attach_install_signal_handler);
+    for (int i = 0; i < attach_signal_slot_count; i++) {
+        if (!attach_signal_slots[i].used.exchange(true)) {
+            attach_signal_slots[i].pending.store(NULL);
+            return i;
+        }
+    }
+    return -1;
+}
+#endif
+
+void attach_thread_main(attach_listener *listener, transport_socket_t fd) {
+    while (!listener->stop.load()) {
+        fd_set read_set;
+        FD_ZERO(&read_set);
+        FD_SET(fd, &read_set);
+        struct timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = 50000;
+        int ret = select(static_cast<int>(fd + 1), &read_set, NULL, NULL, &tv);
+        if (ret <= 0) {
+            continue;
+        }
+        transport_socket_t client = accept(fd, NULL, NULL);
+        if (client == static_cast<transport_socket_t>(-1)) {
+            continue;
+        }
+        //连接只作为触发信号，不读取内容
+        close_socket(client);
+        if (listener->armed.exchange(false)) {
+            listener->requested.store(true);
+#ifndef _WIN32
+            if (listener->signal_slot >= 0) {
+                attach_signal_slot &slot = attach_signal_slots[listener->signal_slot];
+                slot.pending.store(listener->main_state);
+                pthread_kill(slot.thread, attach_signal);
+            }
+#endif
+        }
+    }
+    close_socket(fd);
+}
+
+//lua设置hook状态时调用，已经在调试中，不再响应请求
+void attach_disarm(debugger_context *ctx) {
+    if (ctx->attach_state) {
+        ctx->attach_state->armed.store(false);
+        ctx->attach_state->requested.store(false);
+#ifndef _WIN32
+        if (ctx->attach_state->signal_slot >= 0) {
+            attach_signal_slots[ctx->attach_state->signal_slot].pending.store(NULL);
+        }
+#endif
+    }
+}
+
+//lua调用，在127.0.0.1上监听attach请求。参数: 端口
+//返回: 1成功 / 0失败(端口被占用，或5.1中不是在主线程调用)
+extern "C" int attach_listen(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    int port = static_cast<int>(luaL_checkinteger(L, 1));
+#if LUA_VERSION_NUM == 501
+    //5.1无法取到主线程，要求在主线程中调用
+    if (lua_pushthread(L) != 1) {
+        lua_pop(L, 1);
+        lua_pushnumber(L, 0);
+        return 1;
+    }
+    lua_pop(L, 1);
+    lua_State *main_state = L;
+#else
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+    lua_State *main_state = lua_tothread(L, -1);
+    lua_pop(L, 1);
+#endif
+    ctx->attach_state.reset();
+    transport_socket_t fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == static_cast<transport_socket_t>(-1)) {
+        lua_pushnumber(L, 0);
+        return 1;
+    }
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<unsigned short>(port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, 4) != 0) {
+        close_socket(fd);
+        lua_pushnumber(L, 0);
+        return 1;
+    }
+    ctx->attach_state.reset(new attach_listener());
+    ctx->attach_state->main_state = main_state;
+#ifndef _WIN32
+    ctx->attach_state->signal_slot = attach_alloc_signal_slot();
+#endif
+    ctx->attach_state->thread = std::thread(attach_thread_main, ctx->attach_state.get(), fd);
+    lua_pushnumber(L, 1);
+    return 1;
+}
+
+//lua调用，停止监听。虚拟机关闭时会随上下文自动停止
+extern "C" int attach_unlisten(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    ctx->attach_state.reset();
+    return 0;
+}
+
+//lua调用，结束调试会话并进入等待状态，之后只保留统计需要的hook，直到收到attach请求
+extern "C" int attach_wait(lua_State *L) {
+    debugger_context *ctx = get_context(L);
+    end_debug_session(ctx, L);
+    if (ctx->attach_state) {
+#ifndef _WIN32
+        if (ctx->attach_state->signal_slot >= 0) {
+            attach_signal_slots[ctx->attach_state->signal_slot].thread = pthread_self();
+        }
+#endif
+        ctx->attach_state->requested.store(false);
+        ctx->attach_state->armed.store(true);
+    }
+    set_detached_hook(ctx, L);
+    return 0;
+}
+
+//------------上下文生命周期------------
+//上下文的指针保存在registry的userdata中，虚拟机关闭时由userdata的__gc释放。释放后userdata中的指针为NULL，之后的hook事件直接返回
+const char *context_registry_key = "LuaPanda_context";
+//每释放一个上下文递增。释放后新虚拟机可能复用相同的registry地址，各线程的缓存以此失效
+std::atomic<unsigned int> context_epoch(1);
+//每个线程缓存最近一次查询的虚拟机和上下文，命中时不需要在registry中查找
+//以registry表的地址区分虚拟机：同一虚拟机的协程共用registry，而协程被回收后地址可能被另一个虚拟机的协程复用，不能以lua_State区分
+struct context_cache {
+    const void *registry;
+    debugger_context *ctx;
+    unsigned int epoch;
+};
+static thread_local context_cache cached_context = { NULL, NULL, 0 };
+//无法创建userdata时(如slua-ue中未导出相应接口)，进程内共用一个上下文
+debugger_context *shared_context = NULL;
+
+int native_context_available() {
+#if !defined(USE_SOURCE_CODE) && defined(_WIN32)
+    return lua_newuserdata != NULL && lua_touserdata != NULL && lua_pushcclosure != NULL && lua_setfield != NULL &&
+           lua_setmetatable != NULL && lua_createtable != NULL && lua_topointer != NULL;
+#else
+    return 1;
+#endif
+}
+
+debugger_context *find_context(lua_State *L) {
+    if (!native_context_available()) {
+        return shared_context;
+    }
+    unsigned int epoch = context_epoch.load(std::memory_order_acquire);
+    const void *registry = lua_topointer(L, LUA_REGISTRYINDEX);
+    if (cached_context.registry == registry && cached_context.epoch == epoch) {
+        return cached_context.ctx;
+    }
+    lua_getfield(L, LUA_REGISTRYINDEX, context_registry_key);
+    debugger_context **slot = static_cast<debugger_context**>(lua_touserdata(L, -1));
+    debugger_context *ctx = slot != NULL ? *slot : NULL;
+    lua_pop(L, 1);
+    if (ctx != NULL) {
+        cached_context.registry = registry;
+        cached_context.ctx = ctx;
+        cached_context.epoch = epoch;
+    }
+    return ctx;
+}
+
+//停止上下文中的后台线程并释放。分配函数被其他代码包装过、无法还原时，包装的分配函数仍会调用alloc_profiler_alloc，此时保留上下文不释放
+void release_context(lua_State *L, debugger_context *ctx) {
+    ctx->attach_state.reset();
+    ctx->transport.reset();
+    ctx->profiler_timer_state.shutdown();
+    pathcache_clear(ctx);
+    if (ctx->heap_file != NULL) {
+        fclose(ctx->heap_file);
+        ctx->heap_file = NULL;
+    }
+    if (ctx->alloc_original_f != NULL) {
+        void *ud = NULL;
+        if (lua_getallocf(L, &ud) != alloc_profiler_alloc || ud != ctx) {
+            ctx->alloc_enabled = false;
+            return;
+        }
+        lua_setallocf(L, ctx->alloc_original_f, ctx->alloc_original_ud);
+    }
+    delete ctx;
+    context_epoch.fetch_add(1, std::memory_order_release);
+}
+
+//registry中userdata的__gc，虚拟机关闭时调用
+int context_gc(lua_State *L) {
+    debugger_context **slot = static_cast<debugger_context**>(lua_touserdata(L, 1));
+    if (slot != NULL && *slot != NULL) {
+        debugger_context *ctx = *slot;
+        *slot = NULL;
+        release_context(L, ctx);
+    }
     return 0;
 }
 
+debugger_context *get_context(lua_State *L) {
+    debugger_context *ctx = find_context(L);
+    if (ctx != NULL) {
+        return ctx;
+    }
+    if (!native_context_available()) {
+        shared_context = new debugger_context();
+        return shared_context;
+    }
+    debugger_context **slot = static_cast<debugger_context**>(lua_newuserdata(L, sizeof(debugger_context*)));
+    *slot = NULL;
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, context_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, context_registry_key);
+    ctx = new debugger_context();
+    *slot = ctx;
+    return ctx;
+}
+
 static luaL_Reg libpdebug[] = {
     { "sync_breakpoints", sync_breakpoints },     //lua同步断点给c，同步发生在新增、删除断点，连接开始时
     { "lua_set_hookstate", lua_set_hookstate },   //lua设置hook状态。lua中发生状态切换时，同步到C
@@ -895,8 +6159,53 @@ static luaL_Reg libpdebug[] = {
     { "get_libhook_state", get_libhook_state },
     { "get_last_source", get_last_source },
     { "clear_pathcache", clear_pathcache },
+    { "set_pathcache_capacity", set_pathcache_capacity },   //设置路径缓存容量
+    { "get_pathcache_stats", get_pathcache_stats },         //获取路径缓存命中统计
+    { "set_logpoint_config", set_logpoint_config },         //设置记录点限流和缓冲参数
+    { "set_poll_config", set_poll_config },                 //设置消息轮询间隔和count hook指令数
+    { "get_stack_table", get_stack_table },                 //获取调用栈信息
+    { "get_variables", get_variables },                     //展开变量
+    { "set_variable_config", set_variable_config },         //设置变量展开的限制
+    { "encode_json", encode_json },                         //把消息编码为json
+    { "decode_messages", decode_messages },                 //切分收到的消息并解码
+    { "base64_encode", base64_encode },                     //base64编码
+    { "base64_decode", base64_decode },                     //base64解码
+    { "profiler_start", profiler_start },                   //开始采样分析
+    { "profiler_stop", profiler_stop },                     //停止采样分析
+    { "profiler_dump", profiler_dump },                     //把采样结果写入临时文件目录
+    { "profiler_clear", profiler_clear },                   //清空采样结果
+    { "trace_start", trace_start },                         //开始统计函数耗时
+    { "trace_stop", trace_stop },                           //停止统计函数耗时
+    { "trace_clear", trace_clear },                         //清空函数耗时统计
+    { "get_trace_stats", get_trace_stats },                 //获取函数耗时统计
+    { "trace_dump", trace_dump },                           //把函数耗时统计写入临时文件目录
+    { "coverage_start", coverage_start },                   //开始收集覆盖率
+    { "coverage_stop", coverage_stop },                     //停止收集覆盖率
+    { "coverage_clear", coverage_clear },                   //清空覆盖率
+    { "coverage_dump", coverage_dump },                     //把覆盖率写入临时文件目录
+    { "alloc_profiler_start", alloc_profiler_start },       //开始统计内存分配
+    { "alloc_profiler_stop", alloc_profiler_stop },         //停止统计内存分配
+    { "alloc_profiler_clear", alloc_profiler_clear },       //清空内存分配统计
+    { "get_alloc_stats", get_alloc_stats },                 //获取各分配位置的统计
+    { "alloc_snapshot", alloc_snapshot },                   //记录内存分配快照
+    { "alloc_snapshot_diff", alloc_snapshot_diff },         //比较两个内存分配快照
+    { "heap_snapshot", heap_snapshot },                     //生成内存快照文件
+    { "heap_snapshot_diff", heap_snapshot_diff },           //比较两个内存快照文件
+    { "hook_stats_start", hook_stats_start },               //开始统计hook开销
+    { "hook_stats_stop", hook_stats_stop },                 //停止统计hook开销
+    { "get_hook_stats", get_hook_stats },                   //获取hook开销统计
+    { "attach_listen", attach_listen },                     //在本地端口监听attach请求
+    { "attach_unlisten", attach_unlisten },                 //停止监听attach请求
+    { "attach_wait", attach_wait },                         //结束hook，等待attach请求
+    { "transport_attach", transport_attach },               //启动原生消息通道，后台线程接收消息
+    { "transport_detach", transport_detach },               //停止原生消息通道
+    { "transport_receive", transport_receive },             //从原生消息通道取一条消息
     { "set_bp_twice_check_res", set_bp_twice_check_res },
     { "sync_lua_debugger_ver", sync_lua_debugger_ver },
+    { "rebind_callbacks", rebind_callbacks },               //LuaPanda中的方法被替换后重新绑定回调
+    { "get_callback_stats", get_callback_stats },           //获取lua回调调用统计
+    { "sync_distinguish_same_name_file", sync_distinguish_same_name_file },   //同步是否区分同名文件
+    { "sync_fake_breakpoint", sync_fake_breakpoint },                         //同步假断点信息
     { NULL, NULL }
 };
 
@@ -1059,18 +6368,53 @@ void general_find_function() {
     luaL_checknumber = (luaDLL_checknumber)GetProcAddress(hInstLibrary, "luaL_checknumber");
     lua_pushinteger = (luaDLL_pushinteger)GetProcAddress(hInstLibrary, "lua_pushinteger");
     lua_toboolean = (luaDLL_toboolean)GetProcAddress(hInstLibrary, "lua_toboolean");
+    lua_createtable = (luaDLL_createtable)GetProcAddress(hInstLibrary, "lua_createtable");
+    lua_pushvalue = (luaDLL_pushvalue)GetProcAddress(hInstLibrary, "lua_pushvalue");
+    lua_setfield = (luaDLL_setfield)GetProcAddress(hInstLibrary, "lua_setfield");
+    lua_setmetatable = (luaDLL_setmetatable)GetProcAddress(hInstLibrary, "lua_setmetatable");
+    lua_getstack = (luaDLL_getstack)GetProcAddress(hInstLibrary, "lua_getstack");
+    lua_getlocal = (luaDLL_getlocal)GetProcAddress(hInstLibrary, "lua_getlocal");
+    lua_getupvalue = (luaDLL_getupvalue)GetProcAddress(hInstLibrary, "lua_getupvalue");
+    lua_setupvalue = (luaDLL_setupvalue)GetProcAddress(hInstLibrary, "lua_setupvalue");
+    luaL_ref = (luaDLL_ref)GetProcAddress(hInstLibrary, "luaL_ref");
+    luaL_unref = (luaDLL_unref)GetProcAddress(hInstLibrary, "luaL_unref");
+    lua_topointer = (luaDLL_topointer)GetProcAddress(hInstLibrary, "lua_topointer");
+    lua_checkstack = (luaDLL_checkstack)GetProcAddress(hInstLibrary, "lua_checkstack");
+    lua_pushlstring = (luaDLL_pushlstring)GetProcAddress(hInstLibrary, "lua_pushlstring");
+    lua_pushboolean = (luaDLL_pushboolean)GetProcAddress(hInstLibrary, "lua_pushboolean");
+    lua_rawset = (luaDLL_rawset)GetProcAddress(hInstLibrary, "lua_rawset");
+    lua_rawseti = (luaDLL_rawseti)GetProcAddress(hInstLibrary, "lua_rawseti");
+    lua_getmetatable = (luaDLL_getmetatable)GetProcAddress(hInstLibrary, "lua_getmetatable");
+    lua_getallocf = (luaDLL_getallocf)GetProcAddress(hInstLibrary, "lua_getallocf");
+    lua_setallocf = (luaDLL_setallocf)GetProcAddress(hInstLibrary, "lua_setallocf");
+    lua_xmove = (luaDLL_xmove)GetProcAddress(hInstLibrary, "lua_xmove");
+    lua_tothread = (luaDLL_tothread)GetProcAddress(hInstLibrary, "lua_tothread");
+    lua_pushthread = (luaDLL_pushthread)GetProcAddress(hInstLibrary, "lua_pushthread");
+    lua_status = (luaDLL_status)GetProcAddress(hInstLibrary, "lua_status");
+    lua_newuserdata = (luaDLL_newuserdata)GetProcAddress(hInstLibrary, "lua_newuserdata");
+    lua_touserdata = (luaDLL_touserdata)GetProcAddress(hInstLibrary, "lua_touserdata");
+    lua_pushcclosure = (luaDLL_pushcclosure)GetProcAddress(hInstLibrary, "lua_pushcclosure");
+    lua_rawgeti = (luaDLL_rawgeti)GetProcAddress(hInstLibrary, "lua_rawgeti");
+#if LUA_VERSION_NUM == 501
+    luaL_loadbuffer = (luaDLL_loadbuffer)GetProcAddress(hInstLibrary, "luaL_loadbuffer");
+    lua_getfenv = (luaDLL_getfenv)GetProcAddress(hInstLibrary, "lua_getfenv");
+    lua_setfenv = (luaDLL_setfenv)GetProcAddress(hInstLibrary, "lua_setfenv");
+    lua_tonumber = (luaDLL_tonumber)GetProcAddress(hInstLibrary, "lua_tonumber");
+    lua_objlen = (luaDLL_objlen)GetProcAddress(hInstLibrary, "lua_objlen");
+#endif
     //5.3
 #if LUA_VERSION_NUM > 501
     lua_pcallk = (luaDLL_pcallk)GetProcAddress(hInstLibrary, "lua_pcallk");
     lua_tointegerx = (luaDLL_tointegerx)GetProcAddress(hInstLibrary, "lua_tointegerx");
-    lua_createtable = (luaDLL_createtable)GetProcAddress(hInstLibrary, "lua_createtable");
+    luaL_loadbufferx = (luaDLL_loadbufferx)GetProcAddress(hInstLibrary, "luaL_loadbufferx");
+    lua_tonumberx = (luaDLL_tonumberx)GetProcAddress(hInstLibrary, "lua_tonumberx");
+    lua_rawlen = (luaDLL_rawlen)GetProcAddress(hInstLibrary, "lua_rawlen");
     luaL_setfuncs = (luaDLL_setfuncs)GetProcAddress(hInstLibrary, "luaL_setfuncs");
     lua_getglobal = (luaDLL_getglobal)GetProcAddress(hInstLibrary, "lua_getglobal");
 #endif
 }
 
-void load(lua_State* L) {
-
+void find_lua_module() {
     HANDLE hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPMODULE, 0);
     if (INVALID_HANDLE_VALUE == hSnapshot)
     {
@@ -1104,4 +6448,11 @@ void load(lua_State* L) {
         bRet = Module32Next(hSnapshot, &mi);
     }
 }
+
+//多个虚拟机(可能在不同线程中)都会加载libpdebug，函数指针只查找一次
+std::once_flag load_once;
+
+void load(lua_State* L) {
+    std::call_once(load_once, find_lua_module);
+}
 #endif
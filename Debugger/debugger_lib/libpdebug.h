@@ -12,6 +12,7 @@
 //setting end
 
 #if !defined(USE_SOURCE_CODE) && defined(_WIN32)
+#include <winsock2.h>       //需在Windows.h之前引用
 #include <Windows.h>
 #include <Tlhelp32.h>
 #else
@@ -52,7 +53,15 @@ extern "C" void pdebug_init(lua_State* L);
 #define LUA_TUSERDATA        7
 #define LUA_TTHREAD        8
 #define LUA_NUMBER    double
+#if LUA_VERSION_NUM == 501
 #define LUA_REGISTRYINDEX    (-10000)
+#else
+#define LUA_REGISTRYINDEX    (-1000000 - 1000)
+#define LUA_RIDX_MAINTHREAD    1
+#define LUA_RIDX_GLOBALS    2
+#endif
+#define LUA_NOREF       (-2)
+#define LUA_REFNIL      (-1)
 #define LUA_ENVIRONINDEX    (-10001)
 #define LUA_GLOBALSINDEX    (-10002)
 #define lua_upvalueindex(i)    (LUA_GLOBALSINDEX-(i))
@@ -72,6 +81,7 @@ extern "C" void pdebug_init(lua_State* L);
 #define lua_isfunction(L,n)    (lua_type(L, (n)) == LUA_TFUNCTION)
 #define lua_pop(L,n)        lua_settop(L, -(n)-1)
 #define lua_newtable(L)        lua_createtable(L, 0, 0)
+#define lua_pushcfunction(L,f)    lua_pushcclosure(L, (f), 0)
 
 struct lua_State;
 struct lua_Debug {
@@ -133,6 +143,47 @@ typedef lua_Integer(*luaDLL_tointegerx)(lua_State *L, int idx, int *pisnum);
 typedef int (*luaDLL_getglobal)(lua_State *L, const char *name);
 typedef int (*luaDLL_pcallk)(lua_State *L, int nargs, int nresults, int msgh, lua_KContext ctx, lua_KFunction k);
 typedef int (*luaDLL_toboolean)(lua_State *L, int index);
+//条件断点等原生功能使用的接口
+typedef void (*luaDLL_pushvalue)(lua_State *L, int idx);
+typedef void (*luaDLL_setfield)(lua_State *L, int idx, const char *k);
+typedef int (*luaDLL_setmetatable)(lua_State *L, int objindex);
+typedef int (*luaDLL_getstack)(lua_State *L, int level, lua_Debug *ar);
+typedef const char *(*luaDLL_getlocal)(lua_State *L, const lua_Debug *ar, int n);
+typedef const char *(*luaDLL_getupvalue)(lua_State *L, int funcindex, int n);
+typedef const char *(*luaDLL_setupvalue)(lua_State *L, int funcindex, int n);
+typedef int (*luaDLL_ref)(lua_State *L, int t);
+typedef void (*luaDLL_unref)(lua_State *L, int t, int ref);
+typedef const void *(*luaDLL_topointer)(lua_State *L, int idx);
+typedef int (*luaDLL_checkstack)(lua_State *L, int n);
+typedef const char *(*luaDLL_pushlstring)(lua_State *L, const char *s, size_t len);
+typedef void (*luaDLL_pushboolean)(lua_State *L, int b);
+typedef void (*luaDLL_rawset)(lua_State *L, int idx);
+typedef int (*luaDLL_getmetatable)(lua_State *L, int objindex);
+typedef void *(*lua_Alloc)(void *ud, void *ptr, size_t osize, size_t nsize);
+typedef lua_Alloc (*luaDLL_getallocf)(lua_State *L, void **ud);
+typedef void (*luaDLL_setallocf)(lua_State *L, lua_Alloc f, void *ud);
+typedef void (*luaDLL_xmove)(lua_State *from, lua_State *to, int n);
+typedef lua_State *(*luaDLL_tothread)(lua_State *L, int idx);
+typedef int (*luaDLL_pushthread)(lua_State *L);
+typedef int (*luaDLL_status)(lua_State *L);
+typedef void *(*luaDLL_newuserdata)(lua_State *L, size_t sz);
+typedef void *(*luaDLL_touserdata)(lua_State *L, int idx);
+typedef void (*luaDLL_pushcclosure)(lua_State *L, lua_CFunction fn, int n);
+#if LUA_VERSION_NUM == 501
+typedef void (*luaDLL_rawgeti)(lua_State *L, int idx, int n);
+typedef void (*luaDLL_rawseti)(lua_State *L, int idx, int n);
+typedef int (*luaDLL_loadbuffer)(lua_State *L, const char *buff, size_t sz, const char *name);
+typedef void (*luaDLL_getfenv)(lua_State *L, int idx);
+typedef int (*luaDLL_setfenv)(lua_State *L, int idx);
+typedef lua_Number (*luaDLL_tonumber)(lua_State *L, int idx);
+typedef size_t (*luaDLL_objlen)(lua_State *L, int idx);
+#else
+typedef int (*luaDLL_rawgeti)(lua_State *L, int idx, lua_Integer n);
+typedef void (*luaDLL_rawseti)(lua_State *L, int idx, lua_Integer n);
+typedef int (*luaDLL_loadbufferx)(lua_State *L, const char *buff, size_t sz, const char *name, const char *mode);
+typedef lua_Number (*luaDLL_tonumberx)(lua_State *L, int idx, int *isnum);
+typedef size_t (*luaDLL_rawlen)(lua_State *L, int idx);
+#endif
 
 luaDLL_checkinteger luaL_checkinteger;
 luaDLL_version lua_version;
@@ -154,13 +205,52 @@ luaDLL_type lua_type;
 luaDLL_tolstring lua_tolstring;
 luaDLL_pushinteger lua_pushinteger;
 luaDLL_toboolean lua_toboolean;
+luaDLL_createtable lua_createtable;
+luaDLL_pushvalue lua_pushvalue;
+luaDLL_setfield lua_setfield;
+luaDLL_setmetatable lua_setmetatable;
+luaDLL_getstack lua_getstack;
+luaDLL_getlocal lua_getlocal;
+luaDLL_getupvalue lua_getupvalue;
+luaDLL_setupvalue lua_setupvalue;
+luaDLL_ref luaL_ref;
+luaDLL_unref luaL_unref;
+luaDLL_topointer lua_topointer;
+luaDLL_checkstack lua_checkstack;
+luaDLL_pushlstring lua_pushlstring;
+luaDLL_pushboolean lua_pushboolean;
+luaDLL_rawset lua_rawset;
+luaDLL_getmetatable lua_getmetatable;
+luaDLL_getallocf lua_getallocf;
+luaDLL_setallocf lua_setallocf;
+luaDLL_xmove lua_xmove;
+luaDLL_tothread lua_tothread;
+luaDLL_pushthread lua_pushthread;
+luaDLL_status lua_status;
+luaDLL_newuserdata lua_newuserdata;
+luaDLL_touserdata lua_touserdata;
+luaDLL_pushcclosure lua_pushcclosure;
+luaDLL_rawgeti lua_rawgeti;
+luaDLL_rawseti lua_rawseti;
+#if LUA_VERSION_NUM == 501
+luaDLL_loadbuffer luaL_loadbuffer;
+luaDLL_getfenv lua_getfenv;
+luaDLL_setfenv lua_setfenv;
+luaDLL_tonumber lua_tonumber;
+luaDLL_objlen lua_objlen;
+#else
+luaDLL_loadbufferx luaL_loadbufferx;
+#define luaL_loadbuffer(L,s,sz,n)    luaL_loadbufferx(L, (s), (sz), (n), NULL)
+luaDLL_tonumberx lua_tonumberx;
+#define lua_tonumber(L,i)    lua_tonumberx(L, (i), NULL)
+luaDLL_rawlen lua_rawlen;
+#endif
 //
 HMODULE hInstLibrary;
 
 //slua-ue header
 #if LUA_VERSION_NUM > 501
 //5.3
-luaDLL_createtable lua_createtable;
 luaDLL_setfuncs luaL_setfuncs;
 luaDLL_tointegerx lua_tointegerx;
 luaDLL_getglobal lua_getglobal;
@@ -0,0 +1,63 @@
+-- 后台attach测试：请求到达时虚拟机正在协程中运行，应在该协程中发起attach
+-- 用法: lua attach_coroutine.lua <libpdebug.so所在目录> [端口]
+-- 通过bash的/dev/tcp发起连接，需在Linux/macOS上运行
+local libDir = assert(arg[1], "usage: lua attach_coroutine.lua <libpdebug dir> [port]");
+local port = tonumber(arg[2]) or 18830;
+package.cpath = libDir .. "/?.so;" .. package.cpath;
+local hookLib = require("libpdebug");
+
+local attached = 0;
+local attachedIn = nil;
+-- hook库通过全局LuaPanda回调lua，这里只实现用到的方法
+LuaPanda = {};
+function LuaPanda.getPath(source) return source; end
+function LuaPanda.printToVSCode() end
+function LuaPanda.reConnect() return 0; end
+function LuaPanda.attachNow()
+    attached = attached + 1;
+    local _, isMain = coroutine.running();
+    attachedIn = isMain and "main" or "coroutine";
+end
+
+local function connect()
+    os.execute("bash -c 'exec 3<>/dev/tcp/127.0.0.1/" .. port .. "' 2>/dev/null");
+end
+
+local function spinUntilAttached(count)
+    local startTime = os.time();
+    while attached < count and os.time() - startTime < 3 do
+        local s = 0;
+        for i = 1, 1000 do s = s + i; end
+    end
+end
+
+local function check(name, count)
+    if attached ~= count or attachedIn ~= "coroutine" then
+        error(string.format("%s: attached=%d in %s", name, attached, tostring(attachedIn)));
+    end
+    print("ok - " .. name);
+end
+
+hookLib.sync_debugger_path("@LuaPanda.lua");
+hookLib.sync_tools_path("@DebugTools.lua");
+assert(hookLib.attach_listen(port) == 1, "attach_listen failed on port " .. port);
+
+-- 等待期间新建的协程
+hookLib.attach_wait();
+coroutine.wrap(function()
+    connect();
+    spinUntilAttached(1);
+end)();
+check("coroutine created while waiting", 1);
+
+-- 等待之前已经存在的协程。创建时处于未连接的hook状态，协程继承该hook
+hookLib.lua_set_hookstate(0);
+local co = coroutine.create(function()
+    coroutine.yield();
+    connect();
+    spinUntilAttached(2);
+end);
+coroutine.resume(co);
+hookLib.attach_wait();
+coroutine.resume(co);
+check("coroutine created before waiting", 2);
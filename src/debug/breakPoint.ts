@@ -3,7 +3,8 @@ import { DebugProtocol } from 'vscode-debugprotocol';
 enum BreakpointType {
     conditionBreakpoint = 0,
     logPoint,
-    lineBreakpoint
+    lineBreakpoint,
+    hitConditionBreakpoint
 }
 
 export class LineBreakpoint implements DebugProtocol.Breakpoint {
@@ -42,3 +43,18 @@ export class LogPoint implements DebugProtocol.Breakpoint, DebugProtocol.SourceB
         this.logMessage = logMessage;
     }
 }
+
+export class HitConditionBreakpoint implements DebugProtocol.Breakpoint, DebugProtocol.SourceBreakpoint {
+    verified: boolean;
+    type: BreakpointType;
+    line: number;
+    hitCondition: string;
+    condition?: string;
+    constructor(verified: boolean, line: number, hitCondition: string, condition: string | undefined, id: number) {
+        this.verified = verified;
+        this.type = BreakpointType.hitConditionBreakpoint;
+        this.line = line;
+        this.hitCondition = hitCondition;
+        this.condition = condition;
+    }
+}
@@ -17,7 +17,7 @@ import * as Net from 'net';
 import { DataProcessor } from './dataProcessor';
 import { DebugLogger } from '../common/logManager';
 import { StatusBarManager } from '../common/statusBarManager';
-import { LineBreakpoint, ConditionBreakpoint, LogPoint } from './breakPoint';
+import { LineBreakpoint, ConditionBreakpoint, LogPoint, HitConditionBreakpoint } from './breakPoint';
 import { Tools } from '../common/tools';
 import { UpdateManager } from './updateManager';
 import { ThreadManager } from '../common/threadManager';
@@ -503,7 +503,10 @@ export class LuaDebugSession extends LoggingDebugSession {
             const id = this._runtime.getBreakPointId()
 
             let breakpoint; // 取出args中的断点并判断类型。
-            if (bp.condition) {
+            if (bp.hitCondition && !bp.logMessage) {
+                breakpoint = new HitConditionBreakpoint(true, bp.line, bp.hitCondition, bp.condition, id);
+            }
+            else if (bp.condition) {
                 breakpoint = new ConditionBreakpoint(true, bp.line, bp.condition, id);
             }
             else if (bp.logMessage) {
@@ -725,19 +728,24 @@ export class LuaDebugSession extends LoggingDebugSession {
             }
             const variables = new Array<DebugProtocol.Variable>();
             info.forEach(element => {
-                variables.push({
+                let variable: DebugProtocol.Variable = {
                     name: element.name,
                     type: element.type,
                     value: element.value,
                     variablesReference: parseInt(element.variablesReference)
-                });
+                };
+                // 成员较多的table由VSCode分页请求
+                if (element.indexedVariables !== undefined) {
+                    variable.indexedVariables = parseInt(element.indexedVariables);
+                }
+                variables.push(variable);
             });
             arr[1].body = {
                 variables: variables
             };
             let ins = arr[0];
             ins.sendResponse(arr[1]);
-        }, callbackArgs, parseInt(referenceArray[0]) , parseInt(referenceArray[1]));
+        }, callbackArgs, parseInt(referenceArray[0]) , parseInt(referenceArray[1]), 'getVariable', args.filter, args.start, args.count);
     }
 
     /**
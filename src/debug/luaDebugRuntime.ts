@@ -145,11 +145,20 @@ export class LuaDebugRuntime extends EventEmitter {
      * @param frameId：当前栈层（变量的值会随切换栈层而改变）
      * @param event：事件名
      */
-    public getVariable(callback, callbackArgs ,  variableRef = 0, frameId = 2, event = 'getVariable') {
+    public getVariable(callback, callbackArgs ,  variableRef = 0, frameId = 2, event = 'getVariable', filter?: string, start?: number, count?: number) {
         DebugLogger.AdapterInfo("getVariable");
         let arrSend = new Object();
         arrSend["varRef"] = String(variableRef);
         arrSend["stackId"] = String(frameId);
+        // 分页展开大table(变量带有indexedVariables时VSCode会分页请求)
+        if (filter) {
+            arrSend["filter"] = filter;
+            arrSend["start"] = String(start || 0);
+            // count缺省或为0时表示展开start之后的全部成员
+            if (count > 0) {
+                arrSend["count"] = String(count);
+            }
+        }
         this._dataProcessor.commandToDebugger(event, arrSend, callback, callbackArgs, 3);
     }
 